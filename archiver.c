@@ -7,33 +7,103 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "buffio.h"
 #include "progbar.h"
 #include "queue.h"
-#include "buffio.h"
 #include "filetools.h"
+#include "catalog.h"
+#include "dedup.h"
+#include "lz.h"
+#include "fse.h"
+#include "cpu.h"
+#include "huff/histogram.h"
+#include "huff/context.h"
 #include "huff/tree/builder.h"
 #include "huff/tree/codes.h"
-
-uint8_t wordsize = 1;
-enum WarningAction compress_warn_act = WARN_ACT_ASK;
+#include "huff/tree/lengths.h"
+#include "huff/tree/table.h"
+
+#if STREAMS_INTERLEAVED != DECODE_STREAMS
+#error "Interleaved streams of blocks must be decoded together by DecodeTable_decode_streams"
+#endif
+
+// Archive signature, the last byte is the format version
+static const char archive_signature[4] = {'H', 'U', 'F', 17};
+
+// Codec of the file data, it is stored in the file trailer, files of solid blocks have no trailers
+// CODEC_HUFFMAN, CODEC_STORED, CODEC_LZ, CODEC_FSE and CODEC_CONTEXT are codecs of blocks of CODEC_BLOCKS file, they are stored in its block index
+enum FileCodec {
+    CODEC_HUFFMAN = 0, // Code lengths and codes
+    CODEC_STORED = 1,  // The file or the block as is, codes can't make it smaller
+    CODEC_SOLID = 2,   // Part of a solid block shared with other small files, it has only its catalog record
+    CODEC_CHUNKS = 3,  // List of chunks of deduplication stores
+    CODEC_LZ = 4,      // LZ77 sequences coded by Huffman codes of literals, lengths and distances
+    CODEC_FSE = 5,     // Normalized byte counts and a tANS stream
+    CODEC_CONTEXT = 6, // Code lengths chosen by the previous byte and codes
+    CODEC_BLOCKS = 7   // Independent blocks, every block has its own codec
+};
+
+// Block of CODEC_BLOCKS file or solid block
+typedef struct {
+    uint64_t offset; // From the file start in bytes
+    uint8_t codec;
+} FileBlock;
+
+// Files smaller than this are packed into solid blocks if solid_size is set
+#define SOLID_FILE_MAX (64 << 10)
+
+// A solid block is coded as one file without a header, the trailer follows its data:
+// uint64 compressed size in bits, uint64 original size, uint8 streams, uint8 codec, uint8 word size,
+// uint32 block size, then the block index of CODEC_BLOCKS: uint8 codec of every block, uint64 offsets of blocks after the first
+// Files of the block have no headers and trailers, their catalog records refer to the block trailer
+// The block is up to this size in bytes
+#define SOLID_SIZE_MAX (1 << 30)
+
+// Deduplication keeps new chunks of a file in a store of up to memory_limit bytes
+// A file without chunks stored before is written whole, its chunks are referred to by its header,
+// otherwise its stores are written as solid blocks and the trailer of a CODEC_CHUNKS file lists its chunks:
+// uint64 count, then uint64 store trailer or file header, uint32 offset, uint32 size of every chunk
+
+// State of one compression or decompression
+// Word size of decompression is read from the archive
+typedef struct {
+    ArchiverOptions opt;
+    ProgressBar progress;
+    Catalog* catalog; // Central directory, filled by headers of compression
+} Job;
 
 typedef struct {
-    int count;
-    int current;
     char* name;
     uint64_t size_original; // bytes
     uint64_t size_compressed; // bits
-    uint32_t treesize; // bits
-    uint64_t filestart;
-    FileBufferIO* fb;
+    uint64_t filestart; // bits
+    uint32_t block_size; // bytes, 0 - one block
+    uint8_t streams; // Code streams of every block
+    uint8_t codec;
+    uint8_t wordsize; // Size of words of Huffman codes in bytes
+    uint64_t blocks_count;
+    FileBlock* blocks; // block offsets from filestart in bytes and codecs
+    uint64_t solid_pos; // Trailer of the solid block of CODEC_SOLID file in bytes
+    uint64_t solid_offset; // Offset of CODEC_SOLID file in the decoded solid block
+    ChunkRef* chunks; // Chunks of CODEC_CHUNKS file
+    uint64_t chunks_count;
+    const Job* job;
 } HeaderFrame;
 
 // == Result structures ==
 typedef struct {
     uint64_t original; // bytes
     uint64_t compressed_bits; // bits
+    uint32_t block_size; // bytes, 0 - one block
+    uint8_t codec;
+    uint8_t wordsize; // Size of words of Huffman codes in bytes
+    FileBlock* blocks; // block offsets from the file start in bytes and codecs
+    const ChunkRef* chunks; // Chunks of CODEC_CHUNKS file with offsets of store trailers
+    uint64_t chunks_count;
 } FileSizeResult;
 
 typedef struct {
@@ -42,9 +112,12 @@ typedef struct {
     int count;
 } CompressingFilesResult;
 
-typedef struct {
+typedef struct CompressingFile {
     char* path;
-    long long size_pos;
+    char* name; // Path in the archive
+    uint64_t size; // bytes
+    struct CompressingFile** members; // Files of the solid block, NULL for a single file
+    uint32_t members_count;
 } CompressingFile;
 
 typedef struct {
@@ -55,152 +128,147 @@ typedef struct {
 
 // create a CompressingFile with the given parameters
 // !!! After use, run "CompressingFile_free" if non-null !!!
-CompressingFile* CompressingFile_create(char* path, long long size_pos) {
+CompressingFile* CompressingFile_create(char* path, char* name, uint64_t size) {
     CompressingFile* file = (CompressingFile*)malloc(sizeof(CompressingFile));
     if (!file) {
         return NULL;
     }
 
+    if (strncmp(name, "./", 2) == 0) {
+        name += 2;
+    }
+
     file->path = (char*)malloc(strlen(path)+1);
-    if (!file->path) {
+    file->name = (char*)malloc(strlen(name)+1);
+    if (!file->path || !file->name) {
+        free(file->path);
+        free(file->name);
         free(file);
         return NULL;
     }
     strcpy(file->path, path);
-    file->size_pos = size_pos;
+    strcpy(file->name, name);
+    file->size = size;
+    file->members = NULL;
+    file->members_count = 0;
 
     return file;
 }
 
 void CompressingFile_free(void* ptr) {
     CompressingFile* file = (CompressingFile*)ptr;
+    for (uint32_t i = 0; i < file->members_count; i++) {
+        CompressingFile_free(file->members[i]);
+    }
+    free(file->members);
     free(file->path);
+    free(file->name);
     free(file);
 }
 
-// == Reading and writing a huffman tree (prefix form) ==
-static size_t fwrite_tree(HuffmanNode* tree, FileBufferIO* stream_write) {
-    size_t tree_size = 0;
-    if (tree->left == NULL && tree->right == NULL) {
-        unsigned char state = 1;
-        tree_size += stream_write->writebits(stream_write, &state, 7, 1);
-        unsigned char lastword = (tree->wordsize != wordsize*8);
-        tree_size += stream_write->writebits(stream_write, &lastword, 7, 1);
-        if (lastword) {
-            tree_size += stream_write->writebytes(stream_write, &tree->wordsize, 0, sizeof(tree->wordsize));
-        }
-        tree_size += stream_write->writebits(stream_write, tree->word, 0, tree->wordsize);
-    } else {
-        unsigned char state = 0;
-        tree_size += stream_write->writebits(stream_write, &state, 7, 1);
-        tree_size += fwrite_tree(tree->left, stream_write);
-        tree_size += fwrite_tree(tree->right, stream_write);
-    }
-
-    return tree_size;
-}
-
-// Returns tree if successful, NULL if failed
-// !!! After use, run "HuffmanNode_freetree" if non-null !!!
-static HuffmanNode* fread_tree(FileBufferIO* stream_read, uint32_t treesize, unsigned int readed) {
-    if (readed > treesize) {
-        fprintf(stderr, "Corrupted huffman tree - out of bounds\n");
-        return NULL;
-    }
-
-    HuffmanNode* node = HuffmanNode_create(0, NULL, 0, NULL, NULL);
-    if (!node) {
-        fprintf(stderr, "Out of memory\n");
-        return NULL;
-    }
 
-    uint8_t state = 0;
-    if (stream_read->readbits(stream_read, &state, 7, 1) != 1) {
-        fprintf(stderr, "Corrupted huffman tree - EOF\n");
-        HuffmanNode_freetree(node);
-        return NULL;
-    }
 
-    if (state == 0) {
-        node->left = fread_tree(stream_read, treesize, readed+1);
-        if (!node->left) {
-            HuffmanNode_freetree(node);
-            return NULL;
-        }
-        
-        node->right = fread_tree(stream_read, treesize, readed+1);
-        if (!node->right) {
-            HuffmanNode_freetree(node);
-            return NULL;
-        }
-    } else {
-        uint8_t lastword = 0;
-        if (stream_read->readbits(stream_read, &lastword, 7, 1) != 1) {
-            fprintf(stderr, "Corrupted huffman tree - EOF\n");
-            HuffmanNode_freetree(node);
-            return NULL;
-        }
 
-        node->wordsize = wordsize*8;
-        if (lastword) {
-            if (!stream_read->readbytes(stream_read, &node->wordsize, 0, sizeof(node->wordsize))) {
-                fprintf(stderr, "Corrupted huffman tree - EOF\n");
-                HuffmanNode_freetree(node);
-                return NULL;
-            }
-        }
+// == Writing headers ============================
+// Size of independently coded blocks of the file, 0 - one block
+// Every block is read to memory once, so files over the memory limit are split into blocks of the limit
+static uint32_t get_block_size(const Job* job, uint64_t filesize) {
+    if (job->opt.block_size != 0) return job->opt.block_size;
+    if (filesize <= job->opt.memory_limit) return 0;
+    return job->opt.memory_limit;
+}
 
-        node->word = (uint8_t*)calloc(wordsize, 1);
-        if (!node->word) {
-            fprintf(stderr, "Out of memory\n");
-            HuffmanNode_freetree(node);
-            return NULL;
-        }
+// Files smaller than this are coded by one stream, setting up interleaved streams costs more than they save
+#define STREAMS_MIN_SIZE (16 << 10)
 
-        if (!stream_read->readbits(stream_read, node->word, 0, node->wordsize)) {
-            fprintf(stderr, "Corrupted huffman tree - EOF\n");
-            HuffmanNode_freetree(node);
-            return NULL;
-        }
-    }
+// Number of code streams of every block of the file
+static uint8_t get_streams(const Job* job, uint64_t filesize) {
+    if (filesize < STREAMS_MIN_SIZE) return 1;
+    return job->opt.streams;
+}
 
-    return node;
+// Number of independently coded blocks of the file
+static uint64_t get_blocks_count(uint32_t block_size, uint64_t filesize) {
+    if (filesize == 0) return 0;
+    if (block_size == 0) return 1;
+    return (filesize + block_size - 1) / block_size;
 }
-// == Reading and writing a huffman tree (prefix form) ==
 
+// Threads compress and decompress a file of several blocks by parts of consecutive blocks of at least this size in bytes,
+// so one large file is shared by all threads
+#define BLOCK_PART_MIN (1 << 20)
 
+// Number of blocks of every part of the file but the last one
+static uint64_t get_part_blocks(uint32_t block_size) {
+    if (block_size == 0 || block_size >= BLOCK_PART_MIN) return 1;
+    return BLOCK_PART_MIN / block_size;
+}
 
-// == Writing headers ============================
-static long prepare_fileheader(FileBufferIO* archive, char* filepath, char* path_in_archive) {
-    if (strncmp(path_in_archive, "./", 2) == 0) {
-        path_in_archive += 2;
+// Writes the header of the file, the compressed file follows it
+// Returns the position of the header in bytes, -1 if failed
+static long long write_fileheader(const Job* job, FileBufferIO* archive, const CompressingFile* compr_file) {
+    long long header_pos = tellbits(archive);
+    if (header_pos < 0) {
+        fprintf(stderr, "Getting file position error\n");
+        return -1;
     }
 
-    uint32_t filename_len = strlen(path_in_archive)+1;
-    uint64_t compressed_filesize = 0;
-    uint32_t compressed_treesize = 0;
-    uint64_t filestart = 0;
-
-    uint64_t original_filesize = get_filesize(filepath);
-    archive->writebytes(archive, &original_filesize, 0, sizeof(original_filesize));
+    uint32_t block_size = get_block_size(job, compr_file->size);
+    uint8_t streams = get_streams(job, compr_file->size);
+    uint32_t filename_len = strlen(compr_file->name)+1;
+    archive->writebytes(archive, &compr_file->size, 0, sizeof(compr_file->size));
+    archive->writebytes(archive, &block_size, 0, sizeof(block_size));
+    archive->writebytes(archive, &streams, 0, sizeof(streams));
     archive->writebytes(archive, &filename_len, 0, sizeof(filename_len));
-    archive->writebytes(archive, path_in_archive, 0, filename_len);
+    archive->writebytes(archive, compr_file->name, 0, filename_len);
+
+    return header_pos / 8;
+}
+
+// Writes codecs of blocks and offsets of blocks after the first of CODEC_BLOCKS file
+static void write_block_index(FileBufferIO* archive, const FileSizeResult* filesize) {
+    if (filesize->codec != CODEC_BLOCKS) {
+        return;
+    }
+    uint64_t blocks_count = get_blocks_count(filesize->block_size, filesize->original);
+    for (uint64_t i = 0; i < blocks_count; i++) {
+        archive->writebytes(archive, &filesize->blocks[i].codec, 0, sizeof(filesize->blocks[i].codec));
+    }
+    // The first block always starts at filestart
+    for (uint64_t i = 1; i < blocks_count; i++) {
+        archive->writebytes(archive, &filesize->blocks[i].offset, 0, sizeof(filesize->blocks[i].offset));
+    }
+}
 
-    long size_pos = ftell(archive->fp);
-    if (size_pos == -1) return -1;
-    size_pos = (size_pos + archive->byte_p) + 1;
+// Writes the compressed size, the codec, the word size and the block index after the compressed file and adds the file to the central directory
+// Sizes and the codec follow the data, so the archive is written without seeking back
+// Returns 0 if success, else 1
+static int write_filetrailer(const Job* job, FileBufferIO* archive, const CompressingFile* compr_file, long long header_pos, const FileSizeResult* filesize) {
+    archive->writebytes(archive, &filesize->compressed_bits, 0, sizeof(filesize->compressed_bits));
+    archive->writebytes(archive, &filesize->codec, 0, sizeof(filesize->codec));
+
+    if (filesize->codec == CODEC_CHUNKS) {
+        archive->writebytes(archive, &filesize->chunks_count, 0, sizeof(filesize->chunks_count));
+        for (uint64_t i = 0; i < filesize->chunks_count; i++) {
+            archive->writebytes(archive, &filesize->chunks[i].store, 0, sizeof(filesize->chunks[i].store));
+            archive->writebytes(archive, &filesize->chunks[i].offset, 0, sizeof(filesize->chunks[i].offset));
+            archive->writebytes(archive, &filesize->chunks[i].size, 0, sizeof(filesize->chunks[i].size));
+        }
+        return Catalog_add(job->catalog, compr_file->name, header_pos, filesize->original, filesize->compressed_bits);
+    }
 
-    archive->writebytes(archive, &compressed_filesize, 0, sizeof(compressed_filesize));
-    archive->writebytes(archive, &compressed_treesize, 0, sizeof(compressed_treesize));
-    archive->writebytes(archive, &filestart, 0, sizeof(filestart));
+    // Files of solid blocks and split files are decoded by words of their blocks
+    archive->writebytes(archive, &filesize->wordsize, 0, sizeof(filesize->wordsize));
+    write_block_index(archive, filesize);
 
-    return size_pos;
+    return Catalog_add(job->catalog, compr_file->name, header_pos, filesize->original, filesize->compressed_bits);
 }
 
 
+// Collects regular files to compress
 // startpath - file or dir, which need to compress
 // addpath - if startpath if folder, when addpath stores subdirs of start folder
-static PreparedFilesResult prepare_headers(FileBufferIO* archive, Queue* queue, char* startpath, char* addpath) {
+static PreparedFilesResult collect_files(const Job* job, FileBufferIO* archive, Queue* queue, char* startpath, char* addpath) {
     char* path = (char*)malloc(strlen(startpath) + strlen(addpath) + 1);
     if (!path) {
         fprintf(stderr, "Out of memory\n");
@@ -227,37 +295,8 @@ static PreparedFilesResult prepare_headers(FileBufferIO* archive, Queue* queue,
     if (S_ISREG(file_stat.st_mode)) {
         size_t filesize = get_filesize(path);
 
-        // Here is warning if file is too small
-        if (compress_warn_act != WARN_ACT_DECLINE) {
-            if (filesize < 512) {
-                if (compress_warn_act == WARN_ACT_ACCEPT) {
-                    free(path);
-                    return (PreparedFilesResult){0, 0};
-                }
-
-                printf("WARNING \"%s\" (%ld bytes)\n", get_filename(path), filesize);
-                printf("File too small (<512 bytes), it may be bigger after compressing\n");
-                printf("Skip this file? (y/default n) ");
-
-                char c = getchar();
-                if (c == 'y' || c == 'Y') {
-                    while ((c = getchar()) != '\n' && c != EOF);
-                    free(path);
-                    return (PreparedFilesResult){0, 0};
-                } else if (c != '\n') {
-                    while ((c = getchar()) != '\n' && c != EOF);
-                }
-            }
-        }
-
         if (strlen(addpath) == 0) { // If just compressing file
-            long size_pos = prepare_fileheader(archive, path, get_filename(startpath));
-            if (size_pos == -1) {
-                free(path);
-                fprintf(stderr, "Getting file position error\n");
-                return (PreparedFilesResult){-1, 0};
-            }
-            CompressingFile* compr_file = CompressingFile_create(path, size_pos);
+            CompressingFile* compr_file = CompressingFile_create(path, get_filename(startpath), filesize);
             if (!compr_file) {
                 free(path);
                 fprintf(stderr, "Out of memory\n");
@@ -279,14 +318,8 @@ static PreparedFilesResult prepare_headers(FileBufferIO* archive, Queue* queue,
             }
             strcpy(filepath, rootdir);
             strcat(filepath, addpath);
-            long size_pos = prepare_fileheader(archive, path, filepath);
+            CompressingFile* compr_file = CompressingFile_create(path, filepath, filesize);
             free(filepath);
-            if (size_pos == -1) {
-                free(path);
-                fprintf(stderr, "Getting file position error\n");
-                return (PreparedFilesResult){-1, 0};
-            }
-            CompressingFile* compr_file = CompressingFile_create(path, size_pos);
             if (!compr_file) {
                 free(path);
                 fprintf(stderr, "Out of memory\n");
@@ -304,7 +337,6 @@ static PreparedFilesResult prepare_headers(FileBufferIO* archive, Queue* queue,
     }
 
     if (!S_ISDIR(file_stat.st_mode)) {
-        pg_end();
         fprintf(stderr, "Unsupported file \"%s\"\n", path);
         free(path);
         return (PreparedFilesResult){0, 0};
@@ -332,7 +364,7 @@ static PreparedFilesResult prepare_headers(FileBufferIO* archive, Queue* queue,
         char* new_addpath = (char*)malloc(strlen(addpath) + strlen(entry->d_name) + 2);
         sprintf(new_addpath, "%s/%s", addpath, entry->d_name);
 
-        PreparedFilesResult temp = prepare_headers(archive, queue, startpath, new_addpath);
+        PreparedFilesResult temp = collect_files(job, archive, queue, startpath, new_addpath);
         files.added += temp.added;
         files.filesize += temp.filesize;
 
@@ -345,30 +377,18 @@ static PreparedFilesResult prepare_headers(FileBufferIO* archive, Queue* queue,
     return files;
 }
 
-static void fwrite_compressed_filesize(FileBufferIO* archive, long size_pos, uint64_t filesize, uint32_t treesize, uint64_t filestart) {
-    writebuffer(archive);
-    long original_pos = ftell(archive->fp);
-    fseek(archive->fp, size_pos, SEEK_SET);
-    archive->writebytes(archive, &filesize, 0, sizeof(filesize));
-    archive->writebytes(archive, &treesize, 0, sizeof(treesize));
-    archive->writebytes(archive, &filestart, 0, sizeof(filestart));
-    writebuffer(archive);
-    fseek(archive->fp, original_pos, SEEK_SET);
-}
-
-// Reserves space for headers at the beginning of the archive
-// Returns a list of files and pointers for compression and header filling
-static CompressingFilesResult prepare_archive(FileBufferIO* archive, int paths_c, char** paths) {
+// Writes the archive header
+// Returns a list of files for compression
+static CompressingFilesResult prepare_archive(const Job* job, FileBufferIO* archive, int paths_c, char** paths) {
     CompressingFilesResult compr_files;
     
     compr_files.files = queue_create();
     compr_files.count = 0;
     compr_files.total_size = 0;
-    archive->writebytes(archive, &compr_files.count, 0, sizeof(compr_files.count));
-    archive->writebytes(archive, &wordsize, 0, sizeof(wordsize));
+    archive->writebytes(archive, archive_signature, 0, sizeof(archive_signature));
 
     for (int i = 0; i < paths_c; i++) {
-        PreparedFilesResult temp = prepare_headers(archive, compr_files.files, paths[i], "");
+        PreparedFilesResult temp = collect_files(job, archive, compr_files.files, paths[i], "");
         if (temp.added == -1) {
             queue_destroy(&compr_files.files, CompressingFile_free);
             compr_files.count = 0;
@@ -377,614 +397,3375 @@ static CompressingFilesResult prepare_archive(FileBufferIO* archive, int paths_c
         compr_files.count += temp.added;
         compr_files.total_size += temp.filesize;
     }
-    writebuffer(archive);
 
-    // Updating the number of files
-    long original_pos = ftell(archive->fp);
-    if (original_pos == -1) {
-        fprintf(stderr, "Getting file position error\n");
-        queue_destroy(&compr_files.files, CompressingFile_free);
-        compr_files.count = 0;
-        return compr_files;
+    return compr_files;
+}
+
+// Returns the extension of the file name without the dot, "" if there is none
+static const char* get_extension(const char* name) {
+    const char* filename = strrchr(name, '/');
+    filename = filename ? filename + 1 : name;
+    const char* dot = strrchr(filename, '.');
+    return dot && dot != filename ? dot + 1 : "";
+}
+
+static int compare_extensions(const void* a, const void* b) {
+    const CompressingFile* fa = *(CompressingFile* const*)a;
+    const CompressingFile* fb = *(CompressingFile* const*)b;
+    int cmp = strcmp(get_extension(fa->name), get_extension(fb->name));
+    return cmp != 0 ? cmp : strcmp(fa->name, fb->name);
+}
+
+// Packs files of the list smaller than SOLID_FILE_MAX into solid blocks of up to solid_size bytes
+// Solid blocks follow other files, their files keep the order of the list or are ordered by extension
+// Sets count of the list to the number of single files and solid blocks
+// Returns 0 if success, else 1
+static int group_solid(const Job* job, CompressingFilesResult* compr_files) {
+    CompressingFile** small = (CompressingFile**)malloc(((size_t)compr_files->count+1) * sizeof(CompressingFile*));
+    Queue* files = queue_create();
+    if (!small || !files) {
+        fprintf(stderr, "Out of memory\n");
+        free(small);
+        if (files) queue_destroy(&files, CompressingFile_free);
+        return 1;
     }
-    
-    if (fseek(archive->fp, 0, SEEK_SET) != 0) {
-        fprintf(stderr, "Fseek error\n");
-        queue_destroy(&compr_files.files, CompressingFile_free);
-        compr_files.count = 0;
-        return compr_files;
+
+    int small_count = 0;
+    int count = 0;
+    CompressingFile* compr_file = NULL;
+    while ((compr_file = (CompressingFile*)queue_dequeue(compr_files->files)) != NULL) {
+        if (compr_file->size > 0 && compr_file->size < SOLID_FILE_MAX && compr_file->size <= job->opt.solid_size) {
+            small[small_count++] = compr_file;
+        } else if (queue_enqueue(files, compr_file) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            CompressingFile_free(compr_file);
+            break;
+        } else {
+            count++;
+        }
     }
+    queue_destroy(&compr_files->files, CompressingFile_free);
+    compr_files->files = files;
 
-    writebuffer(archive);
-    archive->writebytes(archive, &compr_files.count, 0, sizeof(compr_files.count));
-    writebuffer(archive);
+    // Similar files get into the same blocks and share codes
+    if (job->opt.solid_by_ext) {
+        qsort(small, small_count, sizeof(CompressingFile*), compare_extensions);
+    }
 
-    if (fseek(archive->fp, original_pos, SEEK_SET) != 0) {
-        fprintf(stderr, "Fseek error\n");
-        queue_destroy(&compr_files.files, CompressingFile_free);
-        compr_files.count = 0;
-        return compr_files;
+    int status = compr_file ? 1 : 0;
+    int first = 0;
+    while (first < small_count && status == 0) {
+        uint64_t size = small[first]->size;
+        int end = first + 1;
+        while (end < small_count && size + small[end]->size <= job->opt.solid_size) {
+            size += small[end++]->size;
+        }
+
+        // A block of one file saves nothing
+        CompressingFile* unit = small[first];
+        if (end - first > 1) {
+            unit = CompressingFile_create(small[first]->path, "", size);
+            if (unit) unit->members = (CompressingFile**)malloc((end - first) * sizeof(CompressingFile*));
+            if (!unit || !unit->members) {
+                fprintf(stderr, "Out of memory\n");
+                if (unit) CompressingFile_free(unit);
+                status = 1;
+                break;
+            }
+            memcpy(unit->members, small + first, (end - first) * sizeof(CompressingFile*));
+            unit->members_count = end - first;
+        }
+        first = end;
+
+        if (queue_enqueue(files, unit) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            CompressingFile_free(unit);
+            status = 1;
+            break;
+        }
+        count++;
     }
 
-    return compr_files;
+    // Files not passed to the list
+    for (int i = first; i < small_count; i++) {
+        CompressingFile_free(small[i]);
+    }
+    free(small);
+    compr_files->count = count;
+    return status;
+}
+
+// Writes the trailer of the solid block after its data
+// Returns the position of the trailer in bytes, -1 if failed
+static long long write_solid_trailer(const Job* job, FileBufferIO* archive, const FileSizeResult* filesize) {
+    long long solid_pos = tellbits(archive);
+    if (solid_pos < 0 || solid_pos % 8 != 0) {
+        fprintf(stderr, "Getting file position error\n");
+        return -1;
+    }
+
+    uint8_t streams = get_streams(job, filesize->original);
+    archive->writebytes(archive, &filesize->compressed_bits, 0, sizeof(filesize->compressed_bits));
+    archive->writebytes(archive, &filesize->original, 0, sizeof(filesize->original));
+    archive->writebytes(archive, &streams, 0, sizeof(streams));
+    archive->writebytes(archive, &filesize->codec, 0, sizeof(filesize->codec));
+    archive->writebytes(archive, &filesize->wordsize, 0, sizeof(filesize->wordsize));
+    archive->writebytes(archive, &filesize->block_size, 0, sizeof(filesize->block_size));
+    write_block_index(archive, filesize);
+    return solid_pos / 8;
+}
+
+// Writes the trailer of the solid block after its data and adds its files referring to it to the central directory
+// Files of the block are written only by their records, so every name is stored once
+// Returns 0 if success, else 1
+static int write_solid(const Job* job, FileBufferIO* archive, const CompressingFile* solid, const FileSizeResult* filesize) {
+    long long solid_pos = write_solid_trailer(job, archive, filesize);
+    if (solid_pos < 0) {
+        return 1;
+    }
+
+    uint64_t solid_offset = 0;
+    for (uint32_t i = 0; i < solid->members_count; i++) {
+        const CompressingFile* member = solid->members[i];
+        if (Catalog_add_member(job->catalog, member->name, solid_pos, member->size, solid_offset) != 0) {
+            return 1;
+        }
+        solid_offset += member->size;
+    }
+
+    return 0;
 }
 // == Writing headers ============================
 
 
 // == HeaderFrame ================================
+// Reads the signature of the archive
+// Returns 0 if success, else 1
+static int read_archive_header(FileBufferIO* archive) {
+    char signature[sizeof(archive_signature)] = {0};
+    if (!archive->readbytes(archive, signature, 0, sizeof(signature))) {
+        fprintf(stderr, "Corrupted file: EOF while reading headers\n");
+        return 1;
+    }
+
+    if (memcmp(signature, archive_signature, sizeof(signature)) != 0) {
+        fprintf(stderr, "Unsupported archive format\n");
+        return 1;
+    }
+
+    return 0;
+}
+
 static void end_header_frame(HeaderFrame* header_frame) {
     free(header_frame->name);
-    header_frame->current = header_frame->count;
+    header_frame->name = NULL;
+    free(header_frame->blocks);
+    header_frame->blocks = NULL;
+    free(header_frame->chunks);
+    header_frame->chunks = NULL;
 }
 
-static HeaderFrame get_header_frame(FileBufferIO* archive, int count) {
-    HeaderFrame header_frame;
-    header_frame.fb = archive;
-    header_frame.count = count;
-    header_frame.current = 1;
-    header_frame.filestart = 0;
-    header_frame.size_compressed = 0;
-    header_frame.size_original = 0;
-    header_frame.treesize = 0;
-
-    if (!archive->readbytes(archive, &header_frame.size_original, 0, sizeof(header_frame.size_original))) {
+// Reads the chunk list of CODEC_CHUNKS file, chunks must fill the file
+// Returns 0 if success, else 1
+static int read_chunks(FileBufferIO* archive, HeaderFrame* header_frame) {
+    uint64_t count = 0;
+    if (!archive->readbytes(archive, &count, 0, sizeof(count))) {
         fprintf(stderr, "EOF while reading headers\n");
-        header_frame.count = -1;
-        return header_frame;
+        return 1;
+    }
+    if (header_frame->size_compressed != 0 || count > header_frame->size_original) {
+        fprintf(stderr, "Corrupted file: invalid chunk list\n");
+        return 1;
     }
 
-    int filename_len = 0;
-    if (!archive->readbytes(archive, &filename_len, 0, sizeof(filename_len))) {
-        fprintf(stderr, "EOF while reading headers\n");
-        header_frame.count = -1;
-        return header_frame;
+    // The list grows while it is read, so a corrupted count can't take much memory
+    uint64_t capacity = 0;
+    uint64_t size = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (i == capacity) {
+            capacity = capacity ? capacity*2 : 64;
+            ChunkRef* chunks = (ChunkRef*)realloc(header_frame->chunks, capacity * sizeof(ChunkRef));
+            if (!chunks) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            header_frame->chunks = chunks;
+        }
+
+        ChunkRef* chunk = &header_frame->chunks[i];
+        if (!archive->readbytes(archive, &chunk->store, 0, sizeof(chunk->store))
+            || !archive->readbytes(archive, &chunk->offset, 0, sizeof(chunk->offset))
+            || !archive->readbytes(archive, &chunk->size, 0, sizeof(chunk->size))) {
+            fprintf(stderr, "EOF while reading headers\n");
+            return 1;
+        }
+        header_frame->chunks_count = i + 1;
+
+        // Stores are written before files referring to them
+        if (chunk->size == 0 || chunk->size > header_frame->size_original - size || chunk->store >= header_frame->filestart / 8) {
+            fprintf(stderr, "Corrupted file: invalid chunk list\n");
+            return 1;
+        }
+        size += chunk->size;
+    }
+
+    if (size != header_frame->size_original) {
+        fprintf(stderr, "Corrupted file: invalid chunk list\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Reads codecs of blocks and offsets of blocks after the first, sizes, the codec and the block size of the header frame must be read
+// A stored file has no block index, its blocks are stored
+// Returns 0 if success, else 1
+static int read_block_index(FileBufferIO* archive, HeaderFrame* header_frame) {
+    header_frame->blocks_count = get_blocks_count(header_frame->block_size, header_frame->size_original);
+    if (header_frame->blocks_count == 0) {
+        return 0;
+    }
+    // Every block takes at least one byte
+    if (header_frame->blocks_count > (header_frame->size_compressed + 7) / 8) {
+        fprintf(stderr, "Corrupted file: invalid block size\n");
+        return 1;
     }
 
-    header_frame.name = (char*)malloc(filename_len);
-    if (!header_frame.name) {
+    header_frame->blocks = (FileBlock*)calloc(header_frame->blocks_count, sizeof(FileBlock));
+    if (!header_frame->blocks) {
         fprintf(stderr, "Out of memory\n");
-        header_frame.count = -1;
-        return header_frame;
+        return 1;
+    }
+    if (header_frame->codec == CODEC_STORED) {
+        for (uint64_t i = 0; i < header_frame->blocks_count; i++) {
+            header_frame->blocks[i].offset = i * header_frame->block_size;
+            header_frame->blocks[i].codec = CODEC_STORED;
+        }
+        return 0;
     }
 
-    if (!archive->readbytes(archive, header_frame.name, 0, filename_len)) {
-        fprintf(stderr, "EOF while reading headers\n");
-        end_header_frame(&header_frame);
-        header_frame.count = -1;
-        return header_frame;
+    for (uint64_t i = 0; i < header_frame->blocks_count; i++) {
+        uint8_t* codec = &header_frame->blocks[i].codec;
+        if (!archive->readbytes(archive, codec, 0, sizeof(*codec))) {
+            fprintf(stderr, "EOF while reading headers\n");
+            return 1;
+        }
+        if (*codec != CODEC_HUFFMAN && *codec != CODEC_STORED && *codec != CODEC_LZ && *codec != CODEC_FSE && *codec != CODEC_CONTEXT) {
+            fprintf(stderr, "Corrupted file: unknown codec\n");
+            return 1;
+        }
+    }
+    for (uint64_t i = 1; i < header_frame->blocks_count; i++) {
+        if (!archive->readbytes(archive, &header_frame->blocks[i].offset, 0, sizeof(header_frame->blocks[i].offset))) {
+            fprintf(stderr, "EOF while reading headers\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Reads the compressed size, the codec, the word size and the block index after the compressed file
+// Returns 0 if success, else 1
+static int read_file_trailer(FileBufferIO* archive, HeaderFrame* header_frame) {
+    if (seekbits(archive, header_frame->filestart + (header_frame->size_compressed + 7) / 8 * 8) != 0) {
+        fprintf(stderr, "Fseek error\n");
+        return 1;
     }
-    if (!archive->readbytes(archive, &header_frame.size_compressed, 0, sizeof(header_frame.size_compressed))) {
+
+    uint64_t size_compressed = 0;
+    if (!archive->readbytes(archive, &size_compressed, 0, sizeof(size_compressed))) {
         fprintf(stderr, "EOF while reading headers\n");
-        end_header_frame(&header_frame);
-        header_frame.count = -1;
-        return header_frame;
+        return 1;
     }
-    if (!archive->readbytes(archive, &header_frame.treesize, 0, sizeof(header_frame.treesize))) {
+    if (size_compressed != header_frame->size_compressed) {
+        fprintf(stderr, "Corrupted file: sizes of the file and the central directory differ\n");
+        return 1;
+    }
+
+    if (!archive->readbytes(archive, &header_frame->codec, 0, sizeof(header_frame->codec))) {
         fprintf(stderr, "EOF while reading headers\n");
-        end_header_frame(&header_frame);
-        header_frame.count = -1;
-        return header_frame;
+        return 1;
+    }
+    if (header_frame->codec != CODEC_BLOCKS && header_frame->codec != CODEC_STORED && header_frame->codec != CODEC_CHUNKS) {
+        fprintf(stderr, "Corrupted file: unknown codec\n");
+        return 1;
+    }
+
+    if (header_frame->codec == CODEC_CHUNKS) {
+        return read_chunks(archive, header_frame);
     }
-    if (!archive->readbytes(archive, &header_frame.filestart, 0, sizeof(header_frame.filestart))) {
+
+    if (!archive->readbytes(archive, &header_frame->wordsize, 0, sizeof(header_frame->wordsize))) {
         fprintf(stderr, "EOF while reading headers\n");
-        end_header_frame(&header_frame);
-        header_frame.count = -1;
-        return header_frame;
+        return 1;
+    }
+    if (header_frame->wordsize == 0 || header_frame->wordsize > 2) {
+        fprintf(stderr, "Corrupted file: invalid wordsize\n");
+        return 1;
     }
 
-    return header_frame;
-}
+    if (header_frame->codec == CODEC_STORED
+        && (header_frame->size_compressed % 8 != 0 || header_frame->size_compressed / 8 != header_frame->size_original)) {
+        fprintf(stderr, "Corrupted file: invalid size of the stored file\n");
+        return 1;
+    }
 
-static int next_header_frame(HeaderFrame* header_frame) {
-    FileBufferIO* archive = header_frame->fb;
+    return read_block_index(archive, header_frame);
+}
 
-    free(header_frame->name);
-    if (header_frame->current == header_frame->count) {
+// Reads the header and the trailer of the file of the central directory record, a file of a solid block is read from its record
+// Returns 0 if success, else 1
+// !!! After use, run "end_header_frame" !!!
+static int read_header_frame(const Job* job, FileBufferIO* archive, uint32_t index, HeaderFrame* header_frame) {
+    const CatalogRecord* record = &job->catalog->records[index];
+    header_frame->job = job;
+    header_frame->name = NULL;
+    header_frame->blocks = NULL;
+    header_frame->blocks_count = 0;
+    header_frame->chunks = NULL;
+    header_frame->chunks_count = 0;
+    header_frame->wordsize = 0;
+    header_frame->size_compressed = record->size_compressed;
+
+    // A file of a solid block has only its record, the block is checked by its trailer when the file is copied
+    if (Catalog_is_member(record)) {
+        header_frame->name = (char*)malloc(record->name_len+1);
+        if (!header_frame->name) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        memcpy(header_frame->name, Catalog_name(job->catalog, index), record->name_len+1);
+        header_frame->size_original = record->size_original;
+        header_frame->size_compressed = 0;
+        header_frame->filestart = 0;
+        header_frame->block_size = 0;
+        header_frame->streams = 1;
+        header_frame->codec = CODEC_SOLID;
+        header_frame->solid_pos = record->header_pos;
+        header_frame->solid_offset = record->size_compressed & ~CATALOG_SOLID_MEMBER;
         return 0;
     }
-    header_frame->current++;
 
-    if (!archive->readbytes(archive, &header_frame->size_original, 0, sizeof(header_frame->size_original))) {
+    if (seekbits(archive, record->header_pos*8) != 0) {
+        fprintf(stderr, "Fseek error\n");
+        return 1;
+    }
+
+    uint32_t filename_len = 0;
+    if (!archive->readbytes(archive, &header_frame->size_original, 0, sizeof(header_frame->size_original))
+        || !archive->readbytes(archive, &header_frame->block_size, 0, sizeof(header_frame->block_size))
+        || !archive->readbytes(archive, &header_frame->streams, 0, sizeof(header_frame->streams))
+        || !archive->readbytes(archive, &filename_len, 0, sizeof(filename_len))) {
         fprintf(stderr, "EOF while reading headers\n");
-        end_header_frame(header_frame);
-        return 0;
+        return 1;
+    }
+
+    if (header_frame->streams != 1 && header_frame->streams != STREAMS_INTERLEAVED) {
+        fprintf(stderr, "Corrupted file: invalid number of code streams\n");
+        return 1;
+    }
+
+    if (filename_len != record->name_len+1 || header_frame->size_original != record->size_original) {
+        fprintf(stderr, "Corrupted file: headers and the central directory differ\n");
+        return 1;
     }
 
-    unsigned int filename_len = 0;
-    archive->readbytes(archive, &filename_len, 0, sizeof(filename_len));
-    header_frame->name = (char*)calloc(filename_len, 1);
-    if (header_frame->name == NULL) {
+    header_frame->name = (char*)malloc(filename_len);
+    if (!header_frame->name) {
         fprintf(stderr, "Out of memory\n");
-        return 0;
+        return 1;
     }
 
     if (!archive->readbytes(archive, header_frame->name, 0, filename_len)) {
         fprintf(stderr, "EOF while reading headers\n");
         end_header_frame(header_frame);
-        return 0;
-    }
-    header_frame->size_compressed = 0;
-    if (!archive->readbytes(archive, &header_frame->size_compressed, 0, sizeof(header_frame->size_compressed))) {
-        fprintf(stderr, "EOF while reading headers\n");
-        end_header_frame(header_frame);
-        return 0;
+        return 1;
     }
-    header_frame->treesize = 0;
-    if (!archive->readbytes(archive, &header_frame->treesize, 0, sizeof(header_frame->treesize))) {
-        fprintf(stderr, "EOF while reading headers\n");
+    if (memcmp(header_frame->name, Catalog_name(job->catalog, index), filename_len) != 0) {
+        fprintf(stderr, "Corrupted file: headers and the central directory differ\n");
         end_header_frame(header_frame);
-        return 0;
+        return 1;
     }
-    header_frame->filestart = 0;
-    if (!archive->readbytes(archive, &header_frame->filestart, 0, sizeof(header_frame->filestart))) {
-        fprintf(stderr, "EOF while reading headers\n");
+
+    header_frame->filestart = tellbits(archive);
+    if (read_file_trailer(archive, header_frame) != 0) {
         end_header_frame(header_frame);
-        return 0;
+        return 1;
     }
 
-    return 1;
+    return 0;
 }
+
 // == HeaderFrame ================================
 
 
 // == Files compression ==========================
-static FileSizeResult compress_file(FileBufferIO* archive, const char* path, long size_pos) {
-    FileSizeResult filesize;
-    filesize.compressed_bits = 0;
-    filesize.original = get_filesize(path);
-    if (filesize.original == 0) {
-        return filesize;
-    }
-    
-    long filestart = ftell(archive->fp);
-    if (filestart < 0) {
-        fprintf(stderr, "Getting file position error\n");
-        return filesize;
-    }
-    filestart = filestart * 8 + archive->byte_p * 8 + archive->bit_p;
-    FileBufferIO* file_compress = FileBufferIO_open(path, "rb", BUFFER_SIZE);
-    if (!file_compress) {
-        return filesize;
-    }
+// Maximum code length of words of wordsize bytes used if it is not set by codelen_max
+static uint8_t get_codelen_max(const Job* job, uint8_t wordsize) {
+    if (job->opt.codelen_max != 0) return job->opt.codelen_max;
+    return wordsize == 1 ? 15 : 20;
+}
 
-    // Calculating words frequency
-    unsigned int freqs_size = (1 << (wordsize*8));
-    unsigned long long* freqs = (unsigned long long*)calloc(freqs_size, sizeof(unsigned long long)); // Частоты символов (для кодирования по дереву
-    if (!freqs) {
+// Stripes of a file sampled to choose its word size, files up to their total size are read whole
+#define WORDSIZE_SAMPLES 64
+#define WORDSIZE_SAMPLE_SIZE (16 << 10)
+
+// Estimates Huffman codes of words of wordsize bytes with freqs of count different words, words are their indices in the increasing order
+// The size is code lengths of the whole alphabet plus codes of the words multiplied by scale
+// Only the used words are put into the tree, so small samples of 2-byte words don't pay for the whole alphabet
+// Returns the size in bits, UINT64_MAX if failed
+static uint64_t estimate_words(const Job* job, const unsigned long long* freqs, const uint16_t* words, unsigned int count, uint8_t wordsize, double scale) {
+    uint8_t* used_lengths = (uint8_t*)malloc(count ? count : 1);
+    uint8_t* lengths = (uint8_t*)calloc(ALPHABET_SIZE(wordsize), 1);
+    if (!used_lengths || !lengths) {
         fprintf(stderr, "Out of memory\n");
-        FileBufferIO_close(file_compress);
-        return filesize;
+        free(used_lengths);
+        free(lengths);
+        return UINT64_MAX;
     }
 
-    uint8_t* word = (uint8_t*)calloc(wordsize, sizeof(uint8_t));
-    if (!word) {
-        fprintf(stderr, "Out of memory\n");
-        free(freqs);
-        FileBufferIO_close(file_compress);
-        return filesize;
+    // Leaves are ordered by word index on ties, so the lengths are the same as of the whole alphabet
+    uint64_t bits = UINT64_MAX;
+    HuffmanTree* tree = TreeBuilder_build(freqs, count);
+    if (Codes_lengths(tree, used_lengths, count, get_codelen_max(job, wordsize)) == 0) {
+        uint64_t codes_bits = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            lengths[words[i]] = used_lengths[i];
+            codes_bits += freqs[i] * used_lengths[i];
+        }
+        size_t lengths_bits = Lengths_size(lengths, ALPHABET_SIZE(wordsize));
+        if (lengths_bits != 0) {
+            bits = lengths_bits + (uint64_t)(codes_bits * scale);
+        }
     }
+    if (tree) HuffmanTree_free(tree);
 
-    uint8_t* lastword = NULL;
-    uint8_t lastword_size = 0;
+    free(used_lengths);
+    free(lengths);
+    return bits;
+}
 
-    while (1) {
-        size_t readed = file_compress->readbytes(file_compress, word, 0, wordsize);
+// Counts 2-byte words of the sample by sorting them, so small samples don't touch a table of the whole alphabet
+// Fills freqs and words with the counts and the indices of different words in the increasing order, both hold sample_len / 2 items
+// Returns the number of different words, -1 if out of memory
+static long long count_sample_words(const uint8_t* sample, size_t sample_len, unsigned long long* freqs, uint16_t* words) {
+    size_t count = sample_len / 2;
+    uint16_t* keys = (uint16_t*)malloc((count ? count : 1) * sizeof(uint16_t));
+    uint16_t* sorted = (uint16_t*)malloc((count ? count : 1) * sizeof(uint16_t));
+    if (!keys || !sorted) {
+        fprintf(stderr, "Out of memory\n");
+        free(keys);
+        free(sorted);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = wordtoi(sample + i*2, 2);
+    }
 
-        if (readed == 0) {
-            break;
+    // Radix sort by the low byte, then by the high byte
+    for (unsigned int shift = 0; shift < 16; shift += 8) {
+        size_t starts[256] = {0};
+        for (size_t i = 0; i < count; i++) starts[(keys[i] >> shift) & 0xFF]++;
+        size_t pos = 0;
+        for (unsigned int b = 0; b < 256; b++) {
+            size_t n = starts[b];
+            starts[b] = pos;
+            pos += n;
         }
+        for (size_t i = 0; i < count; i++) sorted[starts[(keys[i] >> shift) & 0xFF]++] = keys[i];
+        uint16_t* swap = keys;
+        keys = sorted;
+        sorted = swap;
+    }
 
-        if (readed != wordsize*8) {
-            lastword = (uint8_t*)calloc(wordsize, sizeof(uint8_t));
-            if (!lastword) {
-                fprintf(stderr, "Out of memory\n");
-                free(freqs);
-                free(word);
-                FileBufferIO_close(file_compress);
-                return filesize;
+    long long different = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || keys[i] != keys[i-1]) {
+            words[different] = keys[i];
+            freqs[different++] = 0;
+        }
+        freqs[different-1]++;
+    }
+
+    free(keys);
+    free(sorted);
+    return different;
+}
+
+// Chooses the word size of the file of size bytes by the estimates of 1-byte and 2-byte words on its sample
+// Stripes start at even offsets, so 2-byte words of the sample are words of the file
+// 2-byte words win only if they pay for their 65536 code lengths
+// Returns the word size, 0 if failed, the file is at its start
+static uint8_t choose_wordsize(const Job* job, FileBufferIO* file, uint64_t size) {
+    size_t sample_len = size < WORDSIZE_SAMPLES*WORDSIZE_SAMPLE_SIZE ? size : WORDSIZE_SAMPLES*WORDSIZE_SAMPLE_SIZE;
+    size_t items = sample_len / 2 > 256 ? sample_len / 2 : 256;
+    uint8_t* sample = (uint8_t*)calloc(sample_len, 1);
+    unsigned long long* freqs = (unsigned long long*)malloc(items * sizeof(unsigned long long));
+    uint16_t* words = (uint16_t*)malloc(items * sizeof(uint16_t));
+    if (!sample || !freqs || !words) {
+        fprintf(stderr, "Out of memory\n");
+        free(sample);
+        free(freqs);
+        free(words);
+        return 0;
+    }
+
+    int status = 0;
+    if (sample_len == size) {
+        status = file->readbytes(file, sample, 0, sample_len) / 8 != sample_len;
+    } else {
+        for (uint64_t i = 0; i < WORDSIZE_SAMPLES && status == 0; i++) {
+            uint64_t offset = (size - WORDSIZE_SAMPLE_SIZE) * i / (WORDSIZE_SAMPLES-1) / 2 * 2;
+            status = seekbits(file, offset*8) != 0
+                || file->readbytes(file, sample + i*WORDSIZE_SAMPLE_SIZE, 0, WORDSIZE_SAMPLE_SIZE) / 8 != WORDSIZE_SAMPLE_SIZE;
+        }
+    }
+    if (status != 0 || seekbits(file, 0) != 0) {
+        fprintf(stderr, "File has changed while compressing\n");
+        free(sample);
+        free(freqs);
+        free(words);
+        return 0;
+    }
+
+    double scale = (double)size / sample_len;
+    unsigned long long byte_freqs[256] = {0};
+    Histogram_count(sample, sample_len, 1, byte_freqs);
+    unsigned int different = 0;
+    for (unsigned int b = 0; b < 256; b++) {
+        if (!byte_freqs[b]) continue;
+        words[different] = b;
+        freqs[different++] = byte_freqs[b];
+    }
+    uint64_t bytes_bits = estimate_words(job, freqs, words, different, 1, scale);
+
+    uint64_t words_bits = UINT64_MAX;
+    long long words_different = count_sample_words(sample, sample_len, freqs, words);
+    if (words_different >= 0) {
+        words_bits = estimate_words(job, freqs, words, words_different, 2, scale);
+        if (words_bits != UINT64_MAX) words_bits += (size % 2)*8;
+    }
+
+    free(sample);
+    free(freqs);
+    free(words);
+    return words_bits < bytes_bits ? 2 : 1;
+}
+
+// Word size of the file of size bytes, it is chosen by a sample of the file if it is not set
+// Returns the word size, 0 if failed, the file is at its start
+static uint8_t get_wordsize(const Job* job, FileBufferIO* file, uint64_t size) {
+    if (job->opt.wordsize != 0) return job->opt.wordsize;
+    return choose_wordsize(job, file, size);
+}
+
+// Builds length-limited canonical codes from the words frequencies
+// Fills lengths with the code lengths
+// Returns codes with size 0 if failed
+// !!! After use, run "Codes_free" if size non-zero !!!
+static Codes build_codes(const Job* job, uint8_t wordsize, const unsigned long long* freqs, uint8_t* lengths, unsigned int size, char has_words) {
+    Codes codes;
+    codes.size = 0;
+
+    HuffmanTree* tree = NULL;
+    if (has_words) {
+        tree = TreeBuilder_build(freqs, size);
+        if (!tree) {
+            return codes;
+        }
+    }
+
+    int lengths_status = Codes_lengths(tree, lengths, size, get_codelen_max(job, wordsize));
+    if (tree) HuffmanTree_free(tree);
+
+    if (lengths_status == 0) {
+        codes = Codes_build(lengths, size);
+    }
+    return codes;
+}
+
+// Writes codes of the words of the chunk
+// The last incomplete word is stored as is
+// Returns the number of written bits
+static uint64_t encode_chunk(FileBufferIO* archive, const Code* code_table, const uint8_t* chunk, size_t size, uint8_t wordsize) {
+    size_t words_count = size / wordsize;
+    uint64_t bits = Codes_encode(archive, code_table, chunk, 0, words_count, 1, wordsize);
+
+    for (size_t i = words_count*wordsize; i < size; i++) {
+        putbits(archive, chunk[i], 8);
+        bits += 8;
+    }
+    return bits;
+}
+
+// Pads the stream with zero bits up to the byte boundary
+// Returns the number of written bits
+static uint64_t pad_to_byte(FileBufferIO* archive, uint64_t bits) {
+    unsigned char pad = (8 - bits % 8) % 8;
+    if (pad) putbits(archive, 0, pad);
+    return pad;
+}
+
+// Adds code sizes of the words of the chunk to the bit sizes of their streams, word i goes to stream i % STREAMS_INTERLEAVED
+// Called with a constant wordsize, so it is compiled separately for every word size
+CPU_KERNEL_INLINE void count_streams_bits(const Code* code_table, const uint8_t* chunk, size_t words_count, uint8_t wordsize, uint64_t* streams_bits) {
+    for (size_t i = 0; i < words_count; i++) {
+        streams_bits[i % STREAMS_INTERLEAVED] += CODE_SIZE(code_table[wordtoi(chunk + i*wordsize, wordsize)]);
+    }
+}
+
+// Writes codes of the words of the chunk into STREAMS_INTERLEAVED streams, word i goes to stream i % STREAMS_INTERLEAVED
+// Byte sizes of all streams but the last one go first, so the streams can be decoded together
+// Every stream starts at the byte boundary, the last incomplete word is stored as is at the end of the last stream
+// The archive must be at the byte boundary
+// Returns the number of written bits
+static uint64_t encode_streams(FileBufferIO* archive, const Code* code_table, const uint8_t* chunk, size_t size, uint8_t wordsize) {
+    size_t words_count = size / wordsize;
+    uint64_t streams_bits[STREAMS_INTERLEAVED] = {0};
+    if (wordsize == 1) {
+        count_streams_bits(code_table, chunk, words_count, 1, streams_bits);
+    } else {
+        count_streams_bits(code_table, chunk, words_count, 2, streams_bits);
+    }
+
+    uint64_t bits = 0;
+    for (int j = 0; j + 1 < STREAMS_INTERLEAVED; j++) {
+        uint32_t stream_size = (streams_bits[j] + 7) / 8;
+        archive->writebytes(archive, &stream_size, 0, sizeof(stream_size));
+        bits += sizeof(stream_size)*8;
+    }
+
+    for (int j = 0; j < STREAMS_INTERLEAVED; j++) {
+        uint64_t stream_bits = Codes_encode(archive, code_table, chunk, j, words_count, STREAMS_INTERLEAVED, wordsize);
+        if (j + 1 == STREAMS_INTERLEAVED) {
+            for (size_t i = words_count*wordsize; i < size; i++) {
+                putbits(archive, chunk[i], 8);
+                stream_bits += 8;
+            }
+        }
+        bits += stream_bits + pad_to_byte(archive, stream_bits);
+    }
+    return bits;
+}
+
+// Estimates the size of the block coded by streams streams: code lengths, codes of the words, the last incomplete word
+// and the padding of the streams, lengths and freqs have size items of words of wordsize bytes
+// Returns the size in bits, UINT64_MAX if failed
+static uint64_t estimate_block(const unsigned long long* freqs, const uint8_t* lengths, unsigned int size, size_t block_len, uint8_t wordsize, uint8_t streams) {
+    size_t lengths_bits = Lengths_size(lengths, size);
+    if (lengths_bits == 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t bits = lengths_bits + (block_len % wordsize)*8;
+    for (unsigned int i = 0; i < size; i++) {
+        bits += freqs[i] * lengths[i];
+    }
+
+    // Every stream is padded to the byte boundary, interleaved streams also store their byte sizes
+    bits += streams == 1 ? 7 : 7 + (STREAMS_INTERLEAVED-1)*32 + STREAMS_INTERLEAVED*7;
+    return bits;
+}
+
+// LZ77 parse of a block with codes of its two alphabets
+typedef struct {
+    LzSequence* sequences;
+    size_t count;
+    unsigned long long litlen_freqs[LZ_LITLEN_SIZE];
+    unsigned long long distance_freqs[LZ_DISTANCE_CODES];
+    uint8_t litlen_lengths[LZ_LITLEN_SIZE];
+    uint8_t distance_lengths[LZ_DISTANCE_CODES];
+    Codes litlen;
+    Codes distance;
+    uint64_t extra_bits; // Extra bits of all lengths and distances
+} LzBlock;
+
+static void init_lz(LzBlock* lz) {
+    lz->sequences = NULL;
+    lz->count = 0;
+    lz->litlen.size = 0;
+    lz->distance.size = 0;
+}
+
+static void end_lz(LzBlock* lz) {
+    free(lz->sequences);
+    if (lz->litlen.size) Codes_free(lz->litlen);
+    if (lz->distance.size) Codes_free(lz->distance);
+    init_lz(lz);
+}
+
+// Parses the block into sequences and builds codes of literal bytes and length buckets and of distance buckets
+// Codes are limited as codes of words of wordsize bytes
+// Returns 0 if success, else 1
+// !!! After use, run "end_lz" !!!
+static int parse_lz(const Job* job, uint8_t wordsize, const uint8_t* block, size_t block_len, LzBlock* lz) {
+    init_lz(lz);
+    size_t count = Lz_parse(block, block_len, job->opt.lz_window, job->opt.lz_depth, &lz->sequences);
+    if (count == (size_t)-1) {
+        return 1;
+    }
+    lz->count = count;
+
+    memset(lz->litlen_freqs, 0, sizeof(lz->litlen_freqs));
+    memset(lz->distance_freqs, 0, sizeof(lz->distance_freqs));
+    lz->extra_bits = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < count; i++) {
+        const LzSequence* seq = &lz->sequences[i];
+        for (uint32_t j = 0; j < seq->literals; j++) {
+            lz->litlen_freqs[block[pos + j]]++;
+        }
+        pos += seq->literals + seq->length;
+        if (seq->length == 0) continue;
+
+        unsigned int extra_bits;
+        uint32_t extra;
+        lz->litlen_freqs[256 + Lz_bucket(seq->length - LZ_MIN_MATCH, &extra_bits, &extra)]++;
+        lz->extra_bits += extra_bits;
+        lz->distance_freqs[Lz_bucket(seq->distance - 1, &extra_bits, &extra)]++;
+        lz->extra_bits += extra_bits;
+    }
+
+    lz->litlen = build_codes(job, wordsize, lz->litlen_freqs, lz->litlen_lengths, LZ_LITLEN_SIZE, 1);
+    if (lz->litlen.size == 0) {
+        end_lz(lz);
+        return 1;
+    }
+
+    // A block without matches has no distance codes
+    lz->distance = build_codes(job, wordsize, lz->distance_freqs, lz->distance_lengths, LZ_DISTANCE_CODES, count > 1 || lz->sequences[0].length > 0);
+    if (lz->distance.size == 0) {
+        end_lz(lz);
+        return 1;
+    }
+    return 0;
+}
+
+// Estimates the size of the block coded by LZ77: code lengths of both alphabets, codes, extra bits and the padding
+// Returns the size in bits, UINT64_MAX if failed
+static uint64_t estimate_lz(const LzBlock* lz) {
+    size_t litlen_bits = Lengths_size(lz->litlen_lengths, LZ_LITLEN_SIZE);
+    size_t distance_bits = Lengths_size(lz->distance_lengths, LZ_DISTANCE_CODES);
+    if (litlen_bits == 0 || distance_bits == 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t bits = litlen_bits + distance_bits + lz->extra_bits + 7;
+    for (unsigned int i = 0; i < LZ_LITLEN_SIZE; i++) {
+        bits += lz->litlen_freqs[i] * lz->litlen_lengths[i];
+    }
+    for (unsigned int i = 0; i < LZ_DISTANCE_CODES; i++) {
+        bits += lz->distance_freqs[i] * lz->distance_lengths[i];
+    }
+    return bits;
+}
+
+// Writes the LZ77 block: code lengths of both alphabets, then every sequence as codes of its literals,
+// the code of the length bucket with its extra bits and the code of the distance bucket with its extra bits
+// The block is one stream padded to the byte boundary
+// Returns the number of written bits, 0 if failed
+static uint64_t encode_lz(FileBufferIO* archive, const LzBlock* lz, const uint8_t* block) {
+    uint64_t litlen_bits = Lengths_write(archive, lz->litlen_lengths, LZ_LITLEN_SIZE);
+    if (litlen_bits == 0) {
+        return 0;
+    }
+    uint64_t distance_bits = Lengths_write(archive, lz->distance_lengths, LZ_DISTANCE_CODES);
+    if (distance_bits == 0) {
+        return 0;
+    }
+
+    const Code* litlen = lz->litlen.codes;
+    const Code* distance = lz->distance.codes;
+    uint64_t bits = litlen_bits + distance_bits;
+    size_t pos = 0;
+    for (size_t i = 0; i < lz->count; i++) {
+        const LzSequence* seq = &lz->sequences[i];
+        for (uint32_t j = 0; j < seq->literals; j++) {
+            Code code = litlen[block[pos + j]];
+            putbits(archive, CODE_BITS(code), CODE_SIZE(code));
+            bits += CODE_SIZE(code);
+        }
+        pos += seq->literals + seq->length;
+        if (seq->length == 0) continue;
+
+        unsigned int extra_bits;
+        uint32_t extra;
+        Code code = litlen[256 + Lz_bucket(seq->length - LZ_MIN_MATCH, &extra_bits, &extra)];
+        putbits(archive, CODE_BITS(code), CODE_SIZE(code));
+        if (extra_bits) putbits(archive, extra, extra_bits);
+        bits += CODE_SIZE(code) + extra_bits;
+
+        code = distance[Lz_bucket(seq->distance - 1, &extra_bits, &extra)];
+        putbits(archive, CODE_BITS(code), CODE_SIZE(code));
+        if (extra_bits) putbits(archive, extra, extra_bits);
+        bits += CODE_SIZE(code) + extra_bits;
+    }
+    return bits + pad_to_byte(archive, bits);
+}
+
+// Writes the tANS block: the normalized counts, then the stream of codes from the byte boundary
+// Returns the number of written bits
+static uint64_t encode_fse(FileBufferIO* archive, const uint16_t* norm, unsigned int table_log, const uint8_t* block, size_t block_len) {
+    uint64_t bits = Fse_write_counts(archive, norm, table_log);
+    bits += pad_to_byte(archive, bits);
+
+    FseEncodeTable table;
+    FseEncodeTable_build(&table, norm, table_log);
+    bits += Fse_encode(archive, &table, block, block_len);
+    return bits + pad_to_byte(archive, bits);
+}
+
+// Writes the order-1 block: the model, then the codes from the byte boundary
+// Returns the number of written bits, 0 if failed
+static uint64_t encode_context(FileBufferIO* archive, const ContextModel* model, const uint8_t* block, size_t block_len) {
+    uint64_t bits = ContextModel_write(archive, model);
+    if (bits == 0) {
+        return 0;
+    }
+    bits += pad_to_byte(archive, bits);
+
+    Codes codes[CONTEXT_TABLES_MAX];
+    for (unsigned int k = 0; k < model->tables_count; k++) {
+        codes[k] = Codes_build(model->lengths[k], CONTEXT_SYMBOLS);
+        if (codes[k].size == 0) {
+            for (unsigned int j = 0; j < k; j++) Codes_free(codes[j]);
+            return 0;
+        }
+    }
+
+    const Code* by_prev[CONTEXT_SYMBOLS];
+    for (unsigned int c = 0; c < CONTEXT_SYMBOLS; c++) {
+        by_prev[c] = codes[model->map[c]].codes;
+    }
+    bits += Context_encode(archive, by_prev, block, block_len);
+
+    for (unsigned int k = 0; k < model->tables_count; k++) Codes_free(codes[k]);
+    return bits + pad_to_byte(archive, bits);
+}
+
+// Coding of one block chosen by the estimates of the enabled codecs
+typedef struct {
+    uint8_t codec;
+    uint64_t bits; // Estimated size of the block coded by codec
+    Codes codes; // Huffman codes of CODEC_HUFFMAN, lengths are kept by the caller
+    LzBlock lz; // Sequences and codes of CODEC_LZ
+    uint16_t norm[FSE_SYMBOLS]; // Normalized counts of CODEC_FSE
+    unsigned int table_log;
+    ContextModel* model; // Tables of CODEC_CONTEXT
+} BlockCoding;
+
+static void end_block_coding(BlockCoding* coding) {
+    if (coding->codes.size) Codes_free(coding->codes);
+    coding->codes.size = 0;
+    end_lz(&coding->lz);
+    free(coding->model);
+    coding->model = NULL;
+}
+
+// Chooses the codec of the block giving the smallest estimate: Huffman codes of words of wordsize bytes, and if they are set
+// LZ77 sequences of lz_window, tANS of fse or tables chosen by the previous byte of context_tables, the last two only for 1-byte words
+// Only the coding of the chosen codec is kept, freqs and lengths get ALPHABET_SIZE(wordsize) items of the Huffman codes
+// Returns 0 if success, else 1
+// !!! After use, run "end_block_coding" !!!
+static int choose_block_coding(const Job* job, const uint8_t* block, size_t block_len, uint8_t streams, uint8_t wordsize, unsigned long long* freqs, uint8_t* lengths, BlockCoding* coding) {
+    coding->codes.size = 0;
+    init_lz(&coding->lz);
+    coding->model = NULL;
+
+    // The last incomplete word is stored as is
+    unsigned int freqs_size = ALPHABET_SIZE(wordsize);
+    memset(freqs, 0, freqs_size * sizeof(unsigned long long));
+    Histogram_count(block, block_len, wordsize, freqs);
+    coding->codes = build_codes(job, wordsize, freqs, lengths, freqs_size, block_len >= wordsize);
+    if (coding->codes.size == 0) {
+        return 1;
+    }
+    coding->codec = CODEC_HUFFMAN;
+    coding->bits = estimate_block(freqs, lengths, freqs_size, block_len, wordsize, streams);
+
+    if (job->opt.lz_window) {
+        if (parse_lz(job, wordsize, block, block_len, &coding->lz) != 0) {
+            end_block_coding(coding);
+            return 1;
+        }
+        uint64_t lz_bits = estimate_lz(&coding->lz);
+        if (lz_bits < coding->bits) {
+            coding->codec = CODEC_LZ;
+            coding->bits = lz_bits;
+        }
+    }
+
+    // Counts of tANS come from the frequencies of the Huffman codes
+    if (job->opt.fse && wordsize == 1) {
+        unsigned int symbols = 0;
+        for (unsigned int i = 0; i < FSE_SYMBOLS; i++) symbols += freqs[i] != 0;
+        coding->table_log = Fse_table_log(block_len, symbols);
+        if (Fse_normalize(freqs, block_len, coding->table_log, coding->norm) == 0) {
+            uint64_t fse_bits = Fse_estimate(freqs, coding->norm, coding->table_log);
+            if (fse_bits < coding->bits) {
+                coding->codec = CODEC_FSE;
+                coding->bits = fse_bits;
+            }
+        }
+    }
+
+    if (job->opt.context_tables && wordsize == 1) {
+        coding->model = ContextModel_create(block, block_len, job->opt.context_tables, get_codelen_max(job, 1));
+        uint64_t context_bits = coding->model ? ContextModel_estimate(coding->model) : UINT64_MAX;
+        if (context_bits < coding->bits) {
+            coding->codec = CODEC_CONTEXT;
+            coding->bits = context_bits;
+        }
+    }
+
+    if (coding->codec != CODEC_HUFFMAN) {
+        Codes_free(coding->codes);
+        coding->codes.size = 0;
+    }
+    if (coding->codec != CODEC_LZ) {
+        end_lz(&coding->lz);
+    }
+    if (coding->codec != CODEC_CONTEXT) {
+        free(coding->model);
+        coding->model = NULL;
+    }
+    return 0;
+}
+
+// Writes the block by its chosen coding, the block ends at the byte boundary
+// Huffman codes form one stream or STREAMS_INTERLEAVED streams after the code lengths, lengths are the ones of the coding
+// Returns the number of written bits, 0 if failed
+static uint64_t encode_block(FileBufferIO* archive, const BlockCoding* coding, const uint8_t* block, size_t block_len, uint8_t streams, uint8_t wordsize, const uint8_t* lengths) {
+    if (coding->codec == CODEC_CONTEXT) {
+        return encode_context(archive, coding->model, block, block_len);
+    }
+    if (coding->codec == CODEC_FSE) {
+        return encode_fse(archive, coding->norm, coding->table_log, block, block_len);
+    }
+    if (coding->codec == CODEC_LZ) {
+        return encode_lz(archive, &coding->lz, block);
+    }
+
+    uint64_t bits = Lengths_write(archive, lengths, ALPHABET_SIZE(wordsize));
+    if (bits == 0) {
+        return 0;
+    }
+    if (streams == 1) {
+        bits += encode_chunk(archive, coding->codes.codes, block, block_len, wordsize);
+        bits += pad_to_byte(archive, bits);
+    } else {
+        bits += pad_to_byte(archive, bits);
+        bits += encode_streams(archive, coding->codes.codes, block, block_len, wordsize);
+    }
+    return bits;
+}
+
+// Compresses the file by independent blocks of block_size, 0 - the whole file is one block
+// Every block is read to memory once and is coded by its own codec and codes, it starts at the byte boundary
+// A block with the estimate not smaller than the block is stored as is, if all blocks are stored the file is the file as is
+// and codec is set to CODEC_STORED, otherwise codec is set to CODEC_BLOCKS
+// Fills blocks with the block offsets from the file start in bytes and their codecs
+// Returns the number of written bits, 0 if failed
+static uint64_t compress_blocks(Job* job, FileBufferIO* archive, FileBufferIO* file_compress, uint64_t size, uint32_t block_size, uint8_t streams, uint8_t wordsize, FileBlock* blocks, uint8_t* codec) {
+    unsigned int freqs_size = ALPHABET_SIZE(wordsize);
+    unsigned long long* freqs = (unsigned long long*)malloc(freqs_size * sizeof(unsigned long long));
+    if (!freqs) {
+        fprintf(stderr, "Out of memory\n");
+        return 0;
+    }
+
+    uint8_t* lengths = (uint8_t*)malloc(freqs_size);
+    if (!lengths) {
+        fprintf(stderr, "Out of memory\n");
+        free(freqs);
+        return 0;
+    }
+
+    size_t block_capacity = block_size == 0 || size < block_size ? size : block_size;
+    uint8_t* block = (uint8_t*)malloc(block_capacity);
+    if (!block) {
+        fprintf(stderr, "Out of memory\n");
+        free(lengths);
+        free(freqs);
+        return 0;
+    }
+
+    char all_stored = 1;
+    uint64_t compressed_bits = 0;
+    uint64_t left = size;
+    for (uint64_t block_i = 0; left > 0; block_i++) {
+        size_t block_len = left < block_capacity ? left : block_capacity;
+        if (file_compress->readbytes(file_compress, block, 0, block_len) / 8 != block_len) {
+            fprintf(stderr, "File has changed while compressing\n");
+            free(block);
+            free(lengths);
+            free(freqs);
+            return 0;
+        }
+        left -= block_len;
+        blocks[block_i].offset = compressed_bits / 8;
+        blocks[block_i].codec = CODEC_STORED;
+
+        BlockCoding coding;
+        if (choose_block_coding(job, block, block_len, streams, wordsize, freqs, lengths, &coding) != 0) {
+            free(block);
+            free(lengths);
+            free(freqs);
+            return 0;
+        }
+
+        if (coding.bits >= (uint64_t)block_len*8) {
+            end_block_coding(&coding);
+            if (writethrough(archive, block, block_len) != block_len) {
+                fprintf(stderr, "Error while writing the archive\n");
+                free(block);
+                free(lengths);
+                free(freqs);
+                return 0;
+            }
+            compressed_bits += (uint64_t)block_len*8;
+            pg_update(&job->progress, block_len*16);
+            continue;
+        }
+
+        all_stored = 0;
+        blocks[block_i].codec = coding.codec;
+        uint64_t block_bits = encode_block(archive, &coding, block, block_len, streams, wordsize, lengths);
+        end_block_coding(&coding);
+        if (block_bits == 0) {
+            free(block);
+            free(lengths);
+            free(freqs);
+            return 0;
+        }
+        compressed_bits += block_bits;
+        pg_update(&job->progress, block_len*16);
+    }
+
+    // Stored blocks follow each other without padding, so the file of them is the file as is
+    *codec = all_stored && size > 0 ? CODEC_STORED : CODEC_BLOCKS;
+    free(block);
+    free(lengths);
+    free(freqs);
+    return compressed_bits;
+}
+
+// Reads files of the solid block one after another
+// Returns the memory reader of the block, NULL if failed
+// !!! After use, run "FileBufferIO_close" and free "data" if non-null !!!
+static FileBufferIO* read_solid(const CompressingFile* solid, uint8_t** data) {
+    *data = (uint8_t*)malloc(solid->size);
+    if (!*data) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < solid->members_count; i++) {
+        const CompressingFile* member = solid->members[i];
+        FileBufferIO* file = FileBufferIO_open(member->path, "rb", BUFFER_SIZE);
+        if (!file) {
+            free(*data);
+            return NULL;
+        }
+        if (file->readbytes(file, *data + offset, 0, member->size) / 8 != member->size) {
+            fprintf(stderr, "File %s has changed while compressing\n", member->path);
+            FileBufferIO_close(file);
+            free(*data);
+            return NULL;
+        }
+        FileBufferIO_close(file);
+        offset += member->size;
+    }
+
+    FileBufferIO* reader = FileBufferIO_memory_reader(*data, solid->size);
+    if (!reader) {
+        free(*data);
+    }
+    return reader;
+}
+
+// Compresses the file or the solid block into the stream, the stream must be at the byte boundary
+// Returns sizes of the file and its block offsets, compressed size is 0 if failed
+// !!! After use, free "blocks" of the result !!!
+static FileSizeResult compress_file(Job* job, FileBufferIO* stream, const CompressingFile* compr_file) {
+    FileSizeResult filesize;
+    filesize.compressed_bits = 0;
+    filesize.original = compr_file->size;
+    filesize.block_size = 0;
+    filesize.codec = CODEC_BLOCKS;
+    filesize.wordsize = 1;
+    filesize.blocks = NULL;
+    filesize.chunks = NULL;
+    filesize.chunks_count = 0;
+    if (filesize.original == 0) {
+        return filesize;
+    }
+
+    // A solid block is one block of the concatenated files
+    uint8_t* solid_data = NULL;
+    FileBufferIO* file_compress = NULL;
+    if (compr_file->members) {
+        file_compress = read_solid(compr_file, &solid_data);
+    } else {
+        file_compress = FileBufferIO_open(compr_file->path, "rb", BUFFER_SIZE);
+    }
+    if (!file_compress) {
+        return filesize;
+    }
+
+    filesize.block_size = compr_file->members ? 0 : get_block_size(job, filesize.original);
+    filesize.blocks = (FileBlock*)calloc(get_blocks_count(filesize.block_size, filesize.original), sizeof(FileBlock));
+    if (!filesize.blocks) {
+        fprintf(stderr, "Out of memory\n");
+        FileBufferIO_close(file_compress);
+        free(solid_data);
+        return filesize;
+    }
+
+    filesize.wordsize = get_wordsize(job, file_compress, filesize.original);
+    if (filesize.wordsize == 0) {
+        FileBufferIO_close(file_compress);
+        free(solid_data);
+        return filesize;
+    }
+
+    filesize.compressed_bits = compress_blocks(job, stream, file_compress, filesize.original, filesize.block_size, get_streams(job, filesize.original), filesize.wordsize, filesize.blocks, &filesize.codec);
+    FileBufferIO_close(file_compress);
+    free(solid_data);
+
+    return filesize;
+}
+
+// Compresses files one by one directly into the archive
+// Returns 0 if success, else 1
+static int compress_sequential(Job* job, FileBufferIO* archive, Queue* files, uint64_t* original_total) {
+    CompressingFile* compr_file = (CompressingFile*)queue_dequeue(files);
+    while (compr_file != NULL) {
+        // A solid block has no header, its files are recorded after its data
+        long long header_pos = compr_file->members ? 0 : write_fileheader(job, archive, compr_file);
+        if (header_pos < 0) {
+            CompressingFile_free(compr_file);
+            return 1;
+        }
+
+        FileSizeResult filesize = compress_file(job, archive, compr_file);
+        if (filesize.compressed_bits == 0 && filesize.original != 0) {
+            fprintf(stderr, "Error while compressing %s\n", compr_file->path);
+            free(filesize.blocks);
+            CompressingFile_free(compr_file);
+            return 1;
+        }
+        int status = compr_file->members ? write_solid(job, archive, compr_file, &filesize)
+            : write_filetrailer(job, archive, compr_file, header_pos, &filesize);
+        if (status != 0) {
+            free(filesize.blocks);
+            CompressingFile_free(compr_file);
+            return 1;
+        }
+        free(filesize.blocks);
+
+        *original_total += filesize.original;
+        pg_update(&job->progress, 1);
+
+        CompressingFile_free(compr_file);
+        compr_file = (CompressingFile*)queue_dequeue(files);
+    }
+
+    return 0;
+}
+// == Files compression ==========================
+
+
+// == Deduplication ==============================
+// File being split into chunks
+typedef struct {
+    CompressingFile* file;
+    ChunkRef* chunks; // Store indices until the stores are written
+    uint64_t chunks_count;
+    uint64_t chunks_capacity;
+    uint64_t first_store; // Index of the store being filled when the file started
+    uint32_t source; // Index of the file in sources of the state
+    char repeated; // Some chunk of the file was stored before
+} DedupEntry;
+
+typedef struct {
+    ChunkIndex* index;
+    uint8_t* window; // CHUNK_MAX bytes of the file being split
+    uint8_t* store; // New chunks of the file being split
+    uint32_t store_size;
+    uint32_t store_capacity;
+    uint64_t* stores; // Trailers of written stores or headers of files written whole in bytes by store index
+    uint64_t stores_count; // Index of the store being filled
+    uint64_t stores_capacity;
+    char** sources; // Paths of split files, chunks of written stores are read again from them to be compared
+    uint32_t sources_count;
+    uint32_t sources_capacity;
+    FileBufferIO* source; // The last source read, NULL if none
+    uint32_t source_index;
+    uint8_t* compare; // CHUNK_MAX bytes of a chunk read from its source
+} DedupState;
+
+static void end_dedup_entry(DedupEntry* entry) {
+    if (entry->file) CompressingFile_free(entry->file);
+    free(entry->chunks);
+}
+
+// Adds the chunk to the end of the file, it is merged with the previous chunk if they follow each other in a store
+// Returns 0 if success, else 1
+static int add_chunk(DedupEntry* entry, const ChunkRef* chunk) {
+    if (entry->chunks_count > 0) {
+        ChunkRef* last = &entry->chunks[entry->chunks_count-1];
+        if (last->store == chunk->store && last->offset + last->size == chunk->offset) {
+            last->size += chunk->size;
+            return 0;
+        }
+    }
+
+    if (entry->chunks_count == entry->chunks_capacity) {
+        uint64_t capacity = entry->chunks_capacity ? entry->chunks_capacity*2 : 16;
+        ChunkRef* chunks = (ChunkRef*)realloc(entry->chunks, capacity * sizeof(ChunkRef));
+        if (!chunks) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        entry->chunks = chunks;
+        entry->chunks_capacity = capacity;
+    }
+    entry->chunks[entry->chunks_count++] = *chunk;
+    return 0;
+}
+
+// Compresses the store being filled into the archive by blocks like a file of its size
+// Returns sizes of the store and its block offsets, compressed size is 0 if failed
+// !!! After use, free "blocks" of the result !!!
+static FileSizeResult compress_store(Job* job, FileBufferIO* archive, const DedupState* dedup) {
+    FileSizeResult filesize = {0};
+    filesize.original = dedup->store_size;
+    filesize.block_size = get_block_size(job, filesize.original);
+    filesize.codec = CODEC_BLOCKS;
+    filesize.blocks = (FileBlock*)calloc(get_blocks_count(filesize.block_size, filesize.original), sizeof(FileBlock));
+    FileBufferIO* store = FileBufferIO_memory_reader(dedup->store, dedup->store_size);
+    if (!filesize.blocks || !store) {
+        if (!filesize.blocks) fprintf(stderr, "Out of memory\n");
+        if (store) FileBufferIO_close(store);
+        return filesize;
+    }
+
+    filesize.wordsize = get_wordsize(job, store, filesize.original);
+    if (filesize.wordsize != 0) {
+        filesize.compressed_bits = compress_blocks(job, archive, store, filesize.original, filesize.block_size, get_streams(job, filesize.original), filesize.wordsize, filesize.blocks, &filesize.codec);
+    }
+    FileBufferIO_close(store);
+    return filesize;
+}
+
+// Gives the next store index to the written store or file, the store is empty again
+// Returns 0 if success, else 1
+static int add_store(DedupState* dedup, uint64_t pos) {
+    if (dedup->stores_count == dedup->stores_capacity) {
+        uint64_t capacity = dedup->stores_capacity ? dedup->stores_capacity*2 : 64;
+        uint64_t* stores = (uint64_t*)realloc(dedup->stores, capacity * sizeof(uint64_t));
+        if (!stores) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        dedup->stores = stores;
+        dedup->stores_capacity = capacity;
+    }
+    dedup->stores[dedup->stores_count++] = pos;
+    dedup->store_size = 0;
+    return 0;
+}
+
+// Compresses the store being filled as a solid block
+// Returns 0 if success, else 1
+static int flush_store(Job* job, FileBufferIO* archive, DedupState* dedup) {
+    if (dedup->store_size == 0) {
+        return 0;
+    }
+
+    FileSizeResult filesize = compress_store(job, archive, dedup);
+    long long store_pos = filesize.compressed_bits ? write_solid_trailer(job, archive, &filesize) : -1;
+    free(filesize.blocks);
+    if (store_pos < 0) {
+        return 1;
+    }
+    return add_store(dedup, store_pos);
+}
+
+// Writes the file as if it were compressed without deduplication, the store holds the whole file
+// Its chunks refer to its header
+// Returns 0 if success, else 1
+static int write_whole(Job* job, FileBufferIO* archive, DedupState* dedup, const DedupEntry* entry) {
+    long long header_pos = write_fileheader(job, archive, entry->file);
+    if (header_pos < 0) {
+        return 1;
+    }
+
+    FileSizeResult filesize = {0};
+    filesize.codec = CODEC_BLOCKS;
+    filesize.wordsize = 1;
+    if (dedup->store_size > 0) {
+        filesize = compress_store(job, archive, dedup);
+        if (filesize.compressed_bits == 0) {
+            free(filesize.blocks);
+            return 1;
+        }
+    }
+
+    int status = write_filetrailer(job, archive, entry->file, header_pos, &filesize);
+    free(filesize.blocks);
+    if (status == 0 && dedup->store_size > 0) {
+        status = add_store(dedup, header_pos);
+    }
+    return status;
+}
+
+// Writes the header and the trailer of the file listing its chunks, all their stores are written
+// Returns 0 if success, else 1
+static int write_chunks(const Job* job, FileBufferIO* archive, const DedupState* dedup, DedupEntry* entry) {
+    for (uint64_t i = 0; i < entry->chunks_count; i++) {
+        entry->chunks[i].store = dedup->stores[entry->chunks[i].store];
+    }
+
+    FileSizeResult filesize = {0};
+    filesize.original = entry->file->size;
+    filesize.codec = CODEC_CHUNKS;
+    filesize.chunks = entry->chunks;
+    filesize.chunks_count = entry->chunks_count;
+    long long header_pos = write_fileheader(job, archive, entry->file);
+    if (header_pos < 0) {
+        return 1;
+    }
+    return write_filetrailer(job, archive, entry->file, header_pos, &filesize);
+}
+
+// Adds the file to the sources of chunks
+// Returns 0 if success, else 1
+static int add_source(DedupState* dedup, DedupEntry* entry) {
+    if (dedup->sources_count == dedup->sources_capacity) {
+        uint32_t capacity = dedup->sources_capacity ? dedup->sources_capacity*2 : 64;
+        char** sources = (char**)realloc(dedup->sources, capacity * sizeof(char*));
+        if (!sources) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        dedup->sources = sources;
+        dedup->sources_capacity = capacity;
+    }
+    char* path = (char*)malloc(strlen(entry->file->path)+1);
+    if (!path) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    strcpy(path, entry->file->path);
+    dedup->sources[dedup->sources_count] = path;
+    entry->source = dedup->sources_count++;
+    return 0;
+}
+
+// Compares the chunk with the stored one byte by byte
+// Chunks of the store being filled are in memory, chunks of written stores are read again from their files
+// Returns 1 if the chunks are equal, 0 if they differ or the stored one can't be read
+static int same_chunk(DedupState* dedup, const ChunkSlot* found, const uint8_t* data, uint32_t size) {
+    if (found->ref.store == dedup->stores_count) {
+        return memcmp(dedup->store + found->ref.offset, data, size) == 0;
+    }
+
+    if (!dedup->source || dedup->source_index != found->source.file) {
+        if (dedup->source) FileBufferIO_close(dedup->source);
+        dedup->source = FileBufferIO_open(dedup->sources[found->source.file], "rb", BUFFER_SIZE);
+        dedup->source_index = found->source.file;
+        if (!dedup->source) {
+            return 0;
+        }
+    }
+    if (seekbits(dedup->source, found->source.offset*8) != 0
+        || dedup->source->readbytes(dedup->source, dedup->compare, 0, size) / 8 != size) {
+        return 0;
+    }
+    return memcmp(dedup->compare, data, size) == 0;
+}
+
+// Adds the chunk at the offset of the file, a chunk not seen before is copied to the store
+// A chunk with the fingerprint of a stored one is reused only if their bytes are equal
+// Returns 0 if success, else 1
+static int dedup_chunk(Job* job, FileBufferIO* archive, DedupState* dedup, DedupEntry* entry, const uint8_t* data, uint32_t size, uint64_t offset) {
+    uint64_t fingerprint[2];
+    Chunk_fingerprint(data, size, fingerprint);
+    const ChunkSlot* found = ChunkIndex_find(dedup->index, fingerprint, size);
+    char collision = found && !same_chunk(dedup, found, data, size);
+    if (found && !collision) {
+        entry->repeated = 1;
+        pg_update(&job->progress, (long long)size*16);
+        return add_chunk(entry, &found->ref);
+    }
+
+    if (dedup->store_size + size > dedup->store_capacity && flush_store(job, archive, dedup) != 0) {
+        return 1;
+    }
+    ChunkRef chunk = {dedup->stores_count, dedup->store_size, size};
+    memcpy(dedup->store + dedup->store_size, data, size);
+    dedup->store_size += size;
+
+    // A colliding chunk is stored again, the index keeps the first one
+    ChunkSource source = {offset, entry->source};
+    if (!collision && ChunkIndex_add(dedup->index, fingerprint, &chunk, &source) != 0) {
+        return 1;
+    }
+    return add_chunk(entry, &chunk);
+}
+
+// Splits the file into chunks and writes it
+// A file without repeated chunks that fits the store is written whole, otherwise its store is written before its chunk list
+// Returns 0 if success, else 1
+static int dedup_file(Job* job, FileBufferIO* archive, DedupState* dedup, DedupEntry* entry) {
+    if (add_source(dedup, entry) != 0) {
+        return 1;
+    }
+    FileBufferIO* file = FileBufferIO_open(entry->file->path, "rb", BUFFER_SIZE);
+    if (!file) {
+        return 1;
+    }
+
+    entry->first_store = dedup->stores_count;
+    uint64_t left = entry->file->size;
+    size_t have = 0;
+    while (left > 0 || have > 0) {
+        size_t want = CHUNK_MAX - have < left ? CHUNK_MAX - have : left;
+        if (file->readbytes(file, dedup->window + have, 0, want) / 8 != want) {
+            fprintf(stderr, "File %s has changed while compressing\n", entry->file->path);
+            FileBufferIO_close(file);
+            return 1;
+        }
+        have += want;
+        left -= want;
+
+        // The window is full until the end of the file, so cuts don't depend on reads
+        size_t cut = Chunk_cut(dedup->window, have);
+        uint64_t offset = entry->file->size - left - have;
+        if (dedup_chunk(job, archive, dedup, entry, dedup->window, cut, offset) != 0) {
+            FileBufferIO_close(file);
+            return 1;
+        }
+        memmove(dedup->window, dedup->window + cut, have - cut);
+        have -= cut;
+    }
+    FileBufferIO_close(file);
+
+    if (!entry->repeated && entry->first_store == dedup->stores_count) {
+        return write_whole(job, archive, dedup, entry);
+    }
+    if (flush_store(job, archive, dedup) != 0) {
+        return 1;
+    }
+    return write_chunks(job, archive, dedup, entry);
+}
+
+// Compresses files by chunks, every unique chunk is coded once
+// Files are split one by one, new chunks of every file are coded together like a file of them
+// Returns 0 if success, else 1
+static int compress_dedup(Job* job, FileBufferIO* archive, Queue* files, uint64_t* original_total) {
+    DedupState dedup = {0};
+    dedup.store_capacity = job->opt.memory_limit < CHUNK_MAX ? CHUNK_MAX : job->opt.memory_limit;
+    dedup.index = ChunkIndex_create();
+    dedup.window = (uint8_t*)malloc(CHUNK_MAX);
+    dedup.store = (uint8_t*)malloc(dedup.store_capacity);
+    dedup.compare = (uint8_t*)malloc(CHUNK_MAX);
+    if (!dedup.index || !dedup.window || !dedup.store || !dedup.compare) {
+        fprintf(stderr, "Out of memory\n");
+        if (dedup.index) ChunkIndex_free(dedup.index);
+        free(dedup.window);
+        free(dedup.store);
+        free(dedup.compare);
+        return 1;
+    }
+
+    int status = 0;
+    CompressingFile* compr_file = NULL;
+    while (status == 0 && (compr_file = (CompressingFile*)queue_dequeue(files)) != NULL) {
+        DedupEntry entry = {compr_file, NULL, 0, 0, 0, 0, 0};
+        if (dedup_file(job, archive, &dedup, &entry) != 0) {
+            fprintf(stderr, "Error while compressing %s\n", compr_file->path);
+            status = 1;
+        }
+        *original_total += compr_file->size;
+        pg_update(&job->progress, 1);
+        end_dedup_entry(&entry);
+    }
+
+    if (dedup.source) FileBufferIO_close(dedup.source);
+    for (uint32_t i = 0; i < dedup.sources_count; i++) {
+        free(dedup.sources[i]);
+    }
+    free(dedup.sources);
+    free(dedup.compare);
+    free(dedup.stores);
+    free(dedup.store);
+    free(dedup.window);
+    ChunkIndex_free(dedup.index);
+    return status;
+}
+// == Deduplication ==============================
+
+
+// == Parallel compression =======================
+enum StagedState {
+    STAGED_WAITING,
+    STAGED_DONE,
+    STAGED_FAILED
+};
+
+// Consecutive blocks of a file compressed by a worker into its own staging file
+typedef struct {
+    FileBufferIO* staging;
+    uint64_t compressed_bits;
+    uint8_t codec; // CODEC_STORED if all blocks of the part are stored
+    enum StagedState state;
+} StagedPart;
+
+// File compressed by workers, a file of more blocks than one part is split into parts
+typedef struct {
+    CompressingFile* file;
+    FileSizeResult filesize; // Sizes and block offsets of a file of several parts are summed up by the writer
+    StagedPart* parts;
+    uint64_t parts_count;
+    uint64_t part_blocks; // Blocks of every part but the last one
+    char ready; // The word size of a file of several parts is chosen by the worker of its first part
+} StagedFile;
+
+typedef struct {
+    Job* job;
+    StagedFile* files; // In the order of headers
+    int count;
+    int next; // The file of the next part to be taken by a worker
+    uint64_t next_part;
+    uint64_t taken; // Parts taken by workers
+    uint64_t appended; // Parts appended to the archive
+    uint64_t ahead; // How many parts may be taken ahead of the writer
+    char cancel;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // Signaled on any change of the fields above
+} CompressPool;
+
+// Splits the file into parts if it has more blocks than one part
+// Returns 0 if success, else 1
+static int init_staged(const Job* job, StagedFile* staged, CompressingFile* file) {
+    staged->file = file;
+    staged->parts_count = 1;
+    staged->part_blocks = 1;
+    staged->ready = 0;
+
+    uint32_t block_size = get_block_size(job, file->size);
+    uint64_t blocks_count = get_blocks_count(block_size, file->size);
+    if (!file->members && blocks_count > get_part_blocks(block_size)) {
+        staged->part_blocks = get_part_blocks(block_size);
+        staged->parts_count = (blocks_count + staged->part_blocks - 1) / staged->part_blocks;
+        staged->filesize.original = file->size;
+        staged->filesize.block_size = block_size;
+        staged->filesize.blocks = (FileBlock*)calloc(blocks_count, sizeof(FileBlock));
+        if (!staged->filesize.blocks) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+
+    staged->parts = (StagedPart*)calloc(staged->parts_count, sizeof(StagedPart));
+    if (!staged->parts) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (uint64_t i = 0; i < staged->parts_count; i++) {
+        staged->parts[i].state = STAGED_WAITING;
+    }
+    return 0;
+}
+
+// Compresses the file of one part into a new staging file
+static enum StagedState stage_file(Job* job, StagedFile* staged) {
+    if (staged->file->size == 0) {
+        staged->filesize.original = 0;
+        staged->filesize.codec = CODEC_BLOCKS;
+        staged->filesize.wordsize = 1;
+        return STAGED_DONE;
+    }
+
+    staged->parts[0].staging = FileBufferIO_tmp(BUFFER_SIZE);
+    if (!staged->parts[0].staging) {
+        return STAGED_FAILED;
+    }
+
+    staged->filesize = compress_file(job, staged->parts[0].staging, staged->file);
+    if (staged->filesize.compressed_bits == 0) {
+        return STAGED_FAILED;
+    }
+
+    writebuffer(staged->parts[0].staging);
+    return STAGED_DONE;
+}
+
+// Compresses blocks of the part of the file into a new staging file
+// The worker of the first part chooses the word size of the file, workers of other parts wait for it
+// Block offsets of the part are counted from the part start
+static enum StagedState stage_part(CompressPool* pool, StagedFile* staged, uint64_t part) {
+    Job* job = pool->job;
+    const CompressingFile* file = staged->file;
+    FileBufferIO* file_compress = FileBufferIO_open(file->path, "rb", BUFFER_SIZE);
+    if (part == 0) {
+        uint8_t wordsize = file_compress ? get_wordsize(job, file_compress, file->size) : 0;
+        pthread_mutex_lock(&pool->lock);
+        staged->filesize.wordsize = wordsize;
+        staged->ready = 1;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (!file_compress) {
+        return STAGED_FAILED;
+    }
+
+    StagedPart* staged_part = &staged->parts[part];
+    uint64_t first_block = part * staged->part_blocks;
+    uint64_t start = first_block * staged->filesize.block_size;
+    uint64_t part_size = staged->part_blocks * staged->filesize.block_size;
+    if (part_size > file->size - start) part_size = file->size - start;
+    staged_part->staging = FileBufferIO_tmp(BUFFER_SIZE);
+    if (staged->filesize.wordsize == 0 || !staged_part->staging || seekbits(file_compress, start*8) != 0) {
+        FileBufferIO_close(file_compress);
+        return STAGED_FAILED;
+    }
+
+    staged_part->compressed_bits = compress_blocks(job, staged_part->staging, file_compress, part_size, staged->filesize.block_size,
+        get_streams(job, file->size), staged->filesize.wordsize, staged->filesize.blocks + first_block, &staged_part->codec);
+    FileBufferIO_close(file_compress);
+    if (staged_part->compressed_bits == 0) {
+        return STAGED_FAILED;
+    }
+
+    writebuffer(staged_part->staging);
+    return STAGED_DONE;
+}
+
+static void* compress_worker(void* arg) {
+    CompressPool* pool = (CompressPool*)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->cancel && pool->next < pool->count && pool->taken >= pool->appended + pool->ahead) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->cancel || pool->next >= pool->count) {
+            break;
+        }
+        StagedFile* staged = &pool->files[pool->next];
+        uint64_t part = pool->next_part++;
+        if (pool->next_part == staged->parts_count) {
+            pool->next++;
+            pool->next_part = 0;
+        }
+        pool->taken++;
+
+        // Parts after the first need the word size of the file
+        while (!pool->cancel && part > 0 && !staged->ready) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        char ready = part == 0 || staged->ready;
+        pthread_mutex_unlock(&pool->lock);
+
+        enum StagedState state = STAGED_FAILED;
+        if (staged->parts_count == 1) {
+            state = stage_file(pool->job, staged);
+        } else if (ready) {
+            state = stage_part(pool, staged, part);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        staged->parts[part].state = state;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+// Copies the staging file to the archive, compressed data ends at the byte boundary, so it is copied by whole bytes
+// Returns 0 if success, else 1
+static int copy_staging(FileBufferIO* archive, FileBufferIO* staging) {
+    rewind(staging->fp);
+    char chunk[BUFFER_SIZE];
+    size_t readed;
+    while ((readed = fread(chunk, 1, sizeof(chunk), staging->fp)) > 0) {
+        if (writethrough(archive, chunk, readed) != readed) {
+            fprintf(stderr, "Error while writing the archive\n");
+            return 1;
+        }
+    }
+    if (ferror(staging->fp)) {
+        fprintf(stderr, "Error while reading the staging file\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Appends the header, the staged parts as they are done and the trailer to the archive
+// Offsets of blocks of a file of several parts are moved by the sizes of the parts before them
+// Returns 0 if success, else 1
+static int append_staged(CompressPool* pool, FileBufferIO* archive, StagedFile* staged) {
+    long long header_pos = staged->file->members ? 0 : write_fileheader(pool->job, archive, staged->file);
+    if (header_pos < 0) {
+        return 1;
+    }
+
+    uint64_t blocks_count = get_blocks_count(staged->filesize.block_size, staged->filesize.original);
+    uint64_t compressed_bits = 0;
+    char all_stored = 1;
+    for (uint64_t i = 0; i < staged->parts_count; i++) {
+        StagedPart* part = &staged->parts[i];
+        pthread_mutex_lock(&pool->lock);
+        while (part->state == STAGED_WAITING) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (part->state == STAGED_FAILED || (part->staging && copy_staging(archive, part->staging) != 0)) {
+            return 1;
+        }
+        if (staged->parts_count > 1) {
+            for (uint64_t j = i * staged->part_blocks; j < (i+1) * staged->part_blocks && j < blocks_count; j++) {
+                staged->filesize.blocks[j].offset += compressed_bits / 8;
+            }
+            compressed_bits += part->compressed_bits;
+            all_stored = all_stored && part->codec == CODEC_STORED;
+        }
+
+        // The staging file is not needed anymore
+        if (part->staging) {
+            FileBufferIO_close(part->staging);
+            part->staging = NULL;
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->appended++;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (staged->parts_count > 1) {
+        staged->filesize.compressed_bits = compressed_bits;
+        staged->filesize.codec = all_stored ? CODEC_STORED : CODEC_BLOCKS;
+    }
+
+    if (staged->file->members) {
+        return write_solid(pool->job, archive, staged->file, &staged->filesize);
+    }
+    return write_filetrailer(pool->job, archive, staged->file, header_pos, &staged->filesize);
+}
+
+// Compresses files by job threads into staging files and appends them to the archive in the order of headers
+// Files of several parts are compressed by parts, so threads share one large file too
+// The archive is the same as compress_sequential makes
+// Returns 0 if success, else 1
+static int compress_parallel(Job* job, FileBufferIO* archive, Queue* files, int count, uint64_t* original_total) {
+    CompressPool pool;
+    pool.job = job;
+    pool.count = count;
+    pool.next = 0;
+    pool.next_part = 0;
+    pool.taken = 0;
+    pool.appended = 0;
+    pool.ahead = job->opt.threads * 2;
+    pool.cancel = 0;
+
+    pool.files = (StagedFile*)calloc(count, sizeof(StagedFile));
+    pthread_t* threads = (pthread_t*)malloc(job->opt.threads * sizeof(pthread_t));
+    if (!pool.files || !threads) {
+        fprintf(stderr, "Out of memory\n");
+        free(pool.files);
+        free(threads);
+        return 1;
+    }
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        CompressingFile* file = (CompressingFile*)queue_dequeue(files);
+        if (status == 0 && init_staged(job, &pool.files[i], file) != 0) {
+            status = 1;
+        }
+        pool.files[i].file = file;
+    }
+    if (status != 0) {
+        pool.count = 0;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+
+    unsigned int threads_count = 0;
+    for (; threads_count < job->opt.threads && status == 0; threads_count++) {
+        if (pthread_create(&threads[threads_count], NULL, compress_worker, &pool) != 0) {
+            break;
+        }
+    }
+
+    if (threads_count == 0 && status == 0) {
+        fprintf(stderr, "Can't create threads\n");
+        status = 1;
+    }
+
+    for (int i = 0; i < pool.count && status == 0; i++) {
+        StagedFile* staged = &pool.files[i];
+        if (append_staged(&pool, archive, staged) != 0) {
+            fprintf(stderr, "Error while compressing %s\n", staged->file->path);
+            status = 1;
+            break;
+        }
+        *original_total += staged->filesize.original;
+        pg_update(&job->progress, 1);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.cancel = 1;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+    for (unsigned int i = 0; i < threads_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        for (uint64_t j = 0; pool.files[i].parts && j < pool.files[i].parts_count; j++) {
+            if (pool.files[i].parts[j].staging) FileBufferIO_close(pool.files[i].parts[j].staging);
+        }
+        free(pool.files[i].parts);
+        free(pool.files[i].filesize.blocks);
+        CompressingFile_free(pool.files[i].file);
+    }
+
+    pthread_cond_destroy(&pool.changed);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.files);
+    free(threads);
+    return status;
+}
+// == Parallel compression =======================
+
+int compress(char** paths, int paths_count, char* archivepath, const ArchiverOptions* options) {
+    // Сhecking that the paths have been passed
+    if (paths_count <= 0) {
+        fprintf(stderr, "Nothing to compress\n");
+        return 1;
+    }
+
+    Job job;
+    job.opt = *options;
+    if (job.opt.threads == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        job.opt.threads = processors > 0 ? processors : 1;
+    }
+    if (job.opt.memory_limit == 0) {
+        job.opt.memory_limit = MEMORY_LIMIT_DEFAULT;
+    }
+    if (job.opt.streams == 0) {
+        job.opt.streams = STREAMS_INTERLEAVED;
+    }
+
+    job.catalog = Catalog_create();
+    if (!job.catalog) {
+        return 1;
+    }
+
+    // The archive is written in one pass, so "-" streams it to the standard output
+    char streaming = strcmp(archivepath, "-") == 0;
+    char* unique_archivepath = NULL;
+    FileBufferIO* archive = NULL;
+    if (streaming) {
+        archive = FileBufferIO_stdout(STDOUT_BUFFER_SIZE);
+    } else {
+        // Generate unique archive path
+        unique_archivepath = generate_unique_filepath(archivepath);
+        archive = FileBufferIO_open(unique_archivepath, "wb", BUFFER_SIZE);
+    }
+    if (!archive) {
+        free(unique_archivepath);
+        Catalog_free(job.catalog);
+        return 1;
+    }
+    
+    // Write the archive header and collect files
+    printf("Collecting files...\n");
+    CompressingFilesResult compr_files = prepare_archive(&job, archive, paths_count, paths); 
+    if (compr_files.files == NULL) {
+        free(unique_archivepath);
+        Catalog_free(job.catalog);
+        FileBufferIO_close_remove(archive);
+        return 1;
+    } else if (compr_files.count == 0) {
+        fprintf(stderr, "Nothing to compress\n");
+        free(unique_archivepath);
+        Catalog_free(job.catalog);
+        queue_destroy(&compr_files.files, CompressingFile_free);
+        FileBufferIO_close_remove(archive);
+        return 1;
+    }
+
+    uint64_t original_total = 0;
+
+    printf("Compressing %d files...\n", compr_files.count);
+    // Deduplication reads every file by its path, so files are not packed into solid blocks
+    if (job.opt.solid_size != 0 && !job.opt.dedup && group_solid(&job, &compr_files) != 0) {
+        free(unique_archivepath);
+        Catalog_free(job.catalog);
+        queue_destroy(&compr_files.files, CompressingFile_free);
+        FileBufferIO_close_remove(archive);
+        return 1;
+    }
+    pg_init(&job.progress, compr_files.count + compr_files.total_size*16, 0);
+
+    int status;
+    if (job.opt.dedup) {
+        status = compress_dedup(&job, archive, compr_files.files, &original_total);
+    } else if (job.opt.threads > 1 && compr_files.count > 1) {
+        status = compress_parallel(&job, archive, compr_files.files, compr_files.count, &original_total);
+    } else {
+        status = compress_sequential(&job, archive, compr_files.files, &original_total);
+    }
+    queue_destroy(&compr_files.files, CompressingFile_free);
+    pg_end(&job.progress);
+
+    // The central directory follows the last file
+    if (status == 0) {
+        status = Catalog_write(job.catalog, archive);
+    }
+    Catalog_free(job.catalog);
+
+    if (status != 0) {
+        free(unique_archivepath);
+        FileBufferIO_close_remove(archive);
+        return 1;
+    }
+
+    long long archive_size = tellbits(archive) / 8;
+    FileBufferIO_close(archive);
+
+    printf("Result: %ld -> %lld bytes (k=%.3lf)\n", original_total, archive_size, (double)archive_size/original_total);
+    if (streaming) {
+        printf("Written to the standard output\n");
+    } else {
+        printf("Saved in %s\n", unique_archivepath);
+    }
+    free(unique_archivepath);
+    return 0;
+}
+
+// == Files decompression ========================
+// Decodes words of the stream one by one following the tree
+// Slow, but reports exactly where the stream is broken
+// Returns 0 if success, else 1
+static int decode_tree_walk(FileBufferIO* stream_read, FileBufferIO* stream_write, const HuffmanTree* tree, uint8_t wordsize, unsigned long long words_count) {
+    unsigned long long bit_i = 0;
+    uint32_t node_cur = tree->root;
+    while (words_count > 0) {
+        unsigned char bit = 0;
+        if (!stream_read->readbits(stream_read, &bit, 7, 1)) {
+            fprintf(stderr, "EOF while decompressing, %llu words left\n", words_count);
+            return 1;
+        }
+
+        node_cur = bit ? tree->right[node_cur] : tree->left[node_cur];
+        if (node_cur == HUFFMAN_NO_NODE) {
+            fprintf(stderr, "Corrupted huffman tree or file: no code ends at bit %llu of the word\n", bit_i);
+            return 1;
+        }
+        bit_i++;
+
+        if (HuffmanTree_is_leaf(tree, node_cur)) {
+            uint8_t word[sizeof(int)] = {0};
+            itoword(tree->words[node_cur], word, wordsize);
+            stream_write->writebits(stream_write, word, 0, wordsize*8);
+            node_cur = tree->root;
+            bit_i = 0;
+            words_count--;
+        }
+    }
+
+    return 0;
+}
+
+// Decodes words of the stream directly into the buffer of stream_write until a word has no code
+// Called with a constant wordsize, so it is compiled separately for every word size
+// size_compressed is used only to show progress
+// Returns the number of decoded words
+CPU_KERNEL_INLINE unsigned long long decode_table_words(Job* job, const DecodeTable* table, FileBufferIO* stream_read, FileBufferIO* stream_write, unsigned long long words_count, uint64_t size_compressed, uint8_t wordsize) {
+    unsigned long long reported = 0;
+    unsigned long long i = 0;
+    for (; i < words_count; i++) {
+        int32_t symbol = DecodeTable_next(table, stream_read);
+        if (symbol < 0) {
+            break;
+        }
+
+        if (stream_write->byte_p + wordsize > stream_write->buffer_size) {
+            writebuffer(stream_write);
+            unsigned long long progress = (double)i / words_count * size_compressed;
+            pg_update(&job->progress, progress - reported);
+            reported = progress;
+        }
+        itoword(symbol, (uint8_t*)stream_write->buffer + stream_write->byte_p, wordsize);
+        stream_write->byte_p += wordsize;
+    }
+    if (i == words_count) {
+        pg_update(&job->progress, size_compressed - reported);
+    }
+    return i;
+}
+
+// Decodes words of the stream by DECODE_PRIMARY_BITS per lookup
+// size_compressed is used only to show progress
+// Returns 0 if success, else 1
+static int decode_table(Job* job, FileBufferIO* stream_read, FileBufferIO* stream_write, const uint8_t* lengths, uint8_t wordsize, unsigned long long words_count, uint64_t size_compressed) {
+    DecodeTable table = DecodeTable_build(lengths, ALPHABET_SIZE(wordsize));
+    if (table.size == 0) {
+        return 1;
+    }
+
+    // Words are stored directly into the buffer, so it must not end with a partially written byte
+    if (stream_write->bit_p != 0) {
+        writebuffer(stream_write);
+    }
+
+    unsigned long long decoded = 0;
+    if (wordsize == 1) {
+        decoded = decode_table_words(job, &table, stream_read, stream_write, words_count, size_compressed, 1);
+    } else {
+        decoded = decode_table_words(job, &table, stream_read, stream_write, words_count, size_compressed, 2);
+    }
+    DecodeTable_free(table);
+    if (decoded == words_count) {
+        return 0;
+    }
+
+    // Walk the tree from the broken word to find out what is wrong
+    HuffmanTree* tree = Codes_tree(lengths, ALPHABET_SIZE(wordsize));
+    if (!tree) {
+        return 1;
+    }
+    int status = decode_tree_walk(stream_read, stream_write, tree, wordsize, words_count - decoded);
+    HuffmanTree_free(tree);
+    return status;
+}
+
+// Decodes words of the block of STREAMS_INTERLEAVED streams, the archive is at the byte sizes of the streams
+// Streams are decoded from memory by independent readers, so the lookups of neighbouring words don't wait for each other
+// The block starts at block_start and takes size_compressed bits, it limits the last stream
+// Returns 0 if success, else 1
+static int decode_streams(Job* job, FileBufferIO* archive, FileBufferIO* stream_write, const uint8_t* lengths, uint8_t wordsize, uint64_t size_original, uint64_t block_start, uint64_t size_compressed) {
+    uint64_t block_end = block_start + size_compressed;
+    uint64_t starts[STREAMS_INTERLEAVED+1];
+    uint32_t stream_size = 0;
+    starts[0] = tellbits(archive) + (STREAMS_INTERLEAVED-1)*sizeof(stream_size)*8;
+    for (int j = 0; j + 1 < STREAMS_INTERLEAVED; j++) {
+        if (!archive->readbytes(archive, &stream_size, 0, sizeof(stream_size))) {
+            fprintf(stderr, "EOF while decompressing\n");
+            return 1;
+        }
+        starts[j+1] = starts[j] + (uint64_t)stream_size*8;
+    }
+    starts[STREAMS_INTERLEAVED] = block_end;
+    if (starts[STREAMS_INTERLEAVED-1] > block_end) {
+        fprintf(stderr, "Corrupted file: code streams are longer than the block\n");
+        return 1;
+    }
+
+    // The mapped archive is decoded in place, otherwise the streams are read to memory
+    size_t data_size = (block_end - starts[0]) / 8;
+    uint8_t* data_read = NULL;
+    const uint8_t* data = NULL;
+    if (archive->map) {
+        if (block_end / 8 > archive->buffer_size) {
+            fprintf(stderr, "EOF while decompressing\n");
+            return 1;
+        }
+        data = (const uint8_t*)archive->map + starts[0] / 8;
+    } else {
+        data_read = (uint8_t*)malloc(data_size + 1);
+        if (!data_read) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        if (archive->readbytes(archive, data_read, 0, data_size) / 8 != data_size) {
+            fprintf(stderr, "EOF while decompressing\n");
+            free(data_read);
+            return 1;
+        }
+        data = data_read;
+    }
+
+    DecodeTable table = DecodeTable_build(lengths, ALPHABET_SIZE(wordsize));
+    if (table.size == 0) {
+        free(data_read);
+        return 1;
+    }
+
+    DecodeStream streams[STREAMS_INTERLEAVED];
+    for (int j = 0; j < STREAMS_INTERLEAVED; j++) {
+        streams[j] = DecodeStream_init(data + (starts[j] - starts[0]) / 8, data + data_size);
+    }
+
+    // Words are stored directly into the buffer, so it must not end with a partially written byte
+    if (stream_write->bit_p != 0) {
+        writebuffer(stream_write);
+    }
+
+    unsigned long long words_count = size_original / wordsize;
+    unsigned long long reported = 0;
+    int status = 0;
+    for (unsigned long long i = 0; i < words_count;) {
+        if (stream_write->byte_p + STREAMS_INTERLEAVED*wordsize > stream_write->buffer_size) {
+            writebuffer(stream_write);
+            unsigned long long progress = (double)i / words_count * size_compressed;
+            pg_update(&job->progress, progress - reported);
+            reported = progress;
+        }
+
+        // Every call starts from the first stream, so all calls but the last one take whole groups of words
+        size_t count = (stream_write->buffer_size - stream_write->byte_p) / wordsize / STREAMS_INTERLEAVED * STREAMS_INTERLEAVED;
+        if (count > words_count - i) count = words_count - i;
+
+        size_t decoded = DecodeTable_decode_streams(&table, streams, (uint8_t*)stream_write->buffer + stream_write->byte_p, count, wordsize);
+        stream_write->byte_p += decoded*wordsize;
+        i += decoded;
+        if (decoded < count) {
+            int j = i % STREAMS_INTERLEAVED;
+            fprintf(stderr, "Corrupted huffman tree or file: no code starts at bit %llu of stream %d\n",
+                (unsigned long long)DecodeStream_consumed(&streams[j], data + (starts[j] - starts[0]) / 8), j);
+            status = 1;
+            break;
+        }
+    }
+    DecodeTable_free(table);
+    if (status == 0) {
+        pg_update(&job->progress, size_compressed - reported);
+    }
+
+    // The last incomplete word is stored as is
+    DecodeStream* last = &streams[STREAMS_INTERLEAVED-1];
+    for (unsigned int i = 0; i < size_original % wordsize && status == 0; i++) {
+        if (last->count < 8) DecodeStream_refill(last);
+        if (last->count < 8) {
+            fprintf(stderr, "EOF while decompressing\n");
+            status = 1;
+            break;
+        }
+        uint8_t byte = last->window >> 56;
+        last->window <<= 8;
+        last->count -= 8;
+        stream_write->writebytes(stream_write, &byte, 0, 1);
+    }
+
+    for (int j = 0; j < STREAMS_INTERLEAVED && status == 0; j++) {
+        if (DecodeStream_consumed(&streams[j], data + (starts[j] - starts[0]) / 8) > starts[j+1] - starts[j]) {
+            fprintf(stderr, "Corrupted file: compressed data is longer than expected\n");
+            status = 1;
+        }
+    }
+
+    free(data_read);
+    return status;
+}
+
+// Decodes the tANS block of size_original bytes written by encode_fse at the stream position
+// size_compressed is the block size in bits, the stream of codes ends with the block
+// Returns 0 if success, else 1
+static int decompress_fse(Job* job, FileBufferIO* archive, FileBufferIO* stream_write, uint64_t size_original, uint64_t size_compressed) {
+    uint64_t block_start = tellbits(archive);
+    uint64_t block_end = block_start + size_compressed;
+
+    uint16_t norm[FSE_SYMBOLS];
+    unsigned int table_log = 0;
+    if (Fse_read_counts(archive, norm, &table_log) != 0) {
+        return 1;
+    }
+
+    // The stream starts at the byte boundary after the counts
+    uint64_t stream_start = (tellbits(archive) + 7) / 8 * 8;
+    if (stream_start >= block_end || seekbits(archive, stream_start) != 0) {
+        fprintf(stderr, "Corrupted file: compressed data is longer than expected\n");
+        return 1;
+    }
+
+    // The stream is read from its end, the decoder may load bytes before it, so the mapped archive
+    // is decoded in place only if they are in it, otherwise the stream is read to memory after 8 zero bytes
+    size_t data_size = (block_end - stream_start + 7) / 8;
+    uint8_t* data_read = NULL;
+    const uint8_t* data = NULL;
+    if (archive->map && stream_start / 8 >= 8) {
+        if (stream_start / 8 + data_size > archive->buffer_size) {
+            fprintf(stderr, "EOF while decompressing\n");
+            return 1;
+        }
+        data = (const uint8_t*)archive->map + stream_start / 8;
+    } else {
+        data_read = (uint8_t*)calloc(data_size + 8, 1);
+        if (!data_read) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        if (archive->readbytes(archive, data_read + 8, 0, data_size) / 8 != data_size) {
+            fprintf(stderr, "EOF while decompressing\n");
+            free(data_read);
+            return 1;
+        }
+        data = data_read + 8;
+    }
+
+    FseDecodeTable table;
+    FseDecodeTable_build(&table, norm, table_log);
+    FseDecoder decoder;
+    if (FseDecoder_init(&decoder, &table, data, data_size) != 0) {
+        fprintf(stderr, "Corrupted file: no end of the tANS stream\n");
+        free(data_read);
+        return 1;
+    }
+
+    // Bytes are stored directly into the buffer, so it must not end with a partially written byte
+    if (stream_write->bit_p != 0) {
+        writebuffer(stream_write);
+    }
+
+    unsigned long long reported = 0;
+    int status = 0;
+    for (uint64_t i = 0; i < size_original;) {
+        if (stream_write->byte_p >= stream_write->buffer_size) {
+            writebuffer(stream_write);
+            unsigned long long progress = (double)i / size_original * size_compressed;
+            pg_update(&job->progress, progress - reported);
+            reported = progress;
+        }
+
+        size_t count = stream_write->buffer_size - stream_write->byte_p;
+        if (count > size_original - i) count = size_original - i;
+
+        size_t decoded = Fse_decode(&table, &decoder, (uint8_t*)stream_write->buffer + stream_write->byte_p, count);
+        stream_write->byte_p += decoded;
+        i += decoded;
+        if (decoded < count || count == 0) {
+            fprintf(stderr, "EOF while decompressing\n");
+            status = 1;
+            break;
+        }
+    }
+    if (status == 0 && !FseDecoder_finished(&decoder)) {
+        fprintf(stderr, "Corrupted file: invalid tANS stream\n");
+        status = 1;
+    }
+    if (status == 0) {
+        pg_update(&job->progress, size_compressed - reported);
+    }
+
+    free(data_read);
+    return status;
+}
+
+// Decodes the order-1 block of size_original bytes written by encode_context at the stream position
+// size_compressed is the block size in bits, the codes end with the block
+// Returns 0 if success, else 1
+static int decompress_context(Job* job, FileBufferIO* archive, FileBufferIO* stream_write, uint64_t size_original, uint64_t size_compressed) {
+    uint64_t block_start = tellbits(archive);
+    uint64_t block_end = block_start + size_compressed;
+
+    ContextModel* model = (ContextModel*)malloc(sizeof(ContextModel));
+    if (!model) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (ContextModel_read(archive, model) != 0) {
+        free(model);
+        return 1;
+    }
+
+    // Codes start at the byte boundary after the model
+    uint64_t codes_start = (tellbits(archive) + 7) / 8 * 8;
+    if (codes_start > block_end || seekbits(archive, codes_start) != 0) {
+        fprintf(stderr, "Corrupted file: compressed data is longer than expected\n");
+        free(model);
+        return 1;
+    }
+
+    DecodeTable tables[CONTEXT_TABLES_MAX];
+    unsigned int tables_count = 0;
+    for (; tables_count < model->tables_count; tables_count++) {
+        tables[tables_count] = DecodeTable_build(model->lengths[tables_count], CONTEXT_SYMBOLS);
+        if (tables[tables_count].size == 0) break;
+    }
+    const DecodeTable* by_prev[CONTEXT_SYMBOLS];
+    for (unsigned int c = 0; c < CONTEXT_SYMBOLS; c++) {
+        by_prev[c] = &tables[model->map[c]];
+    }
+    char built = tables_count == model->tables_count;
+    free(model);
+    if (!built) {
+        for (unsigned int k = 0; k < tables_count; k++) DecodeTable_free(tables[k]);
+        return 1;
+    }
+
+    // The mapped archive is decoded in place, otherwise the codes are read to memory
+    size_t data_size = (block_end - codes_start) / 8;
+    uint8_t* data_read = NULL;
+    const uint8_t* data = NULL;
+    if (archive->map) {
+        if (block_end / 8 > archive->buffer_size) {
+            fprintf(stderr, "EOF while decompressing\n");
+            for (unsigned int k = 0; k < tables_count; k++) DecodeTable_free(tables[k]);
+            return 1;
+        }
+        data = (const uint8_t*)archive->map + codes_start / 8;
+    } else {
+        data_read = (uint8_t*)malloc(data_size + 1);
+        if (!data_read || archive->readbytes(archive, data_read, 0, data_size) / 8 != data_size) {
+            fprintf(stderr, data_read ? "EOF while decompressing\n" : "Out of memory\n");
+            for (unsigned int k = 0; k < tables_count; k++) DecodeTable_free(tables[k]);
+            free(data_read);
+            return 1;
+        }
+        data = data_read;
+    }
+
+    // Bytes are stored directly into the buffer, so it must not end with a partially written byte
+    if (stream_write->bit_p != 0) {
+        writebuffer(stream_write);
+    }
+
+    DecodeStream stream = DecodeStream_init(data, data + data_size);
+    uint8_t prev = 0;
+    unsigned long long reported = 0;
+    int status = 0;
+    for (uint64_t i = 0; i < size_original && status == 0;) {
+        if (stream_write->byte_p >= stream_write->buffer_size) {
+            writebuffer(stream_write);
+            unsigned long long progress = (double)i / size_original * size_compressed;
+            pg_update(&job->progress, progress - reported);
+            reported = progress;
+        }
+
+        size_t count = stream_write->buffer_size - stream_write->byte_p;
+        if (count > size_original - i) count = size_original - i;
+
+        size_t decoded = Context_decode(by_prev, &stream, (uint8_t*)stream_write->buffer + stream_write->byte_p, count, &prev);
+        stream_write->byte_p += decoded;
+        i += decoded;
+        if (decoded < count || count == 0) {
+            fprintf(stderr, "Corrupted huffman tree or file: no code starts at bit %llu of the block\n",
+                    (unsigned long long)(codes_start - block_start + DecodeStream_consumed(&stream, data)));
+            status = 1;
+        }
+    }
+    if (status == 0 && DecodeStream_consumed(&stream, data) > block_end - codes_start) {
+        fprintf(stderr, "Corrupted file: compressed data is longer than expected\n");
+        status = 1;
+    }
+    if (status == 0) {
+        pg_update(&job->progress, size_compressed - reported);
+    }
+
+    for (unsigned int k = 0; k < tables_count; k++) DecodeTable_free(tables[k]);
+    free(data_read);
+    return status;
+}
+
+// Reads count extra bits of a length or a distance
+// Returns 0 if success, else 1
+static int read_extra(FileBufferIO* archive, unsigned int count, uint32_t* extra) {
+    *extra = 0;
+    if (count == 0) return 0;
+    *extra = peekbits(archive, count);
+    if (archive->window_count < count) {
+        return 1;
+    }
+    consumebits(archive, count);
+    return 0;
+}
+
+// Decodes the LZ77 block of size_original bytes written by encode_lz at the stream position
+// size_compressed is the block size in bits, it limits the block data
+// Returns 0 if success, else 1
+static int decompress_lz(Job* job, FileBufferIO* archive, FileBufferIO* file_decompress, uint64_t size_original, uint64_t size_compressed) {
+    long long blockstart = tellbits(archive);
+
+    uint8_t litlen_lengths[LZ_LITLEN_SIZE];
+    uint8_t distance_lengths[LZ_DISTANCE_CODES];
+    if (Lengths_read(archive, litlen_lengths, LZ_LITLEN_SIZE) != 0 || Lengths_read(archive, distance_lengths, LZ_DISTANCE_CODES) != 0) {
+        return 1;
+    }
+
+    DecodeTable litlen = DecodeTable_build(litlen_lengths, LZ_LITLEN_SIZE);
+    if (litlen.size == 0) {
+        return 1;
+    }
+    DecodeTable distance = DecodeTable_build(distance_lengths, LZ_DISTANCE_CODES);
+    if (distance.size == 0) {
+        DecodeTable_free(litlen);
+        return 1;
+    }
+
+    // Matches refer back to the decoded block, so it is decoded in memory
+    uint8_t* data = (uint8_t*)malloc(size_original ? size_original : 1);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        DecodeTable_free(distance);
+        DecodeTable_free(litlen);
+        return 1;
+    }
+
+    uint64_t pos = 0;
+    uint64_t next_report = 1 << 20;
+    unsigned long long reported = 0;
+    int status = 0;
+    while (pos < size_original) {
+        if (pos >= next_report) {
+            unsigned long long progress = (double)pos / size_original * size_compressed;
+            pg_update(&job->progress, progress - reported);
+            reported = progress;
+            next_report = pos + (1 << 20);
+        }
+
+        int32_t symbol = DecodeTable_next(&litlen, archive);
+        if (symbol < 0) {
+            fprintf(stderr, "Corrupted huffman tree or file: no code starts at bit %llu of the block\n", (unsigned long long)(tellbits(archive) - blockstart));
+            status = 1;
+            break;
+        }
+        if (symbol < 256) {
+            data[pos++] = symbol;
+            continue;
+        }
+
+        unsigned int extra_bits;
+        uint32_t extra;
+        uint32_t length = LZ_MIN_MATCH + Lz_bucket_base(symbol - 256, &extra_bits);
+        if (read_extra(archive, extra_bits, &extra) != 0) {
+            fprintf(stderr, "EOF while decompressing\n");
+            status = 1;
+            break;
+        }
+        length += extra;
+
+        symbol = DecodeTable_next(&distance, archive);
+        if (symbol < 0) {
+            fprintf(stderr, "Corrupted huffman tree or file: no code starts at bit %llu of the block\n", (unsigned long long)(tellbits(archive) - blockstart));
+            status = 1;
+            break;
+        }
+        uint32_t dist = 1 + Lz_bucket_base(symbol, &extra_bits);
+        if (read_extra(archive, extra_bits, &extra) != 0) {
+            fprintf(stderr, "EOF while decompressing\n");
+            status = 1;
+            break;
+        }
+        dist += extra;
+
+        if (dist > pos || length > size_original - pos) {
+            fprintf(stderr, "Corrupted file: invalid match\n");
+            status = 1;
+            break;
+        }
+
+        // Overlapping matches repeat the bytes just copied
+        const uint8_t* src = data + pos - dist;
+        if (dist >= length) {
+            memcpy(data + pos, src, length);
+        } else {
+            for (uint32_t i = 0; i < length; i++) data[pos + i] = src[i];
+        }
+        pos += length;
+    }
+    DecodeTable_free(distance);
+    DecodeTable_free(litlen);
+
+    if (status == 0 && (unsigned long long)(tellbits(archive) - blockstart) > size_compressed) {
+        fprintf(stderr, "Corrupted file: compressed data is longer than expected\n");
+        status = 1;
+    }
+    if (status == 0 && writethrough(file_decompress, data, size_original) != size_original) {
+        fprintf(stderr, "Error while writing the file\n");
+        status = 1;
+    }
+    if (status == 0) {
+        pg_update(&job->progress, size_compressed - reported);
+    }
+
+    free(data);
+    return status;
+}
+
+// Decompresses one block of size_original bytes starting at the stream position
+// size_compressed is the block size in bits, it limits the block data
+// Codes of the block form streams streams, 1 or STREAMS_INTERLEAVED, blocks of CODEC_LZ, CODEC_FSE and CODEC_CONTEXT have one stream
+// Huffman codes are codes of words of wordsize bytes, lengths must hold ALPHABET_SIZE(wordsize) items
+// Returns 0 if success, else 1
+static int decompress_block(Job* job, FileBufferIO* archive, uint8_t codec, uint8_t streams, uint8_t wordsize, FileBufferIO* file_decompress, uint8_t* lengths, uint64_t size_original, uint64_t size_compressed) {
+    if (codec == CODEC_LZ) {
+        return decompress_lz(job, archive, file_decompress, size_original, size_compressed);
+    }
+    if (codec == CODEC_FSE) {
+        return decompress_fse(job, archive, file_decompress, size_original, size_compressed);
+    }
+    if (codec == CODEC_CONTEXT) {
+        return decompress_context(job, archive, file_decompress, size_original, size_compressed);
+    }
+
+    long long blockstart = tellbits(archive);
+
+    unsigned int lengths_size = ALPHABET_SIZE(wordsize);
+    if (Lengths_read(archive, lengths, lengths_size) != 0) {
+        return 1;
+    }
+
+    if (streams == STREAMS_INTERLEAVED) {
+        // Streams start at the byte boundary after the code lengths
+        long long streams_start = (tellbits(archive) + 7) / 8 * 8;
+        if ((unsigned long long)(streams_start - blockstart) > size_compressed || seekbits(archive, streams_start) != 0) {
+            fprintf(stderr, "Corrupted file: compressed data is longer than expected\n");
+            return 1;
+        }
+        return decode_streams(job, archive, file_decompress, lengths, wordsize, size_original, blockstart, size_compressed);
+    }
+
+    unsigned long long words_count = size_original / wordsize;
+    if (decode_table(job, archive, file_decompress, lengths, wordsize, words_count, size_compressed) != 0) {
+        return 1;
+    }
+
+    // The last incomplete word is stored as is
+    for (unsigned int i = 0; i < size_original % wordsize; i++) {
+        uint8_t byte = 0;
+        if (archive->readbits(archive, &byte, 0, 8) != 8) {
+            fprintf(stderr, "EOF while decompressing\n");
+            return 1;
+        }
+        file_decompress->writebytes(file_decompress, &byte, 0, 1);
+    }
+
+    if ((unsigned long long)(tellbits(archive) - blockstart) > size_compressed) {
+        fprintf(stderr, "Corrupted file: compressed data is longer than expected\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Stored files are copied by chunks of this size if the archive is not mapped
+#define STORED_CHUNK_SIZE (1 << 20)
+
+// Copies size bytes stored at start bits of the archive, a stored file or a stored block
+// The mapped archive is written right from its pages by one call
+// Returns 0 if success, else 1
+static int copy_stored(Job* job, FileBufferIO* archive, FileBufferIO* file_decompress, uint64_t start, uint64_t size) {
+    if (archive->map) {
+        if (writethrough(file_decompress, archive->map + start / 8, size) != size) {
+            fprintf(stderr, "Error while writing the file\n");
+            return 1;
+        }
+        pg_update(&job->progress, size*8);
+        return 0;
+    }
+
+    if (seekbits(archive, start) != 0) {
+        fprintf(stderr, "Fseek error\n");
+        return 1;
+    }
+
+    uint8_t* chunk = (uint8_t*)malloc(STORED_CHUNK_SIZE);
+    if (!chunk) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (uint64_t left = size; left > 0;) {
+        size_t chunk_len = left < STORED_CHUNK_SIZE ? left : STORED_CHUNK_SIZE;
+        if (archive->readbytes(archive, chunk, 0, chunk_len) / 8 != chunk_len) {
+            fprintf(stderr, "EOF while decompressing\n");
+            free(chunk);
+            return 1;
+        }
+        if (writethrough(file_decompress, chunk, chunk_len) != chunk_len) {
+            fprintf(stderr, "Error while writing the file\n");
+            free(chunk);
+            return 1;
+        }
+        pg_update(&job->progress, chunk_len*8);
+        left -= chunk_len;
+    }
+
+    free(chunk);
+    return 0;
+}
+
+// Decodes blocks from first to end of the header frame by their codecs, stored blocks are copied
+// Returns 0 if success, else 1
+static int decode_blocks(Job* job, FileBufferIO* archive, FileBufferIO* file_decompress, const HeaderFrame* header_frame, uint64_t first, uint64_t end) {
+    unsigned int lengths_size = ALPHABET_SIZE(header_frame->wordsize);
+    uint8_t* lengths = (uint8_t*)malloc(lengths_size);
+    if (!lengths) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (uint64_t i = first; i < end; i++) {
+        uint64_t block_start = header_frame->blocks[i].offset*8;
+        uint64_t block_end = i+1 < header_frame->blocks_count ? header_frame->blocks[i+1].offset*8 : header_frame->size_compressed;
+        if (block_start >= block_end || block_end > header_frame->size_compressed) {
+            fprintf(stderr, "Corrupted file: invalid block index\n");
+            free(lengths);
+            return 1;
+        }
+
+        uint64_t left = header_frame->size_original - i * header_frame->block_size;
+        uint64_t block_len = header_frame->block_size == 0 || left < header_frame->block_size ? left : header_frame->block_size;
+        if (header_frame->blocks[i].codec == CODEC_STORED) {
+            if (block_end - block_start != block_len*8) {
+                fprintf(stderr, "Corrupted file: invalid size of the stored block\n");
+                free(lengths);
+                return 1;
             }
-            for (int i = 0; i < wordsize; i++) {
-                lastword[i] = word[i];
+            if (copy_stored(job, archive, file_decompress, header_frame->filestart + block_start, block_len) != 0) {
+                free(lengths);
+                return 1;
             }
-            lastword_size = readed;
-        } else {
-            freqs[wordtoi(word)]++;
+            continue;
         }
-        pg_update(readed);
+
+        if (seekbits(archive, header_frame->filestart + block_start) != 0) {
+            fprintf(stderr, "Fseek error\n");
+            free(lengths);
+            return 1;
+        }
+        if (decompress_block(job, archive, header_frame->blocks[i].codec, header_frame->streams, header_frame->wordsize, file_decompress, lengths, block_len, block_end - block_start) != 0) {
+            free(lengths);
+            return 1;
+        }
+    }
+    free(lengths);
+
+    return 0;
+}
+
+// Decodes the blocks of the header frame by their codecs or copies the stored data
+// Returns 0 if success, else 1
+static int decompress_blocks(Job* job, FileBufferIO* archive, FileBufferIO* file_decompress, HeaderFrame* header_frame) {
+    // Pages of the file are needed soon
+    FileBufferIO_advise(archive, header_frame->filestart / 8, (header_frame->size_compressed + 7) / 8, MADV_WILLNEED);
+
+    if (header_frame->codec == CODEC_STORED) {
+        return copy_stored(job, archive, file_decompress, header_frame->filestart, header_frame->size_original);
+    }
+    return decode_blocks(job, archive, file_decompress, header_frame, 0, header_frame->blocks_count);
+}
+
+// Decoders flush the output before it has no room for a word of every stream,
+// so the memory writer of a solid block or of a part of a file has this many extra bytes and is never flushed
+#define SOLID_SLACK (STREAMS_INTERLEAVED * 2)
+
+// Decoded solid block, files of a block follow each other, so it is decoded once for all of them
+typedef struct {
+    uint64_t pos; // Trailer of the block in bytes, 0 - the slot is empty
+    uint64_t size; // bytes
+    FileBufferIO* data; // Memory writer holding the decoded block in its buffer
+    unsigned int users; // Threads decoding the block or copying files from it
+    char loading;
+    uint64_t used; // Clock of the cache when the block was taken last
+} SolidSlot;
+
+// Chunks of a file may alternate between stores, so a few blocks are kept besides the ones in use
+#define SOLID_CACHE_SLOTS 4
+
+// Solid blocks shared by the threads of one decompression
+// Every thread uses one block at a time, so there are always free slots if they outnumber threads
+// The least recently used free slot is taken for a new block
+typedef struct {
+    SolidSlot* slots;
+    unsigned int slots_count;
+    uint64_t clock;
+    pthread_mutex_t* lock; // NULL if the cache has one thread
+    pthread_cond_t* changed; // Signaled when a block is decoded or released
+} SolidCache;
+
+static void end_solid_cache(SolidCache* solid) {
+    for (unsigned int i = 0; i < solid->slots_count; i++) {
+        if (solid->slots[i].data) FileBufferIO_close(solid->slots[i].data);
+        solid->slots[i].data = NULL;
+        solid->slots[i].pos = 0;
+    }
+}
+
+// Reads the trailer of the solid block at pos bytes into the header frame, its data precedes the trailer
+// Returns 0 if success, else 1
+// !!! After use, run "end_header_frame" !!!
+static int read_solid_trailer(FileBufferIO* archive, uint64_t pos, HeaderFrame* header_frame) {
+    if (seekbits(archive, pos*8) != 0
+        || !archive->readbytes(archive, &header_frame->size_compressed, 0, sizeof(header_frame->size_compressed))
+        || !archive->readbytes(archive, &header_frame->size_original, 0, sizeof(header_frame->size_original))
+        || !archive->readbytes(archive, &header_frame->streams, 0, sizeof(header_frame->streams))
+        || !archive->readbytes(archive, &header_frame->codec, 0, sizeof(header_frame->codec))
+        || !archive->readbytes(archive, &header_frame->wordsize, 0, sizeof(header_frame->wordsize))
+        || !archive->readbytes(archive, &header_frame->block_size, 0, sizeof(header_frame->block_size))) {
+        fprintf(stderr, "Corrupted file: EOF while reading the solid block\n");
+        return 1;
+    }
+
+    uint64_t data_size = (header_frame->size_compressed + 7) / 8;
+    if (data_size == 0 || pos < sizeof(archive_signature) || data_size > pos - sizeof(archive_signature)
+        || (header_frame->streams != 1 && header_frame->streams != STREAMS_INTERLEAVED) || header_frame->wordsize == 0 || header_frame->wordsize > 2
+        || (header_frame->codec != CODEC_BLOCKS && header_frame->codec != CODEC_STORED)
+        || (header_frame->codec == CODEC_STORED && (header_frame->size_compressed % 8 != 0 || header_frame->size_compressed / 8 != header_frame->size_original))) {
+        fprintf(stderr, "Corrupted file: invalid solid block\n");
+        return 1;
+    }
+    header_frame->filestart = (pos - data_size)*8;
+    return read_block_index(archive, header_frame);
+}
+
+// Decodes the solid block with the trailer at pos bytes into a new memory writer
+// Chunks of deduplication may also refer to the header of a file written whole, it is decoded the same way
+// Returns NULL if the block is corrupted or out of memory
+// !!! After use, run "FileBufferIO_close" if non-null !!!
+static FileBufferIO* decode_solid(Job* job, FileBufferIO* archive, uint64_t pos) {
+    HeaderFrame header_frame = {0};
+    long long index = Catalog_find_header(job->catalog, pos);
+    int status = index >= 0 ? read_header_frame(job, archive, index, &header_frame) : read_solid_trailer(archive, pos, &header_frame);
+    if (status != 0) {
+        end_header_frame(&header_frame);
+        return NULL;
+    }
+
+    uint8_t codec = header_frame.codec;
+    if (header_frame.size_original == 0 || header_frame.size_original > SOLID_SIZE_MAX
+        || (codec != CODEC_BLOCKS && codec != CODEC_STORED)) {
+        fprintf(stderr, "Corrupted file: invalid solid block\n");
+        end_header_frame(&header_frame);
+        return NULL;
+    }
+
+    FileBufferIO* data = FileBufferIO_memory_writer(header_frame.size_original + SOLID_SLACK);
+    if (!data) {
+        end_header_frame(&header_frame);
+        return NULL;
+    }
+    status = decompress_blocks(job, archive, data, &header_frame);
+
+    // The last whole byte may still be counted by bits
+    syncbits(data);
+    if (status == 0 && (data->byte_p + data->bit_p / 8 != header_frame.size_original || data->bit_p % 8 != 0)) {
+        fprintf(stderr, "Corrupted file: invalid size of the solid block\n");
+        status = 1;
     }
+    end_header_frame(&header_frame);
+    if (status != 0) {
+        FileBufferIO_close(data);
+        return NULL;
+    }
+    return data;
+}
 
-    // Building a tree
-    TreeBuilder* tree_builder = TreeBuilder_create(freqs_size+1);
-    for (unsigned int i = 0; i < freqs_size; i++) {
-        if (freqs[i]==0) {
+// Returns the slot of the decoded solid block with the trailer at pos bytes, the block is decoded if it isn't in the cache
+// Returns NULL if the block is corrupted or out of memory
+// !!! After use, run "release_solid" if non-null !!!
+static SolidSlot* acquire_solid(Job* job, FileBufferIO* archive, SolidCache* solid, uint64_t pos) {
+    if (solid->lock) pthread_mutex_lock(solid->lock);
+    SolidSlot* slot = NULL;
+    while (!slot) {
+        for (unsigned int i = 0; i < solid->slots_count && !slot; i++) {
+            if (solid->slots[i].pos == pos) slot = &solid->slots[i];
+        }
+        if (slot && slot->loading) {
+            // Another thread is decoding the block
+            slot = NULL;
+            pthread_cond_wait(solid->changed, solid->lock);
             continue;
         }
-        itoword(i, word);
-        
-        HuffmanNode* node = HuffmanNode_create(wordsize*8, word, freqs[i], NULL, NULL);
-        if (!node) {
-            fprintf(stderr, "Out of memory\n");
-            FileBufferIO_close(file_compress);
-            free(freqs);
-            free(word);
-            free(lastword);
-            TreeBuilder_free(tree_builder);
-            return filesize;
+        if (slot) {
+            slot->users++;
+            slot->used = ++solid->clock;
+            if (solid->lock) pthread_mutex_unlock(solid->lock);
+            return slot;
         }
 
-        tree_builder->insert(tree_builder, node);
+        for (unsigned int i = 0; i < solid->slots_count; i++) {
+            if (solid->slots[i].users == 0 && (!slot || solid->slots[i].used < slot->used)) slot = &solid->slots[i];
+        }
+        if (!slot) {
+            pthread_cond_wait(solid->changed, solid->lock);
+        }
     }
 
-    if (lastword) {
-        HuffmanNode* node = HuffmanNode_create(lastword_size, lastword, 1, NULL, NULL);
-        if (!node) {
-            fprintf(stderr, "Out of memory\n");
-            FileBufferIO_close(file_compress);
-            free(freqs);
-            free(word);
-            free(lastword);
-            TreeBuilder_free(tree_builder);
-            return filesize;
-        }
-        tree_builder->insert(tree_builder, node);
-        free(lastword);
+    FileBufferIO* old_data = slot->data;
+    slot->pos = pos;
+    slot->data = NULL;
+    slot->users = 1;
+    slot->loading = 1;
+    slot->used = ++solid->clock;
+    if (solid->lock) pthread_mutex_unlock(solid->lock);
+
+    if (old_data) FileBufferIO_close(old_data);
+    FileBufferIO* data = decode_solid(job, archive, pos);
+
+    if (solid->lock) pthread_mutex_lock(solid->lock);
+    slot->data = data;
+    slot->size = data ? data->byte_p + data->bit_p / 8 : 0;
+    slot->loading = 0;
+    if (!data) {
+        slot->pos = 0;
+        slot->users = 0;
+        slot = NULL;
+    }
+    if (solid->lock) {
+        pthread_cond_broadcast(solid->changed);
+        pthread_mutex_unlock(solid->lock);
     }
+    return slot;
+}
 
-    free(freqs);
+static void release_solid(SolidCache* solid, SolidSlot* slot) {
+    if (solid->lock) pthread_mutex_lock(solid->lock);
+    slot->users--;
+    if (solid->lock) {
+        pthread_cond_broadcast(solid->changed);
+        pthread_mutex_unlock(solid->lock);
+    }
+}
 
-    HuffmanNode* tree = tree_builder->extract_tree(tree_builder);
+// Copies the file of the header frame from its decoded solid block
+// Returns 0 if success, else 1
+static int copy_solid(Job* job, FileBufferIO* archive, FileBufferIO* file_decompress, HeaderFrame* header_frame, SolidCache* solid) {
+    SolidSlot* slot = acquire_solid(job, archive, solid, header_frame->solid_pos);
+    if (!slot) {
+        return 1;
+    }
 
-    TreeBuilder_free(tree_builder);
+    int status = 0;
+    if (header_frame->solid_offset > slot->size || header_frame->size_original > slot->size - header_frame->solid_offset) {
+        fprintf(stderr, "Corrupted file: the file is out of its solid block\n");
+        status = 1;
+    } else if (writethrough(file_decompress, slot->data->buffer + header_frame->solid_offset, header_frame->size_original) != header_frame->size_original) {
+        fprintf(stderr, "Error while writing the file\n");
+        status = 1;
+    }
 
-    // Tree encoding
-    Codes codes = Codes_build(tree);
-    if (codes.size == 0) {
-        free(word);
-        FileBufferIO_close(file_compress);
-        return filesize;
+    release_solid(solid, slot);
+    return status;
+}
+
+// Writes chunks of the file of the header frame one by one from their decoded stores
+// Returns 0 if success, else 1
+static int copy_chunks(Job* job, FileBufferIO* archive, FileBufferIO* file_decompress, HeaderFrame* header_frame, SolidCache* solid) {
+    for (uint64_t i = 0; i < header_frame->chunks_count; i++) {
+        const ChunkRef* chunk = &header_frame->chunks[i];
+        SolidSlot* slot = acquire_solid(job, archive, solid, chunk->store);
+        if (!slot) {
+            return 1;
+        }
+
+        int status = 0;
+        if (chunk->offset > slot->size || chunk->size > slot->size - chunk->offset) {
+            fprintf(stderr, "Corrupted file: the chunk is out of its store\n");
+            status = 1;
+        } else if (writethrough(file_decompress, slot->data->buffer + chunk->offset, chunk->size) != chunk->size) {
+            fprintf(stderr, "Error while writing the file\n");
+            status = 1;
+        }
+
+        release_solid(solid, slot);
+        if (status != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Decompresses the file of the header frame from the archive
+// solid keeps solid blocks decoded by the caller
+// Returns 0 if success, else 1
+static int decompress_file(Job* job, FileBufferIO* archive, FileBufferIO* file_decompress, HeaderFrame* header_frame, SolidCache* solid) {
+    if (header_frame->codec == CODEC_SOLID) {
+        return copy_solid(job, archive, file_decompress, header_frame, solid);
+    }
+    if (header_frame->codec == CODEC_CHUNKS) {
+        return copy_chunks(job, archive, file_decompress, header_frame, solid);
     }
 
-    // File compression
-    rewind(file_compress->fp);
+    return decompress_blocks(job, archive, file_decompress, header_frame);
+}
+// == Files decompression ========================
 
-    uint32_t compress_treesize = fwrite_tree(tree, archive); // Tree size in bits
-    filesize.compressed_bits = compress_treesize; // Compressed file size in bits
 
-    HuffmanNode_freetree(tree);
+// == Parallel decompression =====================
+// File to be decompressed by workers, a file of more blocks than one part is decoded by parts
+typedef struct {
+    FileBufferIO* file_decompress;
+    HeaderFrame header; // Without the name, the block index and the chunk list are owned by the file
+    uint64_t parts_count;
+    uint64_t part_blocks; // Blocks of every part but the last one
+    uint64_t parts_left; // Parts not finished yet, the worker of the last one closes the file
+} ExtractFile;
+
+// Part of a file to be decompressed by a worker
+typedef struct {
+    ExtractFile* file;
+    uint64_t part;
+} ExtractTask;
 
-    // Compression with code compression
-    while (1) {
-        size_t readed = file_compress->readbytes(file_compress, word, 0, wordsize);
+typedef struct {
+    Job* job;
+    FileBufferIO* archive; // Every worker reads it by its own reader
+    ExtractTask* tasks; // Ring of "ahead" tasks
+    int ahead; // How many files may be submitted and not finished
+    unsigned long long added;
+    unsigned long long taken;
+    unsigned long long finished;
+    char closed; // No more files will be submitted
+    char failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // Signaled on any change of the fields above
+    pthread_t* threads;
+    unsigned int threads_count;
+    SolidCache solid; // Shared by workers under the lock
+} ExtractPool;
+
+static void end_extract_file(ExtractFile* file) {
+    FileBufferIO_close(file->file_decompress);
+    free(file->header.blocks);
+    free(file->header.chunks);
+    free(file);
+}
+
+// Decodes the part of the file into memory and writes it at its place in the file
+// Returns 0 if success, else 1
+static int decompress_part(Job* job, FileBufferIO* archive, const ExtractFile* file, uint64_t part) {
+    const HeaderFrame* header_frame = &file->header;
+    uint64_t first = part * file->part_blocks;
+    uint64_t end = first + file->part_blocks < header_frame->blocks_count ? first + file->part_blocks : header_frame->blocks_count;
+    uint64_t start = first * header_frame->block_size;
+    uint64_t size = end * header_frame->block_size < header_frame->size_original ? end * header_frame->block_size - start : header_frame->size_original - start;
+
+    FileBufferIO* data = FileBufferIO_memory_writer(size + SOLID_SLACK);
+    if (!data) {
+        return 1;
+    }
+    int status = decode_blocks(job, archive, data, header_frame, first, end);
+
+    // The last whole byte may still be counted by bits
+    syncbits(data);
+    if (status == 0 && (data->byte_p + data->bit_p / 8 != size || data->bit_p % 8 != 0)) {
+        fprintf(stderr, "Corrupted file: invalid size of the block\n");
+        status = 1;
+    }
 
-        if (readed == 0) {
+    // Parts of the file are written by different threads, so every part is written by positional writes
+    int fd = fileno(file->file_decompress->fp);
+    for (uint64_t written = 0; status == 0 && written < size;) {
+        ssize_t wrote = pwrite(fd, data->buffer + written, size - written, start + written);
+        if (wrote <= 0) {
+            fprintf(stderr, "Error while writing the file\n");
+            status = 1;
             break;
         }
+        written += wrote;
+    }
+    FileBufferIO_close(data);
+    return status;
+}
 
-        uint8_t* code;
-        size_t size;
-        if (readed != wordsize*8) {
-            code = codes.codes[codes.size-1].code;
-            size = codes.codes[codes.size-1].size;
-        } else {
-            code = codes.codes[wordtoi(word)].code;
-            size = codes.codes[wordtoi(word)].size;
+static void* extract_worker(void* arg) {
+    ExtractPool* pool = (ExtractPool*)arg;
+
+    FileBufferIO* archive = FileBufferIO_reader(pool->archive);
+
+    pthread_mutex_lock(&pool->lock);
+    if (!archive) {
+        pool->failed = 1;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    while (archive && !pool->failed) {
+        while (!pool->failed && !pool->closed && pool->taken == pool->added) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->failed || pool->taken == pool->added) {
+            break;
         }
-        filesize.compressed_bits += archive->writebits(archive, code, 0, size);
-        pg_update(readed);
+        ExtractTask task = pool->tasks[pool->taken++ % pool->ahead];
+        pthread_mutex_unlock(&pool->lock);
+
+        ExtractFile* file = task.file;
+        int status = file->parts_count == 1 ? decompress_file(pool->job, archive, file->file_decompress, &file->header, &pool->solid)
+            : decompress_part(pool->job, archive, file, task.part);
+
+        pthread_mutex_lock(&pool->lock);
+        char last = --file->parts_left == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (last) end_extract_file(file);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        if (status != 0) pool->failed = 1;
+        pthread_cond_broadcast(&pool->changed);
     }
-    free(word);
-    Codes_free(codes);
-    
-    FileBufferIO_close(file_compress);
+    pthread_mutex_unlock(&pool->lock);
 
-    fwrite_compressed_filesize(archive, size_pos, filesize.compressed_bits, compress_treesize, filestart);
+    if (archive) FileBufferIO_close(archive);
+    return NULL;
+}
 
-    return filesize;
+// Starts job threads reading the archive
+// Returns 0 if success, else 1
+static int extract_pool_start(ExtractPool* pool, Job* job, FileBufferIO* archive) {
+    pool->job = job;
+    pool->archive = archive;
+    pool->ahead = job->opt.threads * 2;
+    pool->added = 0;
+    pool->taken = 0;
+    pool->finished = 0;
+    pool->closed = 0;
+    pool->failed = 0;
+    pool->threads_count = 0;
+
+    pool->tasks = (ExtractTask*)malloc(pool->ahead * sizeof(ExtractTask));
+    pool->threads = (pthread_t*)malloc(job->opt.threads * sizeof(pthread_t));
+    pool->solid.slots_count = job->opt.threads + SOLID_CACHE_SLOTS;
+    pool->solid.clock = 0;
+    pool->solid.slots = (SolidSlot*)calloc(pool->solid.slots_count, sizeof(SolidSlot));
+    if (!pool->tasks || !pool->threads || !pool->solid.slots) {
+        fprintf(stderr, "Out of memory\n");
+        free(pool->tasks);
+        free(pool->threads);
+        free(pool->solid.slots);
+        return 1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+    pool->solid.lock = &pool->lock;
+    pool->solid.changed = &pool->changed;
+    for (; pool->threads_count < job->opt.threads; pool->threads_count++) {
+        if (pthread_create(&pool->threads[pool->threads_count], NULL, extract_worker, pool) != 0) {
+            break;
+        }
+    }
+
+    if (pool->threads_count == 0) {
+        fprintf(stderr, "Can't create threads\n");
+        pthread_cond_destroy(&pool->changed);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->tasks);
+        free(pool->threads);
+        free(pool->solid.slots);
+        return 1;
+    }
+    return 0;
 }
 
-int compress(char** paths, int paths_count, char* archivepath) {
-    // Сhecking that the paths have been passed
-    if (paths_count <= 0) {
-        fprintf(stderr, "Nothing to compress\n");
+// Passes the file to workers, the file, the block index and the chunk list of the frame are owned by the pool after the call
+// Blocks of a file of several parts are decoded by different workers
+// Returns 0 if success, else 1 if a worker has failed
+static int extract_pool_submit(ExtractPool* pool, FileBufferIO* file_decompress, HeaderFrame* header_frame) {
+    ExtractFile* file = (ExtractFile*)malloc(sizeof(ExtractFile));
+    if (!file) {
+        fprintf(stderr, "Out of memory\n");
+        FileBufferIO_close(file_decompress);
         return 1;
     }
+    file->file_decompress = file_decompress;
+    file->header = *header_frame;
+    file->header.name = NULL;
+    header_frame->blocks = NULL;
+    header_frame->chunks = NULL;
+
+    file->parts_count = 1;
+    file->part_blocks = 1;
+    uint64_t part_blocks = get_part_blocks(file->header.block_size);
+    if ((file->header.codec == CODEC_BLOCKS || file->header.codec == CODEC_STORED) && file->header.blocks_count > part_blocks) {
+        file->part_blocks = part_blocks;
+        file->parts_count = (file->header.blocks_count + part_blocks - 1) / part_blocks;
+    }
+    file->parts_left = file->parts_count;
+
+    // The worker of the last part frees the file, so it isn't read after the last part is submitted
+    uint64_t parts_count = file->parts_count;
+    for (uint64_t part = 0; part < parts_count; part++) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->failed && pool->added - pool->finished >= (unsigned long long)pool->ahead) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->failed) {
+            // Parts not submitted are dropped
+            file->parts_left -= parts_count - part;
+            char last = file->parts_left == 0;
+            pthread_mutex_unlock(&pool->lock);
+            if (last) end_extract_file(file);
+            return 1;
+        }
+        pool->tasks[pool->added++ % pool->ahead] = (ExtractTask){file, part};
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
 
-    // Generate unique archive path
-    char* unique_archivepath = generate_unique_filepath(archivepath);
-    FileBufferIO* archive = FileBufferIO_open(unique_archivepath, "wb", BUFFER_SIZE);
-    if (!archive) {
-        free(unique_archivepath);
+    return 0;
+}
+
+// Waits for workers to finish submitted files and stops them
+// Returns 0 if all files are decompressed, else 1
+static int extract_pool_finish(ExtractPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int i = 0; i < pool->threads_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    // Parts left after a failure
+    for (; pool->taken < pool->added; pool->taken++) {
+        ExtractFile* file = pool->tasks[pool->taken % pool->ahead].file;
+        if (--file->parts_left == 0) end_extract_file(file);
+    }
+
+    int status = pool->failed;
+    end_solid_cache(&pool->solid);
+    pthread_cond_destroy(&pool->changed);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->tasks);
+    free(pool->threads);
+    free(pool->solid.slots);
+    return status;
+}
+// == Parallel decompression =====================
+
+// == Extracting files ===========================
+// Creates the file of the header frame by its path in the archive inside outdir and decompresses it
+// If file_out is not NULL, the file is decompressed into it instead
+// The file is passed to the pool if it is not NULL
+// Returns 0 if success, else 1
+static int extract_file(Job* job, FileBufferIO* archive, ExtractPool* pool, SolidCache* solid, FileBufferIO* file_out, char* outdir, HeaderFrame* header_frame, const char* path_in_archive) {
+    if (file_out) {
+        return decompress_file(job, archive, file_out, header_frame, solid);
+    }
+
+    char* path = (char*)malloc(strlen(outdir) + strlen(path_in_archive) + 2);
+    if (!path) {
+        fprintf(stderr, "Out of memory\n");
         return 1;
     }
-    
-    // Prepare archive headers
-    printf("Preparing headers...\n");
-    CompressingFilesResult compr_files = prepare_archive(archive, paths_count, paths); 
-    if (compr_files.files == NULL) {
-        free(unique_archivepath);
-        FileBufferIO_close_remove(archive);
+    sprintf(path, "%s/%s", outdir, path_in_archive);
+    if (create_directories(path) != 0) {
+        free(path);
         return 1;
-    } else if (compr_files.count == 0) {
-        fprintf(stderr, "Nothing to compress\n");
-        free(unique_archivepath);
-        queue_destroy(&compr_files.files, CompressingFile_free);
-        FileBufferIO_close_remove(archive);
+    }
+
+    char* unique_path = generate_unique_filepath(path);
+    free(path);
+    if (!unique_path) {
+        return 1;
+    }
+    FileBufferIO* file_decompress = FileBufferIO_open(unique_path, "wb", BUFFER_SIZE);
+    free(unique_path);
+    if (!file_decompress) {
         return 1;
     }
 
-    FileSizeResult filesize_total = {.original = 0, .compressed_bits = 0};
+    if (header_frame->size_original == 0) {
+        FileBufferIO_close(file_decompress);
+        return 0;
+    }
 
-    printf("Compressing %d files...\n", compr_files.count);
-    pg_init(compr_files.count + compr_files.total_size*16, 0);
+    if (pool) {
+        return extract_pool_submit(pool, file_decompress, header_frame);
+    }
+    int status = decompress_file(job, archive, file_decompress, header_frame, solid);
+    FileBufferIO_close(file_decompress);
+    return status;
+}
 
-    CompressingFile* compr_file = (CompressingFile*)queue_dequeue(compr_files.files);
-    while (compr_file != NULL) {
-        // Сhecking if file is archive
-        if (strcmp(get_filename(compr_file->path), unique_archivepath) == 0) {
-            CompressingFile_free(compr_file);
-            continue;
+// Finds files of the catalog matching the filters by the sorted names and the hash index
+// Returns lengths of name prefixes cut from the output paths by record index, -1 for not matched files
+// A directory keeps its last name in the output path, a file keeps only its name
+// All files are selected with their full paths if there are no filters
+// !!! After use, free returned value if non-null !!!
+static long long* select_files(const Catalog* catalog, char** filepaths, int filepaths_count, char** dirpaths, int dirpaths_count) {
+    long long* cuts = (long long*)malloc(((size_t)catalog->count+1) * sizeof(long long));
+    if (!cuts) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    for (uint32_t i = 0; i < catalog->count; i++) {
+        cuts[i] = filepaths_count + dirpaths_count > 0 ? -1 : 0;
+    }
+
+    // Files of a directory have the same prefix "dir/", so they follow each other in the sorted order
+    for (int i = 0; i < dirpaths_count; i++) {
+        long long cut = get_filename(dirpaths[i]) - dirpaths[i];
+
+        char* prefix = (char*)malloc(strlen(dirpaths[i]) + 2);
+        if (!prefix) {
+            fprintf(stderr, "Out of memory\n");
+            free(cuts);
+            return NULL;
         }
-        FileSizeResult filesize = compress_file(archive, compr_file->path, compr_file->size_pos);
-        if (filesize.compressed_bits == 0 && filesize.original != 0) {
-            pg_end();
-            fprintf(stderr, "Error while compressing %s\n", compr_file->path);
-            free(unique_archivepath);
-            CompressingFile_free(compr_file);
-            queue_destroy(&compr_files.files, CompressingFile_free);
-            FileBufferIO_close_remove(archive);
-            return 1;
+        sprintf(prefix, "%s/", dirpaths[i]);
+        size_t prefix_len = strlen(prefix);
+
+        uint32_t pos = Catalog_lower_bound(catalog, prefix);
+        for (; pos < catalog->count; pos++) {
+            uint32_t index = catalog->sorted[pos];
+            if (strncmp(Catalog_name(catalog, index), prefix, prefix_len) != 0) break;
+            if (cuts[index] < 0) cuts[index] = cut;
         }
-        filesize_total.original += filesize.original;
-        pg_update(1);
+        free(prefix);
+    }
 
-        CompressingFile_free(compr_file);
-        compr_file = (CompressingFile*)queue_dequeue(compr_files.files);
+    // Files found in required directories keep their directory paths
+    for (int i = 0; i < filepaths_count; i++) {
+        long long index = Catalog_find(catalog, filepaths[i]);
+        if (index < 0 || cuts[index] >= 0) {
+            continue;
+        }
+
+        const char* name = Catalog_name(catalog, index);
+        const char* filename = strrchr(name, '/');
+        cuts[index] = filename ? filename + 1 - name : 0;
     }
-    queue_destroy(&compr_files.files, CompressingFile_free);
-    pg_end();
 
-    FileBufferIO_close(archive);
+    return cuts;
+}
 
-    size_t archive_size = get_filesize(unique_archivepath);
-    printf("Result: %ld -> %ld bytes (k=%.3lf)\n", filesize_total.original, archive_size, (double)archive_size/filesize_total.original);
-    printf("Saved in %s\n", unique_archivepath);
-    free(unique_archivepath);
-    return 0;
+// Reads the header of the catalog record and extracts its file
+// Returns 0 if success, else 1
+static int extract_record(Job* job, FileBufferIO* archive, FileBufferIO* archive_frame, ExtractPool* pool, SolidCache* solid, FileBufferIO* file_out, char* outdir, uint32_t index, long long cut) {
+    HeaderFrame header_frame;
+    if (read_header_frame(job, archive_frame, index, &header_frame) != 0) {
+        return 1;
+    }
+
+    int status = extract_file(job, archive, pool, solid, file_out, outdir, &header_frame, header_frame.name + cut);
+    end_header_frame(&header_frame);
+    return status;
 }
-// == Files compression ==========================
+// == Extracting files ===========================
 
-int decompress(char* archivepath, char* outdir, char** filepaths, int filepaths_count, char** dirpaths, int dirpaths_count) {
+int decompress(char* archivepath, char* outdir, char** filepaths, int filepaths_count, char** dirpaths, int dirpaths_count, const ArchiverOptions* options) {
     if (!archivepath) {
         fprintf(stderr, "Nothing to decompress\n");
         return 1;
     }
 
-    FileBufferIO* archive = FileBufferIO_open(archivepath, "rb", BUFFER_SIZE);
-    if (!archive) {
-        return 1;
+    Job job;
+    memset(&job, 0, sizeof(job));
+    job.opt.threads = options->threads;
+    if (job.opt.threads == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        job.opt.threads = processors > 0 ? processors : 1;
     }
 
-    FileBufferIO* archive_frame = FileBufferIO_open(archivepath, "rb", BUFFER_SIZE);
-    if (!archive_frame) {
-        FileBufferIO_close(archive);
+    // "-" decompresses one file straight to the standard output
+    char to_stdout = strcmp(outdir, "-") == 0;
+    if (to_stdout && (filepaths_count != 1 || dirpaths_count != 0)) {
+        fprintf(stderr, "Only one file can be decompressed to the standard output\n");
         return 1;
     }
 
-    uint32_t files_count = 0;
-    if (!archive_frame->readbytes(archive_frame, &files_count, 0, sizeof(files_count))) {
-        fprintf(stderr, "Corrupted file: EOF while reading headers\n");
-        FileBufferIO_close(archive);
-        FileBufferIO_close(archive_frame);
+    // Selected files are read by their pages only
+    char filtered = filepaths_count + dirpaths_count > 0;
+    FileBufferIO* archive = FileBufferIO_mmap(archivepath, filtered ? MADV_RANDOM : MADV_SEQUENTIAL, BUFFER_SIZE);
+    if (!archive) {
         return 1;
     }
 
-    if (!archive_frame->readbytes(archive_frame, &wordsize, 0, sizeof(wordsize))) {
-        fprintf(stderr, "Corrupted file: EOF while reading headers\n");
+    FileBufferIO* archive_frame = FileBufferIO_reader(archive);
+    if (!archive_frame) {
         FileBufferIO_close(archive);
-        FileBufferIO_close(archive_frame);
         return 1;
     }
 
-    if (wordsize == 0 || wordsize > 2) {
-        fprintf(stderr, "Corrupted file: invalid wordsize\n");
-        FileBufferIO_close(archive);
+    if (read_archive_header(archive_frame) != 0) {
         FileBufferIO_close(archive_frame);
+        FileBufferIO_close(archive);
         return 1;
     }
 
-    HeaderFrame header_frame = get_header_frame(archive_frame, files_count);
-    if (header_frame.count == -1) {
-        FileBufferIO_close(archive);
+    // Files are found by the central directory, headers of not selected files are not read
+    long long* cuts = NULL;
+    job.catalog = Catalog_read(archive_frame, get_filesize(archivepath));
+    if (job.catalog) {
+        cuts = select_files(job.catalog, filepaths, filepaths_count, dirpaths, dirpaths_count);
+    }
+    if (!cuts) {
+        if (job.catalog) Catalog_free(job.catalog);
         FileBufferIO_close(archive_frame);
+        FileBufferIO_close(archive);
         return 1;
     }
 
-    printf("Decompressing files from %s\n", archivepath);
-    pg_init(get_filesize(archivepath)*8, 0);
-
-    int decompressed_count = 0;
-    int filepaths_remain = filepaths_count;
-    int dirpaths_remain = dirpaths_count;
-    int lastdir_ind = -1;
-    do {
-        // cutted_filepath pointer may be moved forward, to cut non-required directories
-        char* cutted_filepath = header_frame.name;
-
-        // If filter is set
-        if (filepaths_count+dirpaths_count > 0) {
-            int flag_match = 0;
-
-            if (lastdir_ind >= 0 && strstr(header_frame.name, dirpaths[lastdir_ind]) == header_frame.name) {
-                flag_match = 1;
-                
-                cutted_filepath += get_filename(dirpaths[lastdir_ind])-dirpaths[lastdir_ind];
-            } else {
-                lastdir_ind = -1;
-            }
-
-            // check dir match
-            for (int i = 0; i < dirpaths_count && dirpaths_remain > 0 && !flag_match; i++) {
-                if (strstr(header_frame.name, dirpaths[i]) == header_frame.name) {
-                    flag_match = 1;
-                    lastdir_ind = i;
-                    dirpaths_remain--;
-
-                    cutted_filepath += get_filename(dirpaths[i])-dirpaths[i];
-
-                    break;
-                }
-            }
-
-            // check file match
-            // if file found in required directory earlier, it skips
-            for (int i = 0; i < filepaths_count && filepaths_remain > 0 && !flag_match; i++) {
-                if (strstr(header_frame.name, filepaths[i]) != header_frame.name) {
-                    continue;
-                }
-
-                if (strcmp(get_filename(header_frame.name), get_filename(filepaths[i])) == 0) {
-                    flag_match = 1;
-                    filepaths_remain--;
-                    cutted_filepath = get_filename(cutted_filepath);
-                    break;
-                }
-            }
-
-            if (!flag_match) continue;
-        }
-
-        int fs = fseek(archive->fp, header_frame.filestart / 8, SEEK_SET);
-        if (fs != 0) {
-            pg_end();
-            fprintf(stderr, "Fseek error\n");
-            end_header_frame(&header_frame);
-            FileBufferIO_close(archive);
-            FileBufferIO_close(archive_frame);
-            return 1;
-        }
-
-        nextbuffer(archive);
-        archive->bit_p = header_frame.filestart % 8;
-
-        char* path = (char*)malloc(strlen(outdir) + strlen(cutted_filepath) + 2);
-        if (!path) {
-            pg_end();
-            fprintf(stderr, "Out of memory\n");
-            end_header_frame(&header_frame);
-            FileBufferIO_close(archive);
+    // Messages are moved to the standard error before the first of them
+    FileBufferIO* file_out = NULL;
+    if (to_stdout) {
+        file_out = FileBufferIO_stdout(STDOUT_BUFFER_SIZE);
+        if (!file_out) {
+            Catalog_free(job.catalog);
+            free(cuts);
             FileBufferIO_close(archive_frame);
-            return 1;
-        }
-        sprintf(path, "%s/%s", outdir, cutted_filepath);
-        if (create_directories(path) != 0) {
-            pg_end();
-            free(path);
-            end_header_frame(&header_frame);
             FileBufferIO_close(archive);
-            FileBufferIO_close(archive_frame);
             return 1;
         }
+    }
 
-        char* unique_path = generate_unique_filepath(path);
-        free(path);
-        if (!unique_path) {
-            pg_end();
-            end_header_frame(&header_frame);
-            FileBufferIO_close(archive);
-            FileBufferIO_close(archive_frame);
-            return 1;
-        }
-        FileBufferIO* file_decompress = FileBufferIO_open(unique_path, "wb", BUFFER_SIZE);
-        if (!file_decompress) {
-            pg_end();
-            free(unique_path);
-            end_header_frame(&header_frame);
-            FileBufferIO_close(archive);
-            FileBufferIO_close(archive_frame);
-            return 1;
-        }
-        free(unique_path);
+    // Files are named and created here in the order of the archive and decoded by workers
+    ExtractPool pool;
+    char parallel = !to_stdout && job.opt.threads > 1;
+    if (parallel && extract_pool_start(&pool, &job, archive) != 0) {
+        Catalog_free(job.catalog);
+        free(cuts);
+        FileBufferIO_close(archive_frame);
+        FileBufferIO_close(archive);
+        return 1;
+    }
 
-        if (header_frame.treesize == 0) {
-            FileBufferIO_close(file_decompress);
-            continue;
-        }
+    printf("Decompressing files from %s\n", archivepath);
+    pg_init(&job.progress, get_filesize(archivepath)*8, 0);
 
-        HuffmanNode* tree = fread_tree(archive, header_frame.treesize, 0);
-        if (!tree) {
-            pg_end();
-            end_header_frame(&header_frame);
-            FileBufferIO_close(archive);
-            FileBufferIO_close(archive_frame);
-            FileBufferIO_close(file_decompress);
-            return 1;
+    int status = 0;
+    int decompressed_count = 0;
+    SolidSlot solid_slots[SOLID_CACHE_SLOTS];
+    memset(solid_slots, 0, sizeof(solid_slots));
+    SolidCache solid = {solid_slots, SOLID_CACHE_SLOTS, 0, NULL, NULL};
+    for (uint32_t i = 0; i < job.catalog->count; i++) {
+        if (cuts[i] < 0) continue;
+
+        status = extract_record(&job, archive, archive_frame, parallel ? &pool : NULL, &solid, file_out, outdir, i, cuts[i]);
+        if (status != 0) {
+            break;
         }
+        decompressed_count++;
+    }
+    end_solid_cache(&solid);
 
-        HuffmanNode* node_cur = tree;
-        for (unsigned long long i = 0; i < header_frame.size_compressed - header_frame.treesize; i++) {
-            unsigned char bit = 0;
-            size_t readed = 0;
-            if (!(readed = archive->readbits(archive, &bit, 7, 1))) {
-                pg_end();
-                fprintf(stderr, "EOF while decompressing\n");
-                end_header_frame(&header_frame);
-                FileBufferIO_close(archive);
-                FileBufferIO_close(archive_frame);
-                FileBufferIO_close(file_decompress);
-                HuffmanNode_freetree(tree);
-                return 1;
-            }
-
-            if (node_cur==tree && node_cur->wordsize!=0) {
-                if (bit==0) {
-                    file_decompress->writebits(file_decompress, node_cur->word, 0, node_cur->wordsize);
-                    continue;
-                } else {
-                    pg_end();
-                    fprintf(stderr, "Corrupted huffman tree - unexpected bit\n");
-                    end_header_frame(&header_frame);
-                    FileBufferIO_close(archive);
-                    FileBufferIO_close(archive_frame);
-                    FileBufferIO_close(file_decompress);
-                    HuffmanNode_freetree(tree);
-                    return 1;
-                }
-            }
-
-            if (bit==0) {
-                node_cur = node_cur->left;
-            } else if (bit==1) {
-                node_cur = node_cur->right;
-            }
-
-            if (!node_cur) {
-                pg_end();
-                fprintf(stderr, "Corrupted huffman tree or file\n");
-                end_header_frame(&header_frame);
-                FileBufferIO_close(archive);
-                FileBufferIO_close(archive_frame);
-                FileBufferIO_close(file_decompress);
-                HuffmanNode_freetree(tree);
-                return 1;
-            }
-            
-            if (node_cur->left==NULL && node_cur->right==NULL) {
-                file_decompress->writebits(file_decompress, node_cur->word, 0, node_cur->wordsize);
-                node_cur = tree;
-            }
-            pg_update(readed);
-        }
+    if (parallel && extract_pool_finish(&pool) != 0) {
+        status = 1;
+    }
 
-        HuffmanNode_freetree(tree);
-        FileBufferIO_close(file_decompress);
-        decompressed_count++;
-    } while (next_header_frame(&header_frame));
+    if (to_stdout && status == 0 && decompressed_count == 0) {
+        fprintf(stderr, "No such file \"%s\" in \"%s\"\n", filepaths[0], archivepath);
+        status = 1;
+    }
 
-    FileBufferIO_close(archive);
+    if (file_out) FileBufferIO_close(file_out);
+    Catalog_free(job.catalog);
+    free(cuts);
     FileBufferIO_close(archive_frame);
+    FileBufferIO_close(archive);
 
-    pg_end();
-    printf("Decompressed %d files in %s\n", decompressed_count, outdir);
+    pg_end(&job.progress);
+    if (status != 0) {
+        return 1;
+    }
+    if (to_stdout) {
+        printf("Decompressed %s to the standard output\n", filepaths[0]);
+    } else {
+        printf("Decompressed %d files in %s\n", decompressed_count, outdir);
+    }
 
     return 0;
 }
@@ -1000,39 +3781,39 @@ int show_files(char* archivepath, char* dirpath) {
         dirpath_files[0] = '\0';
     }
 
-    FileBufferIO* archive = FileBufferIO_open(archivepath, "rb", BUFFER_SIZE);
-    if (!archive) {
-        free(dirpath_files);
-        return 1;
-    }
+    Job job;
+    memset(&job, 0, sizeof(job));
 
-    uint32_t files_count = 0;
-    if (!archive->readbytes(archive, &files_count, 0, sizeof(files_count))) {
-        fprintf(stderr, "EOF while reading headers\n");
+    // Only the header and the central directory are read
+    FileBufferIO* archive = FileBufferIO_mmap(archivepath, MADV_RANDOM, BUFFER_SIZE);
+    if (!archive) {
         free(dirpath_files);
-        FileBufferIO_close(archive);
         return 1;
     }
 
-    if (!archive->readbytes(archive, &wordsize, 0, sizeof(wordsize))) {
-        fprintf(stderr, "EOF while reading headers\n");
+    if (read_archive_header(archive) != 0) {
         free(dirpath_files);
         FileBufferIO_close(archive);
         return 1;
     }
 
-    HeaderFrame header_frame = get_header_frame(archive, files_count);
-    if (header_frame.count == -1) {
+    Catalog* catalog = Catalog_read(archive, get_filesize(archivepath));
+    if (!catalog) {
         free(dirpath_files);
         FileBufferIO_close(archive);
         return 1;
     }
 
+    // Files of the directory follow each other in the sorted order, so do files of every subdirectory
     char empty_dir = 1;
-    char* prevdir = NULL;
-    do {
-        if (strstr(header_frame.name, dirpath_files) != header_frame.name) {
-            continue;
+    const char* prevdir = NULL;
+    size_t prevdir_len = 0;
+    size_t dirpath_len = strlen(dirpath_files);
+    for (uint32_t pos = Catalog_lower_bound(catalog, dirpath_files); pos < catalog->count; pos++) {
+        const CatalogRecord* record = &catalog->records[catalog->sorted[pos]];
+        const char* name = Catalog_name(catalog, catalog->sorted[pos]);
+        if (strncmp(name, dirpath_files, dirpath_len) != 0) {
+            break;
         }
 
         if (empty_dir) {
@@ -1041,36 +3822,21 @@ int show_files(char* archivepath, char* dirpath) {
             empty_dir = 0;
         }
 
-        char* filename = header_frame.name + strlen(dirpath_files);
-        char* bs = strchr(filename, '/');
+        const char* filename = name + dirpath_len;
+        const char* bs = strchr(filename, '/');
         if (bs) {
-            filename[bs-filename] = '\0';
-            
-            if (prevdir) {
-                if (strcmp(prevdir, filename) == 0) {
-                    continue;
-                } else {
-                    free(prevdir);
-                    prevdir = NULL;
-                }
-            }
-            
-            if (!prevdir) {
-                prevdir = (char*)malloc(strlen(filename)+1);
-                strcpy(prevdir, filename);
+            size_t filename_len = bs - filename;
+            if (prevdir && prevdir_len == filename_len && strncmp(prevdir, filename, filename_len) == 0) {
+                continue;
             }
+            prevdir = filename;
+            prevdir_len = filename_len;
 
-            printf("<DIR>  ");
-        } else {
-            printf("<FILE> ");
-        }
-
-        if (bs) {
-            printf("          %s\n", filename);
+            printf("<DIR>            %.*s\n", (int)filename_len, filename);
             continue;
         }
 
-        uint64_t filesize = header_frame.size_original;
+        uint64_t filesize = record->size_original;
         char sizename = ' ';
         if (filesize >= 1024) {
             sizename = 'K';
@@ -1086,22 +3852,19 @@ int show_files(char* archivepath, char* dirpath) {
         }
 
         if (sizename == ' ') {
-            printf("(%-4ld  B) %s\n", filesize, filename);
+            printf("<FILE> (%-4ld  B) %s\n", filesize, filename);
         } else {
-            printf("(%-4ld %cB) %s\n", filesize, sizename, filename);
+            printf("<FILE> (%-4ld %cB) %s\n", filesize, sizename, filename);
         }
-    } while (next_header_frame(&header_frame));
+    }
 
     if (empty_dir) {
         printf("No such directory \"%s\" in \"%s\"\n", dirpath, archivepath);
     }
 
-    if (prevdir) {
-        free(prevdir);
-    }
-
+    Catalog_free(catalog);
     free(dirpath_files);
     FileBufferIO_close(archive);
 
     return 0;
-}
\ No newline at end of file
+}
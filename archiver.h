@@ -2,28 +2,36 @@
 #include <stdint.h>
 
 #define BUFFER_SIZE 4096
+#define STDOUT_BUFFER_SIZE (1 << 20) // Pipes take large writes with fewer syscalls
+#define MEMORY_LIMIT_DEFAULT (64 << 20)
+#define STREAMS_INTERLEAVED 4 // Number of code streams of blocks with interleaved streams
 
-// Size of words in bytes to compress/decompress
-extern uint8_t wordsize;
-
-enum WarningAction {
-    WARN_ACT_ASK,
-    WARN_ACT_ACCEPT,
-    WARN_ACT_DECLINE
-};
-
-// Skip warning about small files
-extern enum WarningAction compress_warn_act;
+typedef struct {
+    uint8_t wordsize;            // Size of words in bytes to compress, 0 - chosen for every file by its sample
+    uint8_t codelen_max;         // Maximum length of huffman codes in bits, 0 - default for the word size
+    uint32_t block_size;         // Size of independently coded blocks in bytes, 0 - one block per file
+    uint32_t memory_limit;       // Files up to this size in bytes are compressed from memory as one block, larger ones by blocks of it, 0 - default
+    uint8_t streams;             // Number of code streams of blocks, 1 or STREAMS_INTERLEAVED, 0 - default
+    uint32_t solid_size;         // Files smaller than 64K are packed into shared blocks of this size in bytes, 0 - every file is coded alone
+    uint8_t solid_by_ext;        // Files of shared blocks are ordered by extension
+    uint8_t dedup;               // Equal chunks of files are stored once, new chunks of a file are compressed together
+    uint32_t lz_window;          // LZ77 window in bytes, 0 - no LZ77 stage
+    uint16_t lz_depth;           // Candidates of a match searched by LZ77, 0 - LZ_DEPTH_DEFAULT
+    uint8_t fse;                 // Files of 1-byte words are coded by tANS if it makes them smaller than Huffman codes
+    uint8_t context_tables;      // Files of 1-byte words are coded by up to this many tables chosen by the previous byte if it makes them smaller, 0 - off
+    unsigned int threads;        // Number of threads, 0 - one per processor
+} ArchiverOptions;
 
 // Compress files from paths and store them into archive on archivepath
 // returns 0 if success, else 1
-int compress(char** paths, int paths_count, char* archivepath);
+int compress(char** paths, int paths_count, char* archivepath, const ArchiverOptions* options);
 
 // Decompress archives from paths into outdir
 // archivefile is directory if it ends with '/'
+// outdir "-" writes the only file of filepaths to the standard output
 // returns 0 if success, else 1
-int decompress(char* archivepath, char* outdir, char** filepaths, int filepaths_count, char** dirpaths, int dirpaths_count);
+int decompress(char* archivepath, char* outdir, char** filepaths, int filepaths_count, char** dirpaths, int dirpaths_count, const ArchiverOptions* options);
 
 // Show files in archive on archivepath in directory dirpath
 // returns 0 if success, else 1
-int show_files(char* archivepath, char* dirpath);
\ No newline at end of file
+int show_files(char* archivepath, char* dirpath);
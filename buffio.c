@@ -1,24 +1,100 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "buffio.h"
 
+// Reads up to count bytes from the current position of the file
+// Returns the number of read bytes, 0 on the end of the file or error
+static size_t readfile(FileBufferIO* self, void* dest, size_t count) {
+    if (self->fp) {
+        size_t readed = fread(dest, 1, count, self->fp);
+        self->fd_pos += readed;
+        return readed;
+    }
+
+    size_t readed = 0;
+    while (readed < count) {
+        ssize_t n = pread(self->fd, (char*)dest + readed, count - readed, self->fd_pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        readed += n;
+        self->fd_pos += n;
+    }
+    return readed;
+}
+
 // Reading the buffer from the file
 void nextbuffer(FileBufferIO* self) {
-    self->buffer_readspace = fread(self->buffer, 1, self->buffer_size, self->fp);
-    if (self->buffer_readspace == 0) {
-        self->byte_p = -1;
-        self->bit_p = -1;
+    if (self->map) return; // The whole file is in the buffer
+    self->buffer_readspace = readfile(self, self->buffer, self->buffer_size);
+    self->byte_p = 0;
+    self->bit_p = 0;
+}
+
+void refillbits(FileBufferIO* self) {
+    // Fast path: take as many whole bytes of the next 8 as fit into the window
+    // Bits loaded after window_count are the real next bits, so loading them again is harmless
+    if (self->buffer_readspace >= 8 && self->byte_p <= self->buffer_readspace - 8) {
+        const unsigned char* bytes = (const unsigned char*)self->buffer + self->byte_p;
+        uint64_t next = 0;
+        for (int i = 0; i < 8; i++) {
+            next = (next << 8) | bytes[i];
+        }
+        unsigned char bytes_count = (64 - self->window_count) / 8;
+        self->window |= next >> self->window_count;
+        self->window_count += bytes_count*8;
+        self->byte_p += bytes_count;
+        return;
+    }
+
+    // Slow path near the end of the buffer
+    while (self->window_count <= 56) {
+        if (self->byte_p >= self->buffer_readspace) {
+            nextbuffer(self);
+            if (self->byte_p >= self->buffer_readspace) return;
+        }
+        self->window |= (uint64_t)(unsigned char)self->buffer[self->byte_p++] << (56 - self->window_count);
+        self->window_count += 8;
+    }
+}
+
+int seekbits(FileBufferIO* self, unsigned long long bit) {
+    if (self->map) {
+        self->byte_p = bit / 8 < self->buffer_readspace ? bit / 8 : self->buffer_readspace;
+    } else if (!self->fp) {
+        self->fd_pos = bit / 8;
+    } else if (fseek(self->fp, bit / 8, SEEK_SET) != 0) {
+        return 1;
     } else {
+        self->fd_pos = bit / 8;
+    }
+    if (!self->map) {
+        self->buffer_readspace = 0;
         self->byte_p = 0;
-        self->bit_p = 0;
     }
+    self->bit_p = 0;
+    self->window = 0;
+    self->window_count = 0;
+
+    unsigned char skip = bit % 8;
+    if (skip > 0) {
+        peekbits(self, skip);
+        if (self->window_count < skip) return 1;
+        consumebits(self, skip);
+    }
+    return 0;
 }
 
-// Writing the buffer to a file
-size_t writebuffer(FileBufferIO* self) {
+// Writing the buffer to a file, ignoring the accumulator
+static size_t writebuffer_raw(FileBufferIO* self) {
     if (self->byte_p==0 && self->bit_p==0) return 0;
+    if (!self->fp) return 0; // Memory writers keep the bytes in the buffer
 
     size_t write_bytes = self->byte_p+(self->bit_p>0);
     if (write_bytes > self->buffer_size) {
@@ -27,6 +103,7 @@ size_t writebuffer(FileBufferIO* self) {
     }
 
     size_t wrote_bytes_count = fwrite(self->buffer, 1, write_bytes, self->fp);
+    self->fd_pos += wrote_bytes_count;
     self->byte_p = 0;
     self->bit_p = 0;
 
@@ -34,10 +111,42 @@ size_t writebuffer(FileBufferIO* self) {
     return wrote_bytes_count;
 }
 
+// Writing the buffer to a file
+size_t writebuffer(FileBufferIO* self) {
+    syncbits(self);
+    return writebuffer_raw(self);
+}
+
+size_t writethrough(FileBufferIO* self, const void* ptr, size_t count) {
+    writebuffer(self);
+    if (!self->fp) {
+        // Memory writers append the bytes after the last started byte of the buffer
+        size_t pos = self->byte_p + (self->bit_p > 0);
+        if (count > self->buffer_size - pos) count = self->buffer_size - pos;
+        memcpy(self->buffer + pos, ptr, count);
+        self->byte_p = pos + count;
+        self->bit_p = 0;
+        return count;
+    }
+
+    size_t wrote_bytes_count = fwrite(ptr, 1, count, self->fp);
+    self->fd_pos += wrote_bytes_count;
+    return wrote_bytes_count;
+}
+
+long long tellbits(FileBufferIO* self) {
+    // The whole mapped file is read to the buffer
+    long long filepos = self->map ? (long long)self->buffer_readspace : (long long)self->fd_pos;
+
+    // Bytes of the buffer were read from the file, but not all of them are consumed
+    long long bytepos = filepos - (long long)self->buffer_readspace + (long long)self->byte_p;
+    return bytepos * 8 + self->bit_p + self->acc_count - self->window_count;
+}
+
 static size_t readbits(FileBufferIO* self, const void* ptr, unsigned long long startbit, size_t count) {
     size_t readed_bits_count_total = 0;
 
-    char* src = (char*)ptr;
+    unsigned char* src = (unsigned char*)ptr;
     unsigned long long src_pointer = startbit;
 
     for (size_t i = 0; i < count/8+(count%8 > 0); i++) {
@@ -46,48 +155,39 @@ static size_t readbits(FileBufferIO* self, const void* ptr, unsigned long long s
 
     while (count > readed_bits_count_total) {
         unsigned char src_bit = src_pointer % 8;
-        unsigned long src_byte = src_pointer / 8;
-
-        // Read a new buffer if the data has ended
-        if (self->byte_p+(self->bit_p/8) >= self->buffer_readspace) nextbuffer(self);
-        if (self->buffer_readspace == 0) break;
-
-        unsigned char reading_bits = self->buffer[self->byte_p] << self->bit_p;
-        unsigned char reading_bits_count = 8 - self->bit_p;
+        unsigned long long src_byte = src_pointer / 8;
 
+        // Read up to the end of the destination byte
+        unsigned char reading_bits_count = 8 - src_bit;
         if (reading_bits_count > (count - readed_bits_count_total)) {
-            reading_bits_count = (count - readed_bits_count_total);
-            reading_bits >>= 8 - (count - readed_bits_count_total);
-            reading_bits <<= 8 - (count - readed_bits_count_total);
+            reading_bits_count = count - readed_bits_count_total;
+        }
+
+        unsigned char reading_bits = peekbits(self, reading_bits_count);
+        if (self->window_count == 0) break;
+        if (reading_bits_count > self->window_count) { // The file has ended
+            reading_bits >>= reading_bits_count - self->window_count;
+            reading_bits_count = self->window_count;
         }
+        consumebits(self, reading_bits_count);
 
-        // Shift reading pointers
-        self->byte_p += (self->bit_p + reading_bits_count) / 8;
-        self->bit_p = (self->bit_p + reading_bits_count) % 8;
+        src[src_byte] |= reading_bits << (8 - src_bit - reading_bits_count);
         src_pointer += reading_bits_count;
         readed_bits_count_total += reading_bits_count; // Increase the number of bits read
-
-        src[src_byte] |= reading_bits >> src_bit; // Write bits to the last byte
-        
-        unsigned char available_to_write = 8 - src_bit; // How many bits were written
-        if (available_to_write < reading_bits_count) {
-            unsigned char remain_bits_count = (reading_bits_count - available_to_write); // How many bits were not written
-            src_byte++; // Write to the next byte
-            src[src_byte] = reading_bits << (reading_bits_count - remain_bits_count);
-        }
     }
 
     return readed_bits_count_total;
 }
 
-static size_t writebits(FileBufferIO* self, const void* ptr, unsigned long long startbit, size_t count) {
+// Writes bits to the buffer, ignoring the accumulator
+static size_t writebits_buffer(FileBufferIO* self, const void* ptr, unsigned long long startbit, size_t count) {
     size_t wrote_bits_count_total = 0;
 
     const char* src = (const char*)ptr;
     unsigned long long src_pointer = startbit;
 
     // Before starting the loop, check whether the buffer is overflowed
-    if (self->byte_p+(self->bit_p/8) >= self->buffer_size) writebuffer(self);
+    if (self->byte_p+(self->bit_p/8) >= self->buffer_size) writebuffer_raw(self);
 
     while (count > wrote_bits_count_total) {
         unsigned char src_bit = src_pointer % 8;
@@ -114,7 +214,7 @@ static size_t writebits(FileBufferIO* self, const void* ptr, unsigned long long
             unsigned char remain_bits_count = (writing_bits_count - available_to_write); // How many bits have not been written
             self->byte_p++; // Write to the next byte
             self->bit_p = 0;
-            if (self->byte_p+(self->bit_p/8) >= self->buffer_size) writebuffer(self); // But first check that the buffer is not full
+            if (self->byte_p+(self->bit_p/8) >= self->buffer_size) writebuffer_raw(self); // But first check that the buffer is not full
             self->bit_p = remain_bits_count;
             self->buffer[self->byte_p] = writing_bits << (writing_bits_count - remain_bits_count);
         } else {
@@ -125,26 +225,112 @@ static size_t writebits(FileBufferIO* self, const void* ptr, unsigned long long
     return wrote_bits_count_total;
 }
 
+static size_t writebits(FileBufferIO* self, const void* ptr, unsigned long long startbit, size_t count) {
+    syncbits(self);
+    return writebits_buffer(self, ptr, startbit, count);
+}
+
+void flushbits(FileBufferIO* self) {
+    unsigned char bytes_count = self->acc_count / 8;
+    if (bytes_count == 0) return;
+
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = self->acc >> (56 - i*8);
+    }
+
+    self->acc = bytes_count == 8 ? 0 : self->acc << (bytes_count*8);
+    self->acc_count -= bytes_count*8;
+
+    // Bits after acc_count are zero, so the whole word can be stored at once
+    if (self->bit_p == 0 && self->byte_p + 8 <= self->buffer_size) {
+        memcpy(self->buffer + self->byte_p, bytes, 8);
+        self->byte_p += bytes_count;
+    } else {
+        writebits_buffer(self, bytes, 0, bytes_count*8);
+    }
+}
+
+void syncbits(FileBufferIO* self) {
+    if (self->acc_count == 0) return;
+    flushbits(self);
+
+    unsigned char lastbyte = self->acc >> 56;
+    unsigned char lastbyte_size = self->acc_count;
+    self->acc = 0;
+    self->acc_count = 0;
+    if (lastbyte_size > 0) {
+        writebits_buffer(self, &lastbyte, 0, lastbyte_size);
+    }
+}
+
 static size_t writebytes(FileBufferIO* self, const void* ptr, unsigned long long startbit, size_t count) {
     return writebits(self, ptr, startbit, count*8);
 }
 
 static size_t readbytes(FileBufferIO* self, const void* ptr, unsigned long long startbit, size_t count) {
-    return readbits(self, ptr, startbit, count*8);
+    if (startbit % 8 != 0 || self->window_count % 8 != 0) {
+        return readbits(self, ptr, startbit, count*8);
+    }
+
+    // The stream is byte aligned, so bytes are copied directly
+    unsigned char* src = (unsigned char*)ptr + startbit / 8;
+    size_t readed = 0;
+
+    while (readed < count && self->window_count > 0) {
+        src[readed++] = self->window >> 56;
+        consumebits(self, 8);
+    }
+    if (readed == count) {
+        return readed*8;
+    }
+    // The window is empty, bits loaded after its end are consumed below
+    self->window = 0;
+
+    while (readed < count) {
+        if (self->byte_p >= self->buffer_readspace) {
+            // Large reads bypass the buffer
+            if (!self->map && count - readed >= self->buffer_size) {
+                size_t fread_count = readfile(self, src + readed, count - readed);
+                readed += fread_count;
+                if (fread_count == 0) break;
+                continue;
+            }
+            nextbuffer(self);
+            if (self->byte_p >= self->buffer_readspace) break;
+        }
+
+        size_t copy_count = self->buffer_readspace - self->byte_p;
+        if (copy_count > count - readed) {
+            copy_count = count - readed;
+        }
+        memcpy(src + readed, self->buffer + self->byte_p, copy_count);
+        self->byte_p += copy_count;
+        readed += copy_count;
+    }
+
+    return readed*8;
 }
 
-FileBufferIO* FileBufferIO_open(const char* filepath, const char* modes, size_t buffer_size) {
+// Creates a FileBufferIO over the opened file, the file is closed if failed
+// If fp is NULL, the file is read from fd
+// If map is not NULL, it is the buffer of buffer_size bytes holding the whole file
+static FileBufferIO* FileBufferIO_wrap(FILE* fp, int fd, char* map, const char* filepath, const char* modes, size_t buffer_size) {
     FileBufferIO* fb = (FileBufferIO*)malloc(sizeof(FileBufferIO));
-    fb->fp = fopen(filepath, modes);
-    if (fb->fp == NULL) {
-        fprintf(stderr, "Can't open file %s\n", filepath);
-        free(fb);
+    if (fb == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        if (fp) fclose(fp);
         return NULL;
     }
+    fb->fp = fp;
+    fb->fd = fd;
+    fb->fd_pos = 0;
+    fb->map = map;
+    fb->map_owned = 0;
     fb->path = (char*)malloc(strlen(filepath)+1);
     if (fb->path == NULL) {
         fprintf(stderr, "Out of memory\n");
-        fclose(fb->fp);
+        if (fb->fp) fclose(fb->fp);
         free(fb);
         return NULL;
     }
@@ -153,31 +339,30 @@ FileBufferIO* FileBufferIO_open(const char* filepath, const char* modes, size_t
     fb->modes = (char*)malloc(strlen(modes)+1);
     if (fb->modes == NULL) {
         fprintf(stderr, "Out of memory\n");
-        fclose(fb->fp);
+        if (fb->fp) fclose(fb->fp);
         free(fb->path);
         free(fb);
         return NULL;
     }
     strcpy(fb->modes, modes);
-    fb->buffer = (char*)calloc(buffer_size, sizeof(char));
+    fb->buffer = map ? map : (char*)calloc(buffer_size, sizeof(char));
     if (fb->buffer == NULL) {
         fprintf(stderr, "Out of memory\n");
-        fclose(fb->fp);
+        if (fb->fp) fclose(fb->fp);
         free(fb->modes);
         free(fb->path);
         free(fb);
         return NULL;
     }
     fb->buffer_size = buffer_size;
-    fb->buffer_readspace = 0;
-
-    if (strchr(fb->modes, 'w')) {
-        fb->byte_p = 0;
-        fb->bit_p = 0;
-    } else {
-        fb->byte_p = -1;
-        fb->bit_p = -1;
-    }
+    fb->buffer_readspace = map ? buffer_size : 0;
+    fb->acc = 0;
+    fb->acc_count = 0;
+    fb->window = 0;
+    fb->window_count = 0;
+
+    fb->byte_p = 0;
+    fb->bit_p = 0;
     fb->readbits = readbits;
     fb->writebits = writebits;
     fb->readbytes = readbytes;
@@ -185,25 +370,127 @@ FileBufferIO* FileBufferIO_open(const char* filepath, const char* modes, size_t
     return fb;
 }
 
+FileBufferIO* FileBufferIO_open(const char* filepath, const char* modes, size_t buffer_size) {
+    FILE* fp = fopen(filepath, modes);
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s\n", filepath);
+        return NULL;
+    }
+    return FileBufferIO_wrap(fp, -1, NULL, filepath, modes, buffer_size);
+}
+
+FileBufferIO* FileBufferIO_tmp(size_t buffer_size) {
+    FILE* fp = tmpfile();
+    if (fp == NULL) {
+        perror("Can't create temporary file");
+        return NULL;
+    }
+    return FileBufferIO_wrap(fp, -1, NULL, "", "w+b", buffer_size);
+}
+
+FileBufferIO* FileBufferIO_stdout(size_t buffer_size) {
+    // Messages printed after this go to the standard error
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+        perror("Can't open the standard output");
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+
+    FILE* fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        perror("Can't open the standard output");
+        close(fd);
+        return NULL;
+    }
+    return FileBufferIO_wrap(fp, -1, NULL, "", "wb", buffer_size);
+}
+
+FileBufferIO* FileBufferIO_pread(int fd, size_t buffer_size) {
+    return FileBufferIO_wrap(NULL, fd, NULL, "", "rb", buffer_size);
+}
+
+FileBufferIO* FileBufferIO_mmap(const char* filepath, int advice, size_t buffer_size) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Can't open file %s\n", filepath);
+        return NULL;
+    }
+
+    struct stat file_stat;
+    char* map = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+        map = (char*)mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    if (map == MAP_FAILED) {
+        return FileBufferIO_open(filepath, "rb", buffer_size);
+    }
+    madvise(map, file_stat.st_size, advice);
+
+    FileBufferIO* fb = FileBufferIO_wrap(NULL, -1, map, filepath, "rb", file_stat.st_size);
+    if (!fb) {
+        munmap(map, file_stat.st_size);
+        return NULL;
+    }
+    fb->map_owned = 1;
+    return fb;
+}
+
+FileBufferIO* FileBufferIO_memory_reader(const void* data, size_t size) {
+    return FileBufferIO_wrap(NULL, -1, (char*)data, "", "rb", size);
+}
+
+FileBufferIO* FileBufferIO_memory_writer(size_t size) {
+    return FileBufferIO_wrap(NULL, -1, NULL, "", "wb", size);
+}
+
+FileBufferIO* FileBufferIO_reader(FileBufferIO* fb) {
+    if (fb->map) {
+        return FileBufferIO_wrap(NULL, -1, fb->map, fb->path, "rb", fb->buffer_size);
+    }
+    return FileBufferIO_wrap(NULL, fb->fp ? fileno(fb->fp) : fb->fd, NULL, fb->path, "rb", fb->buffer_size);
+}
+
+void FileBufferIO_advise(FileBufferIO* fb, unsigned long long offset, unsigned long long length, int advice) {
+    if (!fb->map || offset >= fb->buffer_size || length == 0) return;
+
+    // madvise takes page aligned addresses
+    unsigned long long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long long start = offset - offset % page_size;
+    if (length > fb->buffer_size - offset) length = fb->buffer_size - offset;
+    madvise(fb->map + start, offset - start + length, advice);
+}
+
 void FileBufferIO_close(FileBufferIO* fb) {
+    syncbits(fb);
     if (strchr(fb->modes, 'w') && (fb->bit_p > 0 || fb->byte_p>0)) {
         writebuffer(fb);
     }
 
-    fclose(fb->fp);
+    if (fb->fp) fclose(fb->fp);
+    if (fb->map) {
+        if (fb->map_owned) munmap(fb->map, fb->buffer_size);
+    } else {
+        free(fb->buffer);
+    }
     free(fb->path);
     free(fb->modes);
-    free(fb->buffer);
     free(fb);
 }
 
 void FileBufferIO_close_remove(FileBufferIO* fb) {
     fclose(fb->fp);
 
-    if (remove(fb->path) == 0) {
-        printf("Deleted %s.\n", fb->path);
-    } else {
-        printf("Failed to delete %s.\n", fb->path);
+    // Anonymous files have no path
+    if (fb->path[0] != '\0') {
+        if (remove(fb->path) == 0) {
+            printf("Deleted %s.\n", fb->path);
+        } else {
+            printf("Failed to delete %s.\n", fb->path);
+        }
     }
 
     free(fb->path);
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <stdio.h>
+#include <stdint.h>
+
 typedef struct FileBufferIO {
     FILE* fp;
+    int fd; // If fp is NULL, the file is read by pread from fd_pos, fd is not owned
+    unsigned long long fd_pos; // Position of the file after the read buffer or before the written one
+    char* map; // Mapped file, the buffer points to it and holds the whole file
+    char map_owned; // The mapping is removed on close
     char* path;
     char* modes;
     char* buffer;
@@ -9,6 +16,10 @@ typedef struct FileBufferIO {
     size_t buffer_readspace;
     unsigned long byte_p;
     unsigned char bit_p;
+    uint64_t acc; // Bits added by putbits, starting from the most significant bit
+    unsigned char acc_count;
+    uint64_t window; // Next bits of the stream for peekbits, starting from the most significant bit
+    unsigned char window_count;
 
     size_t (*readbits)(struct FileBufferIO* self, const void* ptr, unsigned long long startbit, size_t count);
     size_t (*writebits)(struct FileBufferIO* self, const void* ptr, unsigned long long startbit, size_t count);
@@ -20,8 +31,80 @@ void nextbuffer(FileBufferIO* self);
 
 size_t writebuffer(FileBufferIO* self);
 
+// Writes the buffer, then count bytes right to the file, memory writers copy them to the buffer
+// Returns the number of bytes written from ptr
+size_t writethrough(FileBufferIO* self, const void* ptr, size_t count);
+
+// Moves whole bytes of the accumulator to the buffer
+void flushbits(FileBufferIO* self);
+
+// Moves all bits of the accumulator to the buffer
+void syncbits(FileBufferIO* self);
+
+// Appends the lowest count bits of value to the stream, count from 1 to 57
+static inline void putbits(FileBufferIO* self, uint64_t value, unsigned char count) {
+    if (self->acc_count + count > 64) flushbits(self);
+    self->acc |= (value << (64 - count)) >> self->acc_count;
+    self->acc_count += count;
+}
+
+// Loads whole bytes of the buffer to the window until it has more than 56 bits or the file ends
+void refillbits(FileBufferIO* self);
+
+// Returns the next count bits of the stream without consuming them, count from 1 to 57
+// Bits after the end of the file are zero, window_count tells how many bits are real
+static inline uint64_t peekbits(FileBufferIO* self, unsigned char count) {
+    if (self->window_count < count) refillbits(self);
+    return self->window >> (64 - count);
+}
+
+// Skips count bits of the stream, count must not exceed window_count
+static inline void consumebits(FileBufferIO* self, unsigned char count) {
+    self->window <<= count;
+    self->window_count -= count;
+}
+
+// Moves the reading position to the bit of the file
+// Returns 0 if success, else 1
+int seekbits(FileBufferIO* self, unsigned long long bit);
+
+// Returns the position of the stream in bits, -1 if failed
+// The position is counted by the stream, so it works for pipes too
+long long tellbits(FileBufferIO* self);
+
 FileBufferIO* FileBufferIO_open(const char* filepath, const char* modes, size_t buffer_size);
 
+// Opens an anonymous file for writing and reading back, it is deleted on close
+FileBufferIO* FileBufferIO_tmp(size_t buffer_size);
+
+// Opens the standard output for writing, the standard output of printf is moved to the standard error
+FileBufferIO* FileBufferIO_stdout(size_t buffer_size);
+
+// Opens a reader of the file descriptor by positional reads
+// Readers of one descriptor don't share the position, so they may be used by different threads
+// The descriptor is not closed on close
+FileBufferIO* FileBufferIO_pread(int fd, size_t buffer_size);
+
+// Opens the file for reading from its memory mapping, bits are decoded right from the mapped pages
+// advice is passed to madvise for the whole file (MADV_SEQUENTIAL, MADV_RANDOM, ...)
+// Falls back to FileBufferIO_open if the file can't be mapped
+FileBufferIO* FileBufferIO_mmap(const char* filepath, int advice, size_t buffer_size);
+
+// Opens a reader of size bytes of memory, the memory is not copied and must outlive the reader
+FileBufferIO* FileBufferIO_memory_reader(const void* data, size_t size);
+
+// Opens a writer into its buffer of size bytes, nothing is written to a file
+// The buffer is never flushed, so no more than size bytes may be written
+FileBufferIO* FileBufferIO_memory_writer(size_t size);
+
+// Opens an independent reader of the file read by fb, it may be used by another thread
+// The reader shares the mapping of fb or reads the file descriptor of fb by positional reads
+// !!! Close the reader before fb !!!
+FileBufferIO* FileBufferIO_reader(FileBufferIO* fb);
+
+// Passes advice about length bytes of the file from offset to madvise if the file is mapped
+void FileBufferIO_advise(FileBufferIO* fb, unsigned long long offset, unsigned long long length, int advice);
+
 void FileBufferIO_close(FileBufferIO* fb);
 
 void FileBufferIO_close_remove(FileBufferIO* fb);
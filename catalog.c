@@ -0,0 +1,304 @@
+#include "catalog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char catalog_signature[4] = {'H', 'U', 'F', 'D'};
+
+typedef struct {
+    const char* name;
+    uint32_t index;
+} SortingName;
+
+// FNV-1a
+static uint32_t hash_name(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* c = (const unsigned char*)name; *c; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int compare_names(const void* a, const void* b) {
+    const SortingName* na = (const SortingName*)a;
+    const SortingName* nb = (const SortingName*)b;
+    int cmp = strcmp(na->name, nb->name);
+    if (cmp != 0) return cmp;
+    return na->index < nb->index ? -1 : (na->index > nb->index);
+}
+
+Catalog* Catalog_create() {
+    Catalog* catalog = (Catalog*)calloc(1, sizeof(Catalog));
+    if (!catalog) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    return catalog;
+}
+
+int Catalog_add(Catalog* catalog, const char* name, uint64_t header_pos, uint64_t size_original, uint64_t size_compressed) {
+    size_t name_size = strlen(name)+1;
+    if (catalog->count == UINT32_MAX || name_size > UINT32_MAX - catalog->names_size) {
+        fprintf(stderr, "Too many files for the archive\n");
+        return 1;
+    }
+
+    if (catalog->count == catalog->capacity) {
+        uint32_t capacity = catalog->capacity ? catalog->capacity*2 : 64;
+        if (capacity < catalog->capacity) capacity = UINT32_MAX;
+        CatalogRecord* records = (CatalogRecord*)realloc(catalog->records, (size_t)capacity * sizeof(CatalogRecord));
+        if (!records) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        catalog->records = records;
+        catalog->capacity = capacity;
+    }
+
+    if (name_size > catalog->names_capacity - catalog->names_size) {
+        uint64_t capacity = catalog->names_capacity ? catalog->names_capacity : 4096;
+        while (capacity - catalog->names_size < name_size) capacity *= 2;
+        if (capacity > UINT32_MAX) capacity = UINT32_MAX;
+        char* names = (char*)realloc(catalog->names, capacity);
+        if (!names) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        catalog->names = names;
+        catalog->names_capacity = capacity;
+    }
+
+    CatalogRecord* record = &catalog->records[catalog->count++];
+    record->header_pos = header_pos;
+    record->size_original = size_original;
+    record->size_compressed = size_compressed;
+    record->name_offset = catalog->names_size;
+    record->name_len = name_size-1;
+    memcpy(catalog->names + catalog->names_size, name, name_size);
+    catalog->names_size += name_size;
+    return 0;
+}
+
+int Catalog_add_member(Catalog* catalog, const char* name, uint64_t solid_pos, uint64_t size_original, uint64_t solid_offset) {
+    return Catalog_add(catalog, name, solid_pos, size_original, CATALOG_SOLID_MEMBER | solid_offset);
+}
+
+// Fills the sorted order and the hash index from the records
+// Returns 0 if success, else 1
+static int build_index(Catalog* catalog) {
+    free(catalog->sorted);
+    free(catalog->hash);
+
+    // At least twice as many slots as names keeps probe chains short
+    catalog->hash_size = 2;
+    while (catalog->hash_size < 2*(uint64_t)catalog->count) catalog->hash_size *= 2;
+
+    catalog->sorted = (uint32_t*)malloc(((size_t)catalog->count+1) * sizeof(uint32_t));
+    catalog->hash = (uint32_t*)calloc(catalog->hash_size, sizeof(uint32_t));
+    SortingName* sorting = (SortingName*)malloc(((size_t)catalog->count+1) * sizeof(SortingName));
+    if (!catalog->sorted || !catalog->hash || !sorting) {
+        fprintf(stderr, "Out of memory\n");
+        free(sorting);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < catalog->count; i++) {
+        sorting[i].name = Catalog_name(catalog, i);
+        sorting[i].index = i;
+
+        // Earlier records take earlier slots, so lookups find the first record of equal names
+        uint32_t slot = hash_name(sorting[i].name) & (catalog->hash_size - 1);
+        while (catalog->hash[slot] != 0) slot = (slot + 1) & (catalog->hash_size - 1);
+        catalog->hash[slot] = i + 1;
+    }
+
+    qsort(sorting, catalog->count, sizeof(SortingName), compare_names);
+    for (uint32_t i = 0; i < catalog->count; i++) {
+        catalog->sorted[i] = sorting[i].index;
+    }
+
+    free(sorting);
+    return 0;
+}
+
+int Catalog_write(Catalog* catalog, FileBufferIO* archive) {
+    if (build_index(catalog) != 0) {
+        return 1;
+    }
+
+    long long start = tellbits(archive);
+    if (start < 0 || start % 8 != 0) {
+        fprintf(stderr, "Getting file position error\n");
+        return 1;
+    }
+
+    uint64_t directory_start = start / 8;
+    size_t records_size = (size_t)catalog->count * sizeof(CatalogRecord);
+    size_t sorted_size = (size_t)catalog->count * sizeof(uint32_t);
+    size_t hash_size = (size_t)catalog->hash_size * sizeof(uint32_t);
+    if (writethrough(archive, catalog->records, records_size) != records_size
+        || writethrough(archive, catalog->names, catalog->names_size) != catalog->names_size
+        || writethrough(archive, catalog->sorted, sorted_size) != sorted_size
+        || writethrough(archive, catalog->hash, hash_size) != hash_size
+        || writethrough(archive, &directory_start, sizeof(directory_start)) != sizeof(directory_start)
+        || writethrough(archive, &catalog->count, sizeof(catalog->count)) != sizeof(catalog->count)
+        || writethrough(archive, &catalog->names_size, sizeof(catalog->names_size)) != sizeof(catalog->names_size)
+        || writethrough(archive, &catalog->hash_size, sizeof(catalog->hash_size)) != sizeof(catalog->hash_size)
+        || writethrough(archive, catalog_signature, sizeof(catalog_signature)) != sizeof(catalog_signature)) {
+        fprintf(stderr, "Error while writing the archive\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Checks that names and indices of the read catalog are in their tables
+// Returns 0 if success, else 1
+static int check_catalog(const Catalog* catalog, uint64_t directory_start) {
+    if (catalog->names_size > 0 && catalog->names[catalog->names_size-1] != '\0') {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < catalog->count; i++) {
+        // Files of one solid block share the position of its trailer
+        const CatalogRecord* record = &catalog->records[i];
+        char member = Catalog_is_member(record);
+        if (record->header_pos >= directory_start
+            || (i > 0 && record->header_pos < catalog->records[i-1].header_pos)
+            || (i > 0 && record->header_pos == catalog->records[i-1].header_pos && !(member && Catalog_is_member(&catalog->records[i-1])))
+            || (!member && record->size_compressed / 8 >= directory_start)
+            || record->name_offset >= catalog->names_size
+            || record->name_len >= catalog->names_size - record->name_offset
+            || catalog->names[record->name_offset + record->name_len] != '\0') {
+            return 1;
+        }
+        if (catalog->sorted[i] >= catalog->count) {
+            return 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < catalog->hash_size; i++) {
+        if (catalog->hash[i] > catalog->count) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+Catalog* Catalog_read(FileBufferIO* archive, uint64_t archive_size) {
+    if (archive_size < CATALOG_FOOTER_SIZE || seekbits(archive, (archive_size - CATALOG_FOOTER_SIZE)*8) != 0) {
+        fprintf(stderr, "Corrupted file: no central directory\n");
+        return NULL;
+    }
+
+    Catalog* catalog = Catalog_create();
+    if (!catalog) {
+        return NULL;
+    }
+
+    uint64_t directory_start = 0;
+    char signature[sizeof(catalog_signature)] = {0};
+    if (!archive->readbytes(archive, &directory_start, 0, sizeof(directory_start))
+        || !archive->readbytes(archive, &catalog->count, 0, sizeof(catalog->count))
+        || !archive->readbytes(archive, &catalog->names_size, 0, sizeof(catalog->names_size))
+        || !archive->readbytes(archive, &catalog->hash_size, 0, sizeof(catalog->hash_size))
+        || !archive->readbytes(archive, signature, 0, sizeof(signature))
+        || memcmp(signature, catalog_signature, sizeof(signature)) != 0) {
+        fprintf(stderr, "Corrupted file: no central directory\n");
+        Catalog_free(catalog);
+        return NULL;
+    }
+
+    // The directory fills the archive up to the footer
+    uint64_t directory_size = (uint64_t)catalog->count * (sizeof(CatalogRecord) + sizeof(uint32_t))
+        + catalog->names_size + (uint64_t)catalog->hash_size * sizeof(uint32_t);
+    if (catalog->hash_size == 0 || (catalog->hash_size & (catalog->hash_size - 1)) != 0
+        || catalog->hash_size < catalog->count
+        || directory_start > archive_size - CATALOG_FOOTER_SIZE
+        || directory_size != archive_size - CATALOG_FOOTER_SIZE - directory_start) {
+        fprintf(stderr, "Corrupted file: invalid central directory\n");
+        Catalog_free(catalog);
+        return NULL;
+    }
+
+    catalog->capacity = catalog->count;
+    catalog->names_capacity = catalog->names_size;
+    catalog->records = (CatalogRecord*)malloc(((size_t)catalog->count+1) * sizeof(CatalogRecord));
+    catalog->names = (char*)malloc((size_t)catalog->names_size+1);
+    catalog->sorted = (uint32_t*)malloc(((size_t)catalog->count+1) * sizeof(uint32_t));
+    catalog->hash = (uint32_t*)malloc((size_t)catalog->hash_size * sizeof(uint32_t));
+    if (!catalog->records || !catalog->names || !catalog->sorted || !catalog->hash) {
+        fprintf(stderr, "Out of memory\n");
+        Catalog_free(catalog);
+        return NULL;
+    }
+
+    if (seekbits(archive, directory_start*8) != 0
+        || archive->readbytes(archive, catalog->records, 0, (size_t)catalog->count * sizeof(CatalogRecord)) != (size_t)catalog->count * sizeof(CatalogRecord)*8
+        || archive->readbytes(archive, catalog->names, 0, catalog->names_size) != (size_t)catalog->names_size*8
+        || archive->readbytes(archive, catalog->sorted, 0, (size_t)catalog->count * sizeof(uint32_t)) != (size_t)catalog->count * sizeof(uint32_t)*8
+        || archive->readbytes(archive, catalog->hash, 0, (size_t)catalog->hash_size * sizeof(uint32_t)) != (size_t)catalog->hash_size * sizeof(uint32_t)*8
+        || check_catalog(catalog, directory_start) != 0) {
+        fprintf(stderr, "Corrupted file: invalid central directory\n");
+        Catalog_free(catalog);
+        return NULL;
+    }
+
+    return catalog;
+}
+
+long long Catalog_find(const Catalog* catalog, const char* name) {
+    if (catalog->hash_size == 0) return -1;
+
+    uint32_t slot = hash_name(name) & (catalog->hash_size - 1);
+    for (uint32_t probes = 0; probes < catalog->hash_size && catalog->hash[slot] != 0; probes++) {
+        uint32_t index = catalog->hash[slot] - 1;
+        if (strcmp(Catalog_name(catalog, index), name) == 0) {
+            return index;
+        }
+        slot = (slot + 1) & (catalog->hash_size - 1);
+    }
+    return -1;
+}
+
+uint32_t Catalog_lower_bound(const Catalog* catalog, const char* prefix) {
+    uint32_t left = 0;
+    uint32_t right = catalog->count;
+    while (left < right) {
+        uint32_t middle = left + (right - left) / 2;
+        if (strcmp(Catalog_name(catalog, catalog->sorted[middle]), prefix) < 0) {
+            left = middle + 1;
+        } else {
+            right = middle;
+        }
+    }
+    return left;
+}
+
+long long Catalog_find_header(const Catalog* catalog, uint64_t header_pos) {
+    uint32_t left = 0;
+    uint32_t right = catalog->count;
+    while (left < right) {
+        uint32_t middle = left + (right - left) / 2;
+        if (catalog->records[middle].header_pos < header_pos) {
+            left = middle + 1;
+        } else {
+            right = middle;
+        }
+    }
+    if (left < catalog->count && catalog->records[left].header_pos == header_pos && !Catalog_is_member(&catalog->records[left])) {
+        return left;
+    }
+    return -1;
+}
+
+void Catalog_free(Catalog* catalog) {
+    free(catalog->records);
+    free(catalog->names);
+    free(catalog->sorted);
+    free(catalog->hash);
+    free(catalog);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "buffio.h"
+
+// Central directory of the archive, it is written after the compressed files:
+// records[count], names[names_size], sorted[count], hash[hash_size], footer
+// The footer is the last CATALOG_FOOTER_SIZE bytes of the archive:
+// uint64 directory start, uint32 count, uint32 names size, uint32 hash size, signature "HUFD"
+#define CATALOG_FOOTER_SIZE 24
+
+// Files of a solid block have no headers, only their records: header_pos is the trailer of the block,
+// size_compressed is this flag with the offset of the file in the decoded block in bytes
+#define CATALOG_SOLID_MEMBER (1ull << 63)
+
+typedef struct {
+    uint64_t header_pos; // Offset of the file header in bytes
+    uint64_t size_original; // bytes
+    uint64_t size_compressed; // bits
+    uint32_t name_offset; // Offset of the name in the string table
+    uint32_t name_len; // Without '\0'
+} CatalogRecord;
+
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    CatalogRecord* records; // In the order of headers, so by header_pos
+    char* names; // String table, every name ends with '\0'
+    uint32_t names_size;
+    uint32_t names_capacity;
+    uint32_t* sorted; // Record indices in the order of names
+    uint32_t* hash; // Open addressing by the hash of the name, record index + 1, 0 - empty slot
+    uint32_t hash_size; // Power of two
+} Catalog;
+
+// Returns NULL if out of memory
+// !!! After use, run "Catalog_free" if non-null !!!
+Catalog* Catalog_create();
+
+// Adds the record of the file to the end of the catalog
+// Returns 0 if success, else 1
+int Catalog_add(Catalog* catalog, const char* name, uint64_t header_pos, uint64_t size_original, uint64_t size_compressed);
+
+// Adds the record of the file of the solid block with the trailer at solid_pos bytes to the end of the catalog
+// Returns 0 if success, else 1
+int Catalog_add_member(Catalog* catalog, const char* name, uint64_t solid_pos, uint64_t size_original, uint64_t solid_offset);
+
+// Returns 1 if the record is of a file of a solid block, else 0
+static inline int Catalog_is_member(const CatalogRecord* record) {
+    return (record->size_compressed & CATALOG_SOLID_MEMBER) != 0;
+}
+
+// Sorts and hashes names, then writes the catalog with the footer at the current byte of the archive
+// The archive is written sequentially, so it may be a pipe
+// Returns 0 if success, else 1
+int Catalog_write(Catalog* catalog, FileBufferIO* archive);
+
+// Reads the catalog by the footer at the end of the archive of archive_size bytes
+// Returns NULL if the catalog is corrupted or out of memory
+// !!! After use, run "Catalog_free" if non-null !!!
+Catalog* Catalog_read(FileBufferIO* archive, uint64_t archive_size);
+
+// Returns the name of the record
+static inline const char* Catalog_name(const Catalog* catalog, uint32_t index) {
+    return catalog->names + catalog->records[index].name_offset;
+}
+
+// Returns the index of the first record with the name, -1 if not found
+long long Catalog_find(const Catalog* catalog, const char* name);
+
+// Returns the first position in the sorted order with a name not less than prefix
+// Names starting with prefix follow it one by one
+uint32_t Catalog_lower_bound(const Catalog* catalog, const char* prefix);
+
+// Returns the index of the record of the header at header_pos bytes, -1 if not found
+// Records of files of solid blocks have no headers, so they are not found
+long long Catalog_find_header(const Catalog* catalog, uint64_t header_pos);
+
+void Catalog_free(Catalog* catalog);
@@ -0,0 +1,54 @@
+#include "cpu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static CpuLevel cpu_level = CPU_GENERIC;
+
+static const char* cpu_names[] = {"generic", "sse4.2", "avx2"};
+
+// Returns the best level supported by the processor
+static CpuLevel detect_level(void) {
+#if CPU_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+        return CPU_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+        return CPU_SSE42;
+    }
+#endif
+    return CPU_GENERIC;
+}
+
+int Cpu_init(const char* name) {
+    CpuLevel supported = detect_level();
+    if (!name) name = getenv("HUF_CPU");
+    if (!name || name[0] == '\0') {
+        cpu_level = supported;
+        return 0;
+    }
+
+    for (int level = CPU_GENERIC; level <= CPU_AVX2; level++) {
+        if (strcmp(name, cpu_names[level]) != 0) continue;
+
+        if ((CpuLevel)level > supported) {
+            fprintf(stderr, "Processor doesn't support %s kernels, the best supported are %s\n", name, cpu_names[supported]);
+            return 1;
+        }
+        cpu_level = (CpuLevel)level;
+        return 0;
+    }
+
+    fprintf(stderr, "Unknown kernels \"%s\", available: generic, sse4.2, avx2\n", name);
+    return 1;
+}
+
+CpuLevel Cpu_level(void) {
+    return cpu_level;
+}
+
+const char* Cpu_name(CpuLevel level) {
+    return cpu_names[level];
+}
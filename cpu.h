@@ -0,0 +1,41 @@
+#pragma once
+
+// Instruction set levels of the hot kernels, every level includes the previous ones
+typedef enum {
+    CPU_GENERIC = 0,
+    CPU_SSE42 = 1,
+    CPU_AVX2 = 2  // AVX2 with BMI1, BMI2 and LZCNT
+} CpuLevel;
+
+// Kernels are built for every level from one scalar C body: the body is CPU_KERNEL_INLINE,
+// and a wrapper of every level calls it with the level attribute, so the same code is
+// recompiled for that instruction set. There are no hand-written pext/bzhi or vector kernels,
+// a level only lets the compiler pick instructions such as shlx, shrx and lzcnt by itself
+// Wrappers of kernels over words call the body with a constant wordsize of 1 or 2,
+// so every level also has separate code for 8-bit and 16-bit words
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH 1
+#define CPU_TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+#define CPU_TARGET_AVX2 __attribute__((target("avx2,bmi,bmi2,lzcnt")))
+#else
+#define CPU_DISPATCH 0
+#define CPU_TARGET_SSE42
+#define CPU_TARGET_AVX2
+#endif
+
+#if defined(__GNUC__)
+#define CPU_KERNEL_INLINE static inline __attribute__((always_inline))
+#else
+#define CPU_KERNEL_INLINE static inline
+#endif
+
+// Selects the level of kernels once at startup, before any threads are started
+// name forces a level: "generic", "sse4.2" or "avx2", NULL - the HUF_CPU environment variable,
+// if it is not set, the best level supported by the processor
+// Returns 0 if success, 1 if the name is unknown or the processor doesn't support the level
+int Cpu_init(const char* name);
+
+// Returns the selected level, CPU_GENERIC before Cpu_init
+CpuLevel Cpu_level(void);
+
+const char* Cpu_name(CpuLevel level);
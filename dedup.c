@@ -0,0 +1,198 @@
+#include "dedup.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Random values of bytes for the gear hash, splitmix64 from the seed "HUFD"
+static const uint64_t gear[256] = {
+    0xc9409ff772b5ecebull, 0xdbc3ca5765a0eb85ull, 0x4f790762ca3c3791ull, 0x88444d91ec19924dull,
+    0x1bac123ec5856859ull, 0x591a2a5342041c23ull, 0x2aa3b8cd8e979ff0ull, 0x82e8a6232582a7eeull,
+    0x29c1068d5fa30babull, 0x0fb9976a6b02ac87ull, 0xe1961ac2a9cadb5aull, 0x7f87fccdead38c64ull,
+    0x66e459df1ed6281bull, 0x11846a979f1a7310ull, 0xbba6b6f8b3defc43ull, 0x59bfe5f99e235ff3ull,
+    0xf6d3cfb7db6b3334ull, 0x0bd055e71bf57efdull, 0x93caf0799838e6e0ull, 0xb132abaa3823ff77ull,
+    0x25f23dd7bc9a49f9ull, 0x4930d102b03bc780ull, 0xf14f2082272e6ee3ull, 0x25a98785d8bfe555ull,
+    0x095eae66403f927eull, 0x9a18faff97798bf3ull, 0xa81950a5afe2b86full, 0xad7dda3c11dd54baull,
+    0xf2d50dc5eefb1599ull, 0x385a081d8266c49aull, 0xcd87f696bb88b612ull, 0x6d3994d74df1a6e5ull,
+    0x5cc768b1914eb14cull, 0x488303da54c217bbull, 0x679174dd13537918ull, 0x2160212e1551b514ull,
+    0x8a774e62e610ef96ull, 0xf8b4dfb3dd0998dbull, 0xd990e07b50da54f7ull, 0x7e1ae394323d4122ull,
+    0xdb6741219a1758e5ull, 0x76a78381390d38c1ull, 0xa43bdcdd0b37736dull, 0x4ad618f7b4b17a3aull,
+    0x84d1349e3735abccull, 0xa60fcb41a46acb09ull, 0x7bb7e892dcabea22ull, 0xae1676e2e1b4a9faull,
+    0xd617e17f8c676cfeull, 0x9899c6d946297ed2ull, 0x1732b3d07c9a5f49ull, 0x57c1cb7735c41cfbull,
+    0x40a4233b390a89a7ull, 0x1c53d7c34e128da8ull, 0x18aa035a6373f452ull, 0xbd79331a4fde791full,
+    0xcbc789621be42e2aull, 0xbab417ee88c0ab27ull, 0x36e860562120fbf4ull, 0x4649604273bef54full,
+    0xc618095dbc86c01bull, 0x552747802f2baf1bull, 0x96b610eadd2560ceull, 0x09bd586f4f512b36ull,
+    0xecc8165d3eebbe1aull, 0x323f6f8fa2173cadull, 0x57ac11da09661c7eull, 0x3a277590d557a94bull,
+    0xacae109b7816e067ull, 0x4b1291f6c9247998ull, 0xd9bca5a850f539d7ull, 0x8cfb0a231d887489ull,
+    0x948c893b59681be0ull, 0x062c023e7e6cc6b1ull, 0xb1abed5d267a4676ull, 0x7187742722fe415dull,
+    0x1069f990992984ddull, 0xbac1d7d729e49be7ull, 0x1fa985e859503fedull, 0xf1d169b76bf5e716ull,
+    0xe1ca1b7487c2e5c9ull, 0x664392f9ce9ec586ull, 0x2788293c340d3136ull, 0x2486fc9d42ecc020ull,
+    0x0d38b2acdcf4ae6eull, 0xe93f04f70ad54566ull, 0x221ee813d02fc87dull, 0x46282d8b31284cb9ull,
+    0xd6111e1ae1e3f4adull, 0x548a9f56867c0f51ull, 0xbbacf25a8a27b7bcull, 0xf5d3d783fd8eede3ull,
+    0x6bb07386ac4fc401ull, 0x3abc49ef1d40bf8eull, 0x2653121619540f35ull, 0x7a9ef73ef155cd56ull,
+    0xc0181b5db301424bull, 0xd3823609b144b290ull, 0x4d38acf1b17fd36cull, 0xcaaa33885c404b2full,
+    0x628cac173c0c24b9ull, 0x3422936ede0d5452ull, 0x710b713bac469026ull, 0xd80714e5bf16ef0aull,
+    0xb5e676c15270ac69ull, 0x84bc24687311ceaaull, 0x01f9870b08628244ull, 0x2c2e80726388d1c9ull,
+    0x4ab1b070d9b059cfull, 0xd7367547a17581e2ull, 0x71d7ddf4e9cd7e17ull, 0xa7d44d407c78eb8cull,
+    0x5f78838849c98bdcull, 0xd7957f654f7da2b1ull, 0xa5d57affc3f8570bull, 0xc2cd421dcbc36ac4ull,
+    0x41b19386af5be120ull, 0xb099af6b73c90dacull, 0x13362e88ec044966ull, 0xaa2bd8eeea839a7cull,
+    0x068b3198c4e45614ull, 0x47e1c617f538c7e1ull, 0x9ac1be3d28a94b70ull, 0x8696c2ab8866b8c8ull,
+    0xba2c3ea316013c8cull, 0x33b88b1eefd8aa02ull, 0xe97114a4bdc03cd8ull, 0x8a50344daf5b43b1ull,
+    0x57b5050f25047a61ull, 0xed9d757274a10ba4ull, 0xd4bce512b3ef3a1dull, 0x313232ad117e22bfull,
+    0xe22c849406b6b547ull, 0x9c7e4231953385f8ull, 0x6b222e7b312ea72full, 0x4ec6d2fb6371fa3aull,
+    0x2cdd2b23121c4603ull, 0x2540cc3528d0a511ull, 0x8a086d58b704a45aull, 0x6e459ffb88f1e2e2ull,
+    0x4b4f4fb5ae66396dull, 0x4fc4f03e38d6ac40ull, 0x032569652131acabull, 0x7af30f3ae4d2a061ull,
+    0x2c0c1d992b09ffc9ull, 0x1184e11517ff779cull, 0xcaadddbb0995f149ull, 0x3642c4b90b3943eeull,
+    0x56953eb71dce1739ull, 0xdfea634eb9352c7cull, 0x5032596f60fab33aull, 0xe6c4f3c26a549076ull,
+    0x39ac33a039d55cafull, 0x26588dee200ba6b8ull, 0x6a5cdef5a1444d28ull, 0x3e4931452c88917cull,
+    0x40361d9cd6806d1bull, 0x71f19854672ddcadull, 0x7cf21b110c706839ull, 0x12919be5df98f232ull,
+    0x656307dc18c6bbf7ull, 0x641dd4d9a72b34b5ull, 0x20302b39f3fbe96cull, 0x28c693d793265a4full,
+    0xa0d81b364acedb19ull, 0x08da52567ed4ce49ull, 0x4b8ef28f136d971bull, 0xc2b823cfc066c810ull,
+    0x07831c086c0cba8dull, 0xb6f76ba2fcd548ebull, 0x54c30d6fed417dabull, 0x7401555166a45ed9ull,
+    0x741e692f3043a966ull, 0xcdc19847eb258ed0ull, 0x07fef9ab198db0f7ull, 0x389912c672f7d516ull,
+    0xe6c1acadc4e99820ull, 0xaaa44c11b20e7336ull, 0xbf1ccc7c151738e1ull, 0xb0a206e0ab5754a4ull,
+    0xef0a6bb7f053f7b0ull, 0x7338a4b8c29bc5f8ull, 0xb53c4759da6861d0ull, 0x576264068849f789ull,
+    0x34ebacdf713b50bcull, 0x8e3bedfa57e1ab75ull, 0x427e9bb8784eb651ull, 0xa506e79dfd222880ull,
+    0x8b45cba6c97041eaull, 0x5766c3a9be68d4e3ull, 0xa3abf1d12cb48c5eull, 0xf40a6ac751676207ull,
+    0x552662b703fff2b4ull, 0x060e877d573eb171ull, 0x6de576eeb5ae4742ull, 0xc13b0a254c9a1499ull,
+    0x278875326f4a78e6ull, 0x52019536741947daull, 0x03a07441347a53e7ull, 0xbce14f0ef6f1e998ull,
+    0xa268bb7c35a1862cull, 0x3c0a1d9d815e01f4ull, 0x45e2289ebc4175a8ull, 0xd9669a10971b7ea7ull,
+    0x5d50acadbf1e3797ull, 0xb5af407b91bb97faull, 0x5cfbae75a5178a83ull, 0x1ce83eecae57a61full,
+    0xb8472d0dc0af2893ull, 0xdfc9edaa1ab496cbull, 0xc6bb9af3848750d3ull, 0x3a06b1f25077c6cdull,
+    0x2ae34cee21f626eeull, 0x4046e4bbbff996c1ull, 0x83787302264eb064ull, 0x27507d77033f6ee9ull,
+    0x828562fb4136d0c4ull, 0x1d53696c887b71abull, 0xad15b681e6901c62ull, 0xa7ef0147775bf851ull,
+    0x7ee78a8104009d5eull, 0xae0cecb9c719b9a2ull, 0xe52ffc2138cac48dull, 0x097be4e8306fa8feull,
+    0xa7267f18d2a4e4ecull, 0xe8755696fd30a810ull, 0xa05c6b033353af13ull, 0x32e73900124cef96ull,
+    0xb51cf7796e580e1aull, 0xb36e3ac86b9c518eull, 0x33974ec72aa60696ull, 0x8269511402176390ull,
+    0x4b7bbb36722306b8ull, 0xea8103907d25afdeull, 0x725952fc8690f12cull, 0xf45225c46fa7c0b5ull,
+    0xc03b503a5eadfd24ull, 0xcbf56fa0b9dab51dull, 0x7e9bb6b1acdeb5f0ull, 0xf36b1ccb1eff906aull,
+    0xf280c5e727dbe4dbull, 0x25c238a7e3b7ebc3ull, 0xbc5ebcc8c411edefull, 0xacd380c0be245411ull,
+    0xada8778244d22e52ull, 0x8025904c0c896ab3ull, 0x2706b3c984c44dd2ull, 0x6350d3b7709176e1ull,
+    0xf9558584624d3ebeull, 0x8a8dd59dc02c7c25ull, 0x6d914e8a3276872full, 0xc46cd8fa0d6b48dcull,
+    0x497994bee2c40f8eull, 0xeeae0a1eb8026dafull, 0x8e54633f57c46559ull, 0x90b4a1e2bbddc507ull,
+};
+
+size_t Chunk_cut(const uint8_t* data, size_t size) {
+    if (size <= CHUNK_MIN) return size;
+    size_t limit = size < CHUNK_MAX ? size : CHUNK_MAX;
+
+    // Every bit of the hash depends on no more than 64 last bytes, so hashing starts just before CHUNK_MIN
+    uint64_t hash = 0;
+    for (size_t i = CHUNK_MIN - 64; i < CHUNK_MIN; i++) {
+        hash = (hash << 1) + gear[data[i]];
+    }
+    for (size_t i = CHUNK_MIN; i < limit; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash >> (64 - CHUNK_BITS)) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Final mix of murmur3
+static inline uint64_t fmix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+void Chunk_fingerprint(const uint8_t* data, size_t size, uint64_t fingerprint[2]) {
+    // Two lanes with different multipliers take every 8 bytes
+    uint64_t h1 = 0x9e3779b97f4a7c15ull ^ size;
+    uint64_t h2 = 0xc2b2ae3d27d4eb4full ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h1 = rotl64(h1 ^ (word * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+        h2 = rotl64(h2 + (word * 0x4cf5ad432745937full), 27) * 0x87c37b91114253d5ull + h1;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    h1 ^= tail * 0x87c37b91114253d5ull;
+    h2 += tail * 0x4cf5ad432745937full;
+
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    fingerprint[0] = h1;
+    fingerprint[1] = h2;
+}
+
+ChunkIndex* ChunkIndex_create() {
+    ChunkIndex* index = (ChunkIndex*)malloc(sizeof(ChunkIndex));
+    if (!index) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    index->count = 0;
+    index->slots_count = 1 << 16;
+    index->slots = (ChunkSlot*)calloc(index->slots_count, sizeof(ChunkSlot));
+    if (!index->slots) {
+        fprintf(stderr, "Out of memory\n");
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+// Returns the slot of the chunk or the empty slot where it would be
+static ChunkSlot* find_slot(ChunkSlot* slots, uint64_t slots_count, const uint64_t fingerprint[2], uint32_t size) {
+    uint64_t slot = fingerprint[0] & (slots_count - 1);
+    while (slots[slot].ref.size != 0
+        && (slots[slot].ref.size != size || slots[slot].fingerprint[0] != fingerprint[0] || slots[slot].fingerprint[1] != fingerprint[1])) {
+        slot = (slot + 1) & (slots_count - 1);
+    }
+    return &slots[slot];
+}
+
+const ChunkSlot* ChunkIndex_find(const ChunkIndex* index, const uint64_t fingerprint[2], uint32_t size) {
+    const ChunkSlot* slot = find_slot(index->slots, index->slots_count, fingerprint, size);
+    return slot->ref.size != 0 ? slot : NULL;
+}
+
+int ChunkIndex_add(ChunkIndex* index, const uint64_t fingerprint[2], const ChunkRef* ref, const ChunkSource* source) {
+    if (2*(index->count + 1) > index->slots_count) {
+        uint64_t slots_count = index->slots_count * 2;
+        ChunkSlot* slots = (ChunkSlot*)calloc(slots_count, sizeof(ChunkSlot));
+        if (!slots) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        for (uint64_t i = 0; i < index->slots_count; i++) {
+            if (index->slots[i].ref.size != 0) {
+                *find_slot(slots, slots_count, index->slots[i].fingerprint, index->slots[i].ref.size) = index->slots[i];
+            }
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->slots_count = slots_count;
+    }
+
+    ChunkSlot* slot = find_slot(index->slots, index->slots_count, fingerprint, ref->size);
+    if (slot->ref.size == 0) {
+        slot->fingerprint[0] = fingerprint[0];
+        slot->fingerprint[1] = fingerprint[1];
+        slot->ref = *ref;
+        slot->source = *source;
+        index->count++;
+    }
+    return 0;
+}
+
+void ChunkIndex_free(ChunkIndex* index) {
+    free(index->slots);
+    free(index);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content-defined chunks: a cut is made where the gear hash of the last 64 bytes has CHUNK_BITS high bits zero,
+// so equal regions of files are cut equally wherever they start
+#define CHUNK_MIN (4 << 10)
+#define CHUNK_MAX (64 << 10)
+#define CHUNK_BITS 14 // About 16K between cuts after CHUNK_MIN
+
+// Place of a chunk in the archive
+typedef struct {
+    uint64_t store; // Index of the chunk store while compressing, offset of the store trailer or of the header of a file written whole in bytes in the archive
+    uint32_t offset; // Offset of the chunk in the decoded store
+    uint32_t size; // bytes
+} ChunkRef;
+
+// Place of the bytes of a stored chunk in the files being compressed, they are read again to compare chunks
+typedef struct {
+    uint64_t offset; // bytes
+    uint32_t file; // Index of the split file while compressing
+} ChunkSource;
+
+typedef struct {
+    uint64_t fingerprint[2];
+    ChunkRef ref; // size 0 - empty slot
+    ChunkSource source;
+} ChunkSlot;
+
+// Fingerprints of stored chunks, open addressing by the fingerprint
+typedef struct {
+    ChunkSlot* slots;
+    uint64_t slots_count; // Power of two
+    uint64_t count;
+} ChunkIndex;
+
+// Returns the length of the first chunk of size bytes of data
+// The rest of data is cut in the same way after the chunk
+size_t Chunk_cut(const uint8_t* data, size_t size);
+
+// Fills fingerprint with the 128-bit hash of the chunk
+// The hash is fast, not cryptographic, it only finds candidates: chunks with equal fingerprints may differ
+void Chunk_fingerprint(const uint8_t* data, size_t size, uint64_t fingerprint[2]);
+
+// Returns NULL if out of memory
+// !!! After use, run "ChunkIndex_free" if non-null !!!
+ChunkIndex* ChunkIndex_create();
+
+// Returns the stored chunk with the fingerprint and the size, NULL if there is none
+const ChunkSlot* ChunkIndex_find(const ChunkIndex* index, const uint64_t fingerprint[2], uint32_t size);
+
+// Adds the chunk, the index grows twice when it is half full
+// Returns 0 if success, else 1
+int ChunkIndex_add(ChunkIndex* index, const uint64_t fingerprint[2], const ChunkRef* ref, const ChunkSource* source);
+
+void ChunkIndex_free(ChunkIndex* index);
@@ -109,11 +109,12 @@ char* generate_unique_filepath(const char* path) {
 
 int check_files_similar(char* path1, char* path2) {
     struct stat stat1;
-    stat(path1, &stat1);
     struct stat stat2;
-    stat(path2, &stat2);
+    if (stat(path1, &stat1) != 0 || stat(path2, &stat2) != 0) {
+        return 0;
+    }
 
-    return stat1.st_ino == stat2.st_ino;
+    return stat1.st_dev == stat2.st_dev && stat1.st_ino == stat2.st_ino;
 }
 
 int create_directories(const char *path) {
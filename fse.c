@@ -0,0 +1,357 @@
+#include "fse.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Table log is written in 4 bits, the number of the first bytes holding all present ones in 9 bits
+#define FSE_LOG_BITS 4
+#define FSE_SYMBOLS_BITS 9
+
+static inline unsigned int highbit(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
+
+// Number of bits of values below limit
+static inline unsigned int value_bits(uint32_t limit) {
+    return limit > 1 ? highbit(limit - 1) + 1 : 0;
+}
+
+// Returns log2(value) in fixed point with 16 fraction bits, value is positive
+static uint32_t log2_fixed(uint32_t value) {
+    unsigned int high = highbit(value);
+    uint32_t result = high << 16;
+
+    // Mantissa in [1, 2) with 31 fraction bits, squaring it doubles the log, so every square gives the next bit
+    uint64_t x = (uint64_t)value << (31 - high);
+    for (uint32_t bit = 1 << 15; bit > 0; bit >>= 1) {
+        x = (x * x) >> 31;
+        if (x >= ((uint64_t)2 << 31)) {
+            x >>= 1;
+            result |= bit;
+        }
+    }
+    return result;
+}
+
+unsigned int Fse_table_log(uint64_t size, unsigned int symbols) {
+    // More states than bytes give no precision, but every symbol needs some room
+    unsigned int table_log = FSE_TABLE_LOG_MIN;
+    while (table_log < FSE_TABLE_LOG_MAX && ((uint64_t)1 << table_log) < size) table_log++;
+    while (table_log < FSE_TABLE_LOG_MAX && (1u << table_log) < 2*symbols) table_log++;
+    return table_log;
+}
+
+int Fse_normalize(const unsigned long long* freqs, uint64_t total, unsigned int table_log, uint16_t* norm) {
+    if (total == 0 || table_log < FSE_TABLE_LOG_MIN || table_log > FSE_TABLE_LOG_MAX) {
+        return 1;
+    }
+
+    uint32_t size = 1u << table_log;
+    uint32_t sum = 0;
+    unsigned int largest = 0;
+    for (unsigned int s = 0; s < FSE_SYMBOLS; s++) {
+        if (freqs[s] == 0) {
+            norm[s] = 0;
+            continue;
+        }
+        uint64_t count = (freqs[s] * size + total / 2) / total;
+        norm[s] = count ? count : 1;
+        sum += norm[s];
+        if (freqs[s] > freqs[largest]) largest = s;
+    }
+
+    // Rounding is fixed on the most frequent byte, its relative error is the smallest
+    if (sum < size) {
+        norm[largest] += size - sum;
+        return 0;
+    }
+    if (norm[largest] > 2*(sum - size)) {
+        norm[largest] -= sum - size;
+        return 0;
+    }
+
+    // Many rare bytes took 1, the largest counts are cut one by one
+    while (sum > size) {
+        unsigned int max = 0;
+        for (unsigned int s = 1; s < FSE_SYMBOLS; s++) {
+            if (norm[s] > norm[max]) max = s;
+        }
+        if (norm[max] <= 1) {
+            return 1;
+        }
+        norm[max]--;
+        sum--;
+    }
+    return 0;
+}
+
+// Returns the number of bits of the counts
+static size_t counts_size(const uint16_t* norm, unsigned int table_log) {
+    unsigned int symbols = 0;
+    unsigned int present = 0;
+    for (unsigned int s = 0; s < FSE_SYMBOLS; s++) {
+        if (norm[s]) {
+            symbols = s + 1;
+            present++;
+        }
+    }
+
+    size_t bits = FSE_LOG_BITS + FSE_SYMBOLS_BITS + symbols;
+    uint32_t remaining = 1u << table_log;
+    for (unsigned int s = 0; s < symbols && present > 1; s++) {
+        if (!norm[s]) continue;
+        bits += value_bits(remaining - (present - 1));
+        remaining -= norm[s];
+        present--;
+    }
+    return bits;
+}
+
+uint64_t Fse_estimate(const unsigned long long* freqs, const uint16_t* norm, unsigned int table_log) {
+    uint64_t cost = 0; // 16 fraction bits
+    for (unsigned int s = 0; s < FSE_SYMBOLS; s++) {
+        if (!freqs[s]) continue;
+        cost += freqs[s] * (((uint64_t)table_log << 16) - log2_fixed(norm[s]));
+    }
+    return counts_size(norm, table_log) + (cost >> 16) + 2*table_log + 1 + 7;
+}
+
+// Every present byte but the last one stores its count minus 1 in the bits of the largest count it may have,
+// the last one takes the rest of the states
+size_t Fse_write_counts(FileBufferIO* stream, const uint16_t* norm, unsigned int table_log) {
+    unsigned int symbols = 0;
+    unsigned int present = 0;
+    for (unsigned int s = 0; s < FSE_SYMBOLS; s++) {
+        if (norm[s]) {
+            symbols = s + 1;
+            present++;
+        }
+    }
+
+    putbits(stream, table_log - FSE_TABLE_LOG_MIN, FSE_LOG_BITS);
+    putbits(stream, symbols - 1, FSE_SYMBOLS_BITS);
+    for (unsigned int s = 0; s < symbols; s++) {
+        putbits(stream, norm[s] != 0, 1);
+    }
+
+    uint32_t remaining = 1u << table_log;
+    for (unsigned int s = 0; s < symbols && present > 1; s++) {
+        if (!norm[s]) continue;
+        unsigned int bits = value_bits(remaining - (present - 1));
+        if (bits) putbits(stream, norm[s] - 1, bits);
+        remaining -= norm[s];
+        present--;
+    }
+    return counts_size(norm, table_log);
+}
+
+static int read_value(FileBufferIO* stream, unsigned char count, uint32_t* value) {
+    *value = 0;
+    if (count == 0) return 0;
+    *value = peekbits(stream, count);
+    if (stream->window_count < count) return 1;
+    consumebits(stream, count);
+    return 0;
+}
+
+int Fse_read_counts(FileBufferIO* stream, uint16_t* norm, unsigned int* table_log) {
+    uint32_t log = 0;
+    uint32_t symbols = 0;
+    if (read_value(stream, FSE_LOG_BITS, &log) != 0 || log > FSE_TABLE_LOG_MAX - FSE_TABLE_LOG_MIN
+        || read_value(stream, FSE_SYMBOLS_BITS, &symbols) != 0 || symbols >= FSE_SYMBOLS) {
+        fprintf(stderr, "Corrupted tANS counts\n");
+        return 1;
+    }
+    *table_log = log + FSE_TABLE_LOG_MIN;
+    symbols++;
+
+    memset(norm, 0, FSE_SYMBOLS * sizeof(uint16_t));
+    unsigned int present = 0;
+    for (uint32_t s = 0; s < symbols; s++) {
+        uint32_t flag = 0;
+        if (read_value(stream, 1, &flag) != 0) {
+            fprintf(stderr, "Corrupted tANS counts\n");
+            return 1;
+        }
+        norm[s] = flag;
+        present += flag;
+    }
+    if (!norm[symbols - 1] || present > (1u << *table_log)) {
+        fprintf(stderr, "Corrupted tANS counts\n");
+        return 1;
+    }
+
+    uint32_t remaining = 1u << *table_log;
+    for (uint32_t s = 0; s < symbols; s++) {
+        if (!norm[s]) continue;
+        if (present == 1) {
+            norm[s] = remaining;
+            break;
+        }
+
+        uint32_t limit = remaining - (present - 1);
+        uint32_t count = 0;
+        if (read_value(stream, value_bits(limit), &count) != 0 || count >= limit) {
+            fprintf(stderr, "Corrupted tANS counts\n");
+            return 1;
+        }
+        norm[s] = count + 1;
+        remaining -= norm[s];
+        present--;
+    }
+    return 0;
+}
+
+// Spreads symbols over the states, symbols[u] is the symbol decoded from state u
+// The step is odd, so it visits every state once, and neighbor states get different symbols
+static void spread_symbols(const uint16_t* norm, unsigned int table_log, uint8_t* symbols) {
+    uint32_t size = 1u << table_log;
+    uint32_t mask = size - 1;
+    uint32_t step = (size >> 1) + (size >> 3) + 3;
+    uint32_t pos = 0;
+    for (unsigned int s = 0; s < FSE_SYMBOLS; s++) {
+        for (uint32_t i = 0; i < norm[s]; i++) {
+            symbols[pos] = s;
+            pos = (pos + step) & mask;
+        }
+    }
+}
+
+void FseEncodeTable_build(FseEncodeTable* table, const uint16_t* norm, unsigned int table_log) {
+    uint32_t size = 1u << table_log;
+    uint8_t symbols[1 << FSE_TABLE_LOG_MAX];
+    spread_symbols(norm, table_log, symbols);
+
+    // States of a symbol are stored together in the order of the decoder states
+    uint32_t cumul[FSE_SYMBOLS];
+    uint32_t total = 0;
+    for (unsigned int s = 0; s < FSE_SYMBOLS; s++) {
+        cumul[s] = total;
+        total += norm[s];
+    }
+    for (uint32_t u = 0; u < size; u++) {
+        table->states[cumul[symbols[u]]++] = size + u;
+    }
+
+    // A symbol with count n takes max_bits or max_bits - 1 bits, max_bits for states from n << max_bits
+    total = 0;
+    for (unsigned int s = 0; s < FSE_SYMBOLS; s++) {
+        FseSymbol* symbol = &table->symbols[s];
+        if (norm[s] == 0) {
+            symbol->delta_bits = 0;
+            symbol->delta_state = 0;
+            continue;
+        }
+        uint32_t max_bits = norm[s] == 1 ? table_log : table_log - highbit(norm[s] - 1);
+        symbol->delta_bits = (int32_t)((max_bits << 16) - ((uint32_t)norm[s] << max_bits));
+        symbol->delta_state = (int32_t)total - norm[s];
+        total += norm[s];
+    }
+    table->table_log = table_log;
+}
+
+void FseDecodeTable_build(FseDecodeTable* table, const uint16_t* norm, unsigned int table_log) {
+    uint32_t size = 1u << table_log;
+    uint8_t symbols[1 << FSE_TABLE_LOG_MAX];
+    spread_symbols(norm, table_log, symbols);
+
+    uint32_t next[FSE_SYMBOLS];
+    for (unsigned int s = 0; s < FSE_SYMBOLS; s++) {
+        next[s] = norm[s];
+    }
+    for (uint32_t u = 0; u < size; u++) {
+        uint8_t s = symbols[u];
+        uint32_t x = next[s]++;
+        uint8_t bits = table_log - highbit(x);
+        table->entries[u].symbol = s;
+        table->entries[u].bits = bits;
+        table->entries[u].base = (x << bits) - size;
+    }
+    table->table_log = table_log;
+}
+
+uint64_t Fse_encode(FileBufferIO* stream, const FseEncodeTable* table, const uint8_t* data, size_t size) {
+    uint32_t size_states = 1u << table->table_log;
+    uint32_t states[FSE_DECODER_STATES] = {size_states, size_states};
+    uint64_t bits = 0;
+    for (size_t i = size; i > 0; i--) {
+        const FseSymbol* symbol = &table->symbols[data[i-1]];
+        uint32_t* state = &states[(i-1) % FSE_DECODER_STATES];
+        uint32_t count = (*state + symbol->delta_bits) >> 16;
+        if (count) putbits(stream, *state & ((1u << count) - 1), count);
+        bits += count;
+        *state = table->states[(*state >> count) + symbol->delta_state];
+    }
+
+    // The decoder starts from the final states, the marker shows where the stream ends
+    putbits(stream, states[1] - size_states, table->table_log);
+    putbits(stream, states[0] - size_states, table->table_log);
+    putbits(stream, 1, 1);
+    return bits + 2*table->table_log + 1;
+}
+
+// Returns count bits of the stream before pos
+static inline uint32_t read_back(const uint8_t* data, int64_t pos, unsigned int count) {
+    int64_t end = (pos + 7) >> 3;
+    const uint8_t* bytes = data + end - 8;
+    uint64_t window = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&window, bytes, sizeof(window));
+    window = __builtin_bswap64(window);
+#else
+    memcpy(&window, bytes, sizeof(window));
+#endif
+    return (window >> (end*8 - pos)) & ((1u << count) - 1);
+}
+
+int FseDecoder_init(FseDecoder* decoder, const FseDecodeTable* table, const uint8_t* data, size_t size) {
+    if (size == 0 || data[size-1] == 0) {
+        return 1;
+    }
+    decoder->data = data;
+    decoder->pos = (int64_t)size*8 - 1 - __builtin_ctz(data[size-1]);
+    if (decoder->pos < 2*table->table_log) {
+        return 1;
+    }
+    for (int j = 0; j < FSE_DECODER_STATES; j++) {
+        decoder->states[j] = read_back(data, decoder->pos, table->table_log);
+        decoder->pos -= table->table_log;
+    }
+    return 0;
+}
+
+size_t Fse_decode(const FseDecodeTable* table, FseDecoder* decoder, uint8_t* out, size_t count) {
+    const uint8_t* data = decoder->data;
+    int64_t pos = decoder->pos;
+    uint32_t state = decoder->states[0];
+    uint32_t other = decoder->states[1];
+
+    // Lookups of the two states don't wait for each other
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        FseEntry entry = table->entries[state];
+        FseEntry entry_other = table->entries[other];
+        if (entry.bits + entry_other.bits > pos) break;
+        out[i] = entry.symbol;
+        out[i+1] = entry_other.symbol;
+        state = entry.base + read_back(data, pos, entry.bits);
+        pos -= entry.bits;
+        other = entry_other.base + read_back(data, pos, entry_other.bits);
+        pos -= entry_other.bits;
+    }
+
+    for (; i < count; i++) {
+        FseEntry entry = table->entries[state];
+        if (entry.bits > pos) break;
+        out[i] = entry.symbol;
+        uint32_t next = entry.base + read_back(data, pos, entry.bits);
+        pos -= entry.bits;
+        state = other;
+        other = next;
+    }
+
+    decoder->pos = pos;
+    decoder->states[0] = state;
+    decoder->states[1] = other;
+    return i;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffio.h"
+
+// Table-based ANS coder of bytes
+// Every symbol has a normalized count, counts sum up to 1 << table_log, the number of coder states
+// A symbol with count n costs about table_log - log2(n) bits, fractions of bits included
+#define FSE_SYMBOLS 256
+#define FSE_TABLE_LOG_MIN 5
+#define FSE_TABLE_LOG_MAX 12
+
+// Encoding of a symbol from state (in [size, 2*size)):
+// bits = (state + delta_bits) >> 16 low bits of the state are written, the next state is states[(state >> bits) + delta_state]
+typedef struct {
+    int32_t delta_bits;
+    int32_t delta_state;
+} FseSymbol;
+
+typedef struct {
+    unsigned int table_log;
+    uint16_t states[1 << FSE_TABLE_LOG_MAX];
+    FseSymbol symbols[FSE_SYMBOLS];
+} FseEncodeTable;
+
+// Decoding from state: the symbol is taken, the next state is base plus the next bits of the stream
+typedef struct {
+    uint16_t base;
+    uint8_t symbol;
+    uint8_t bits;
+} FseEntry;
+
+typedef struct {
+    unsigned int table_log;
+    FseEntry entries[1 << FSE_TABLE_LOG_MAX];
+} FseDecodeTable;
+
+// Symbols take turns between this many states, so the decoder can look up two symbols at once
+#define FSE_DECODER_STATES 2
+
+// Reader of the stream from its end, the encoder writes symbols from the last one
+// At least 8 bytes before the stream must be readable, they are never used
+typedef struct {
+    const uint8_t* data;
+    int64_t pos; // Bits of the stream left before the read ones
+    uint32_t states[FSE_DECODER_STATES]; // The first one decodes the next symbol
+} FseDecoder;
+
+// Returns the table log for size bytes with symbols different bytes
+unsigned int Fse_table_log(uint64_t size, unsigned int symbols);
+
+// Scales freqs of bytes summing up to total to counts summing up to 1 << table_log, every present byte gets at least 1
+// Returns 0 if success, else 1
+int Fse_normalize(const unsigned long long* freqs, uint64_t total, unsigned int table_log, uint16_t* norm);
+
+// Estimates the size of the block coded with the counts: the counts, the codes and the final states
+// Returns the size in bits
+uint64_t Fse_estimate(const unsigned long long* freqs, const uint16_t* norm, unsigned int table_log);
+
+// Writes the table log and the counts
+// Returns the number of written bits
+size_t Fse_write_counts(FileBufferIO* stream, const uint16_t* norm, unsigned int table_log);
+
+// Reads counts written by Fse_write_counts
+// Returns 0 if success, else 1
+int Fse_read_counts(FileBufferIO* stream, uint16_t* norm, unsigned int* table_log);
+
+void FseEncodeTable_build(FseEncodeTable* table, const uint16_t* norm, unsigned int table_log);
+
+void FseDecodeTable_build(FseDecodeTable* table, const uint16_t* norm, unsigned int table_log);
+
+// Writes codes of size bytes of data from the last one, then the final states and the end marker bit
+// Every byte of data must have a non-zero count
+// Returns the number of written bits
+uint64_t Fse_encode(FileBufferIO* stream, const FseEncodeTable* table, const uint8_t* data, size_t size);
+
+// Starts reading the stream of size bytes written by Fse_encode and padded to the byte boundary
+// Returns 0 if success, else 1
+int FseDecoder_init(FseDecoder* decoder, const FseDecodeTable* table, const uint8_t* data, size_t size);
+
+// Decodes count bytes to out
+// Returns the number of decoded bytes, less than count if the stream has ended
+size_t Fse_decode(const FseDecodeTable* table, FseDecoder* decoder, uint8_t* out, size_t count);
+
+// Returns 1 if the whole stream is read and the decoder is back in the initial states of the encoder, else 0
+static inline int FseDecoder_finished(const FseDecoder* decoder) {
+    return decoder->pos == 0 && decoder->states[0] == 0 && decoder->states[1] == 0;
+}
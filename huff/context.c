@@ -0,0 +1,304 @@
+#include "context.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree/builder.h"
+#include "tree/lengths.h"
+
+// Rounds of moving previous bytes to the table that codes their followers shortest
+#define CONTEXT_ITERATIONS 6
+
+// Number of tables is written in this many bits
+#define CONTEXT_TABLES_BITS 6
+
+// Bytes after every previous byte in a sparse form: counts[starts[c]..starts[c+1]) of bytes[] follow byte c
+typedef struct {
+    uint32_t starts[CONTEXT_SYMBOLS + 1];
+    uint8_t bytes[CONTEXT_SYMBOLS * CONTEXT_SYMBOLS];
+    uint32_t counts[CONTEXT_SYMBOLS * CONTEXT_SYMBOLS];
+    uint64_t totals[CONTEXT_SYMBOLS];
+    uint8_t order[CONTEXT_SYMBOLS]; // Previous bytes seen in the data, the most frequent first
+    unsigned int active;
+} Followers;
+
+// Number of bits of values below limit
+static inline unsigned int value_bits(uint32_t limit) {
+    return limit > 1 ? 32 - __builtin_clz(limit - 1) : 0;
+}
+
+// Fills lengths with code lengths of freqs up to maxlen, all zero if there are no bytes
+// Returns 0 if success, else 1
+static int table_lengths(const unsigned long long* freqs, uint8_t* lengths, uint8_t maxlen) {
+    HuffmanTree* tree = TreeBuilder_build(freqs, CONTEXT_SYMBOLS);
+    int status = Codes_lengths(tree, lengths, CONTEXT_SYMBOLS, maxlen);
+    if (tree) HuffmanTree_free(tree);
+    return status;
+}
+
+// Returns 0 if success, else 1
+static int count_followers(const uint8_t* data, size_t size, Followers* followers) {
+    uint32_t* pairs = (uint32_t*)calloc(CONTEXT_SYMBOLS * CONTEXT_SYMBOLS, sizeof(uint32_t));
+    if (!pairs) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    uint8_t prev = 0;
+    for (size_t i = 0; i < size; i++) {
+        pairs[prev * CONTEXT_SYMBOLS + data[i]]++;
+        prev = data[i];
+    }
+
+    uint32_t n = 0;
+    followers->active = 0;
+    for (unsigned int c = 0; c < CONTEXT_SYMBOLS; c++) {
+        followers->starts[c] = n;
+        followers->totals[c] = 0;
+        for (unsigned int b = 0; b < CONTEXT_SYMBOLS; b++) {
+            uint32_t count = pairs[c * CONTEXT_SYMBOLS + b];
+            if (!count) continue;
+            followers->bytes[n] = b;
+            followers->counts[n] = count;
+            followers->totals[c] += count;
+            n++;
+        }
+
+        // Insertion by the total keeps the order stable for equal totals
+        if (followers->totals[c]) {
+            unsigned int j = followers->active++;
+            while (j > 0 && followers->totals[followers->order[j-1]] < followers->totals[c]) {
+                followers->order[j] = followers->order[j-1];
+                j--;
+            }
+            followers->order[j] = c;
+        }
+    }
+    followers->starts[CONTEXT_SYMBOLS] = n;
+
+    free(pairs);
+    return 0;
+}
+
+// Clusters previous bytes into up to tables tables, fills the model
+// The most frequent previous bytes start the tables, then every byte moves to the table coding its followers shortest
+// Returns 0 if success, else 1
+static int cluster(const Followers* followers, unsigned int tables, uint8_t maxlen, ContextModel* model) {
+    uint8_t assign[CONTEXT_SYMBOLS] = {0};
+    uint8_t costs[CONTEXT_TABLES_MAX][CONTEXT_SYMBOLS];
+
+    memset(model->freqs, 0, sizeof(model->freqs));
+    for (unsigned int k = 0; k < tables; k++) {
+        uint8_t c = followers->order[k];
+        for (uint32_t i = followers->starts[c]; i < followers->starts[c+1]; i++) {
+            model->freqs[k][followers->bytes[i]] += followers->counts[i];
+        }
+    }
+
+    for (int iteration = 0; iteration < CONTEXT_ITERATIONS; iteration++) {
+        // A byte missing from a table would get one of its longest codes
+        for (unsigned int k = 0; k < tables; k++) {
+            if (table_lengths(model->freqs[k], model->lengths[k], maxlen) != 0) {
+                return 1;
+            }
+            for (unsigned int b = 0; b < CONTEXT_SYMBOLS; b++) {
+                costs[k][b] = model->lengths[k][b] ? model->lengths[k][b] : maxlen + 2;
+            }
+        }
+
+        char changed = 0;
+        for (unsigned int j = 0; j < followers->active; j++) {
+            uint8_t c = followers->order[j];
+            uint64_t best_cost = UINT64_MAX;
+            unsigned int best = 0;
+            for (unsigned int k = 0; k < tables; k++) {
+                uint64_t cost = 0;
+                for (uint32_t i = followers->starts[c]; i < followers->starts[c+1]; i++) {
+                    cost += (uint64_t)followers->counts[i] * costs[k][followers->bytes[i]];
+                }
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best = k;
+                }
+            }
+            if (assign[c] != best || iteration == 0) changed = 1;
+            assign[c] = best;
+        }
+
+        memset(model->freqs, 0, sizeof(model->freqs));
+        for (unsigned int j = 0; j < followers->active; j++) {
+            uint8_t c = followers->order[j];
+            for (uint32_t i = followers->starts[c]; i < followers->starts[c+1]; i++) {
+                model->freqs[assign[c]][followers->bytes[i]] += followers->counts[i];
+            }
+        }
+        if (!changed) break;
+    }
+
+    // Tables left without bytes are dropped, unseen previous bytes take the first table
+    uint8_t renumber[CONTEXT_TABLES_MAX];
+    unsigned int count = 0;
+    for (unsigned int k = 0; k < tables; k++) {
+        char used = 0;
+        for (unsigned int b = 0; b < CONTEXT_SYMBOLS && !used; b++) {
+            used = model->freqs[k][b] != 0;
+        }
+        if (!used) continue;
+        renumber[k] = count;
+        if (count != k) memcpy(model->freqs[count], model->freqs[k], sizeof(model->freqs[k]));
+        count++;
+    }
+    model->tables_count = count;
+
+    memset(model->map, 0, sizeof(model->map));
+    for (unsigned int j = 0; j < followers->active; j++) {
+        uint8_t c = followers->order[j];
+        model->map[c] = renumber[assign[c]];
+    }
+
+    for (unsigned int k = 0; k < count; k++) {
+        if (table_lengths(model->freqs[k], model->lengths[k], maxlen) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+ContextModel* ContextModel_create(const uint8_t* data, size_t size, unsigned int tables, uint8_t maxlen) {
+    Followers* followers = (Followers*)malloc(sizeof(Followers));
+    ContextModel* best = (ContextModel*)malloc(sizeof(ContextModel));
+    ContextModel* trial = (ContextModel*)malloc(sizeof(ContextModel));
+    if (!followers || !best || !trial) {
+        fprintf(stderr, "Out of memory\n");
+        free(followers);
+        free(best);
+        free(trial);
+        return NULL;
+    }
+    if (count_followers(data, size, followers) != 0 || followers->active == 0) {
+        free(followers);
+        free(best);
+        free(trial);
+        return NULL;
+    }
+
+    if (tables > CONTEXT_TABLES_MAX) tables = CONTEXT_TABLES_MAX;
+    if (tables > followers->active) tables = followers->active;
+
+    // Every halving of the tables is tried, small blocks can't pay for many tables
+    uint64_t best_bits = UINT64_MAX;
+    for (unsigned int count = tables; count > 0; count /= 2) {
+        if (cluster(followers, count, maxlen, trial) != 0) {
+            continue;
+        }
+        uint64_t bits = ContextModel_estimate(trial);
+        if (bits < best_bits) {
+            best_bits = bits;
+            ContextModel* swap = best;
+            best = trial;
+            trial = swap;
+        }
+    }
+
+    free(followers);
+    free(trial);
+    if (best_bits == UINT64_MAX) {
+        free(best);
+        return NULL;
+    }
+    return best;
+}
+
+uint64_t ContextModel_estimate(const ContextModel* model) {
+    uint64_t bits = CONTEXT_TABLES_BITS + 7;
+    if (model->tables_count > 1) {
+        bits += CONTEXT_SYMBOLS * value_bits(model->tables_count);
+    }
+    for (unsigned int k = 0; k < model->tables_count; k++) {
+        size_t lengths_bits = Lengths_size(model->lengths[k], CONTEXT_SYMBOLS);
+        if (lengths_bits == 0) {
+            return UINT64_MAX;
+        }
+        bits += lengths_bits;
+        for (unsigned int b = 0; b < CONTEXT_SYMBOLS; b++) {
+            bits += model->freqs[k][b] * model->lengths[k][b];
+        }
+    }
+    return bits;
+}
+
+size_t ContextModel_write(FileBufferIO* stream, const ContextModel* model) {
+    putbits(stream, model->tables_count - 1, CONTEXT_TABLES_BITS);
+    size_t bits = CONTEXT_TABLES_BITS;
+
+    unsigned int map_bits = value_bits(model->tables_count);
+    if (map_bits) {
+        for (unsigned int c = 0; c < CONTEXT_SYMBOLS; c++) {
+            putbits(stream, model->map[c], map_bits);
+        }
+        bits += CONTEXT_SYMBOLS * map_bits;
+    }
+
+    for (unsigned int k = 0; k < model->tables_count; k++) {
+        size_t lengths_bits = Lengths_write(stream, model->lengths[k], CONTEXT_SYMBOLS);
+        if (lengths_bits == 0) {
+            return 0;
+        }
+        bits += lengths_bits;
+    }
+    return bits;
+}
+
+int ContextModel_read(FileBufferIO* stream, ContextModel* model) {
+    uint64_t value = peekbits(stream, CONTEXT_TABLES_BITS);
+    if (stream->window_count < CONTEXT_TABLES_BITS) {
+        fprintf(stderr, "Corrupted context tables\n");
+        return 1;
+    }
+    consumebits(stream, CONTEXT_TABLES_BITS);
+    model->tables_count = value + 1;
+
+    memset(model->map, 0, sizeof(model->map));
+    unsigned int map_bits = value_bits(model->tables_count);
+    for (unsigned int c = 0; c < CONTEXT_SYMBOLS && map_bits; c++) {
+        value = peekbits(stream, map_bits);
+        if (stream->window_count < map_bits || value >= model->tables_count) {
+            fprintf(stderr, "Corrupted context tables\n");
+            return 1;
+        }
+        consumebits(stream, map_bits);
+        model->map[c] = value;
+    }
+
+    for (unsigned int k = 0; k < model->tables_count; k++) {
+        if (Lengths_read(stream, model->lengths[k], CONTEXT_SYMBOLS) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint64_t Context_encode(FileBufferIO* stream, const Code* const* codes, const uint8_t* data, size_t size) {
+    uint64_t bits = 0;
+    uint8_t prev = 0;
+    for (size_t i = 0; i < size; i++) {
+        Code code = codes[prev][data[i]];
+        putbits(stream, CODE_BITS(code), CODE_SIZE(code));
+        bits += CODE_SIZE(code);
+        prev = data[i];
+    }
+    return bits;
+}
+
+size_t Context_decode(const DecodeTable* const* tables, DecodeStream* stream, uint8_t* out, size_t count, uint8_t* prev) {
+    uint8_t last = *prev;
+    size_t i = 0;
+    for (; i < count; i++) {
+        int32_t symbol = DecodeStream_next(tables[last], stream);
+        if (symbol < 0) break;
+        out[i] = symbol;
+        last = symbol;
+    }
+    *prev = last;
+    return i;
+}
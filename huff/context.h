@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../buffio.h"
+#include "tree/codes.h"
+#include "tree/table.h"
+
+// Order-1 model of bytes: every byte is coded by the table of the byte before it, the first byte of a block follows 0
+// Previous bytes with similar followers share a table, so a block stores at most CONTEXT_TABLES_MAX tables
+#define CONTEXT_SYMBOLS 256
+#define CONTEXT_TABLES_MAX 64
+
+typedef struct {
+    unsigned int tables_count;
+    uint8_t map[CONTEXT_SYMBOLS]; // Table of the bytes after every byte
+    unsigned long long freqs[CONTEXT_TABLES_MAX][CONTEXT_SYMBOLS];
+    uint8_t lengths[CONTEXT_TABLES_MAX][CONTEXT_SYMBOLS];
+} ContextModel;
+
+// Counts bytes after every byte of size bytes of data, clusters the previous bytes into up to tables tables
+// and builds code lengths up to maxlen of every table
+// Fewer tables are taken if their smaller size pays for worse codes
+// Returns NULL if out of memory
+// !!! After use, run "free" if non-null !!!
+ContextModel* ContextModel_create(const uint8_t* data, size_t size, unsigned int tables, uint8_t maxlen);
+
+// Returns the size of the tables, the map and the codes of the data in bits
+uint64_t ContextModel_estimate(const ContextModel* model);
+
+// Writes the number of tables, the map and code lengths of every table
+// Returns the number of written bits, 0 if failed
+size_t ContextModel_write(FileBufferIO* stream, const ContextModel* model);
+
+// Reads the map and code lengths written by ContextModel_write, freqs are not filled
+// Returns 0 if success, else 1
+int ContextModel_read(FileBufferIO* stream, ContextModel* model);
+
+// Writes codes of size bytes of data, codes[b] are codes of the table of bytes after b
+// Returns the number of written bits
+uint64_t Context_encode(FileBufferIO* stream, const Code* const* codes, const uint8_t* data, size_t size);
+
+// Decodes up to count bytes of the stream to out, tables[b] decodes bytes after b
+// prev is the byte before the first one, it is updated to the last decoded byte
+// Returns the number of decoded bytes, less than count if the stream has no code at its position
+size_t Context_decode(const DecodeTable* const* tables, DecodeStream* stream, uint8_t* out, size_t count, uint8_t* prev);
@@ -0,0 +1,121 @@
+#include "histogram.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cpu.h"
+#include "tree/codes.h"
+
+// Repeated words increment the same counter one after another and wait for the previous store
+// Interleaved sub-tables let the increments of neighbouring words run independently
+#define BYTE_TABLES 4
+#define WORD16_TABLES 2
+
+// Counters of sub-tables are 32-bit, so the buffer is counted by parts that can't overflow them
+#define PART_SIZE ((size_t)1 << 30)
+
+// Buffers smaller than this are counted directly, clearing and merging big sub-tables costs more
+#define WORD16_MIN_SIZE ((size_t)1 << 16)
+
+CPU_KERNEL_INLINE void count_simple(const uint8_t* data, size_t size, uint8_t wordsize, unsigned long long* freqs) {
+    size_t words_count = size / wordsize;
+    for (size_t i = 0; i < words_count; i++) {
+        freqs[wordtoi(data + i*wordsize, wordsize)]++;
+    }
+}
+
+CPU_KERNEL_INLINE void count_bytes(const uint8_t* data, size_t size, unsigned long long* freqs) {
+    uint32_t tables[BYTE_TABLES][256];
+    memset(tables, 0, sizeof(tables));
+
+    // 16 bytes per step, every byte of a 64-bit word goes to the next sub-table
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        uint64_t a, b;
+        memcpy(&a, data + i, sizeof(a));
+        memcpy(&b, data + i + 8, sizeof(b));
+        for (int j = 0; j < 8; j += BYTE_TABLES) {
+            tables[0][(a >> (j*8)) & 0xFF]++;
+            tables[1][(a >> (j*8 + 8)) & 0xFF]++;
+            tables[2][(a >> (j*8 + 16)) & 0xFF]++;
+            tables[3][(a >> (j*8 + 24)) & 0xFF]++;
+            tables[0][(b >> (j*8)) & 0xFF]++;
+            tables[1][(b >> (j*8 + 8)) & 0xFF]++;
+            tables[2][(b >> (j*8 + 16)) & 0xFF]++;
+            tables[3][(b >> (j*8 + 24)) & 0xFF]++;
+        }
+    }
+    for (; i < size; i++) {
+        tables[0][data[i]]++;
+    }
+
+    for (int word = 0; word < 256; word++) {
+        freqs[word] += (unsigned long long)tables[0][word] + tables[1][word] + tables[2][word] + tables[3][word];
+    }
+}
+
+// Returns 0 if success, 1 if out of memory
+CPU_KERNEL_INLINE int count_words16(const uint8_t* data, size_t size, unsigned long long* freqs) {
+    uint32_t* tables = (uint32_t*)calloc((size_t)WORD16_TABLES << 16, sizeof(uint32_t));
+    if (!tables) {
+        return 1;
+    }
+    uint32_t* table0 = tables;
+    uint32_t* table1 = tables + (1 << 16);
+
+    // Words are little-endian as in wordtoi, 4 words per 64-bit load
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t a;
+        memcpy(&a, data + i, sizeof(a));
+        table0[a & 0xFFFF]++;
+        table1[(a >> 16) & 0xFFFF]++;
+        table0[(a >> 32) & 0xFFFF]++;
+        table1[a >> 48]++;
+    }
+    for (; i + 2 <= size; i += 2) {
+        table0[data[i] | (data[i+1] << 8)]++;
+    }
+
+    for (int word = 0; word < (1 << 16); word++) {
+        freqs[word] += (unsigned long long)table0[word] + table1[word];
+    }
+    free(tables);
+    return 0;
+}
+
+CPU_KERNEL_INLINE void count_words(const uint8_t* data, size_t size, uint8_t wordsize, unsigned long long* freqs) {
+    // Parts keep whole words
+    for (size_t offset = 0; offset < size; offset += PART_SIZE) {
+        size_t part = size - offset < PART_SIZE ? size - offset : PART_SIZE;
+
+        if (wordsize == 1) {
+            count_bytes(data + offset, part, freqs);
+        } else if (part < WORD16_MIN_SIZE || count_words16(data + offset, part, freqs) != 0) {
+            count_simple(data + offset, part, wordsize, freqs);
+        }
+    }
+}
+
+static void count_words_generic(const uint8_t* data, size_t size, uint8_t wordsize, unsigned long long* freqs) {
+    if (wordsize == 1) count_words(data, size, 1, freqs);
+    else count_words(data, size, 2, freqs);
+}
+
+CPU_TARGET_SSE42 static void count_words_sse42(const uint8_t* data, size_t size, uint8_t wordsize, unsigned long long* freqs) {
+    if (wordsize == 1) count_words(data, size, 1, freqs);
+    else count_words(data, size, 2, freqs);
+}
+
+CPU_TARGET_AVX2 static void count_words_avx2(const uint8_t* data, size_t size, uint8_t wordsize, unsigned long long* freqs) {
+    if (wordsize == 1) count_words(data, size, 1, freqs);
+    else count_words(data, size, 2, freqs);
+}
+
+void Histogram_count(const uint8_t* data, size_t size, uint8_t wordsize, unsigned long long* freqs) {
+    switch (Cpu_level()) {
+        case CPU_AVX2: count_words_avx2(data, size, wordsize, freqs); break;
+        case CPU_SSE42: count_words_sse42(data, size, wordsize, freqs); break;
+        default: count_words_generic(data, size, wordsize, freqs); break;
+    }
+}
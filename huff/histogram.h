@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Adds the number of every word of wordsize bytes (1 or 2) of the buffer to freqs
+// freqs holds ALPHABET_SIZE(wordsize) counters, the word is the index as in wordtoi
+// The last incomplete word is not counted
+// The kernel is built for every level of cpu.h and dispatched by Cpu_level
+void Histogram_count(const uint8_t* data, size_t size, uint8_t wordsize, unsigned long long* freqs);
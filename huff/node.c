@@ -4,43 +4,35 @@
 #include <stdlib.h>
 #include <string.h>
 
-HuffmanNode* HuffmanNode_create(
-    uint8_t wordsize,
-    uint8_t* word,
-    unsigned long long freq,
-    HuffmanNode* left,
-    HuffmanNode* right
-) {
-    HuffmanNode* node = (HuffmanNode*)malloc(sizeof(HuffmanNode));
-    if (node == NULL) return NULL;
-    if (word == NULL) {
-        node->word = NULL;
-        node->wordsize = 0;
-        if (wordsize != 0) {
-            fprintf(stderr, "WARNING: In HuffmanNode_create() word NULL with size > 0\n");
-        }
-    } else {
-        node->wordsize = wordsize;
-        int wordsize_bytes = (wordsize/8 + (wordsize%8 > 0));
-        node->word = (unsigned char*)malloc(sizeof(unsigned char) * wordsize_bytes);
-        if (!node->word) {
-            free(node);
-            return NULL;
-        }
+HuffmanTree* HuffmanTree_create(uint32_t capacity) {
+    // Frequencies go first to keep them aligned
+    size_t arrays_size = (size_t)capacity * (sizeof(unsigned long long) + 3*sizeof(uint32_t));
+    HuffmanTree* tree = (HuffmanTree*)malloc(sizeof(HuffmanTree) + arrays_size);
+    if (tree == NULL) return NULL;
 
-        for (int i = 0; i < wordsize_bytes; i++) {
-            node->word[i] = word[i];
-        }
+    tree->size = 0;
+    tree->capacity = capacity;
+    tree->root = HUFFMAN_NO_NODE;
+    tree->freqs = (unsigned long long*)(tree + 1);
+    tree->left = (uint32_t*)(tree->freqs + capacity);
+    tree->right = tree->left + capacity;
+    tree->words = tree->right + capacity;
+    return tree;
+}
+
+uint32_t HuffmanTree_add(HuffmanTree* tree, uint32_t word, unsigned long long freq, uint32_t left, uint32_t right) {
+    if (tree->size == tree->capacity) {
+        return HUFFMAN_NO_NODE;
     }
-    node->freq = freq;
-    node->left = left;
-    node->right = right;
+
+    uint32_t node = tree->size++;
+    tree->words[node] = word;
+    tree->freqs[node] = freq;
+    tree->left[node] = left;
+    tree->right[node] = right;
     return node;
 }
 
-void HuffmanNode_freetree(HuffmanNode* tree) {
-    if (tree->left) HuffmanNode_freetree(tree->left);
-    if (tree->right) HuffmanNode_freetree(tree->right);
-    if (tree->word) free(tree->word);
+void HuffmanTree_free(HuffmanTree* tree) {
     free(tree);
-}
\ No newline at end of file
+}
@@ -1,23 +1,32 @@
 #pragma once
 #include <stdint.h>
 
-typedef struct HuffmanNode {
-    uint8_t wordsize;
-    uint8_t* word;
-    unsigned long long freq;
-    struct HuffmanNode* left;
-    struct HuffmanNode* right;
-} HuffmanNode;
+// Index of a missing child
+#define HUFFMAN_NO_NODE UINT32_MAX
 
-// create a HuffmanNode with the given parameters
-// !!! After use, run "HuffmanNode_freetree" if non-null !!!
-HuffmanNode* HuffmanNode_create(
-    uint8_t wordsize,
-    uint8_t* word,
-    unsigned long long freq,
-    HuffmanNode* left,
-    HuffmanNode* right
-);
+// Huffman tree in one arena of parallel arrays, nodes are referred to by index
+// Leaves have no children, inner nodes have both children
+typedef struct {
+    uint32_t size;             // Number of nodes
+    uint32_t capacity;
+    uint32_t root;
+    uint32_t* left;
+    uint32_t* right;
+    uint32_t* words;           // Word index of the leaf (see itoword)
+    unsigned long long* freqs;
+} HuffmanTree;
 
-// Recursively frees the tree of nodes
-void HuffmanNode_freetree(HuffmanNode* tree);
\ No newline at end of file
+// Creates an empty tree for capacity nodes in a single allocation
+// Returns NULL if out of memory
+// !!! After use, run "HuffmanTree_free" if non-null !!!
+HuffmanTree* HuffmanTree_create(uint32_t capacity);
+
+// Adds a node with the given parameters
+// Returns the index of the node, HUFFMAN_NO_NODE if the tree is full
+uint32_t HuffmanTree_add(HuffmanTree* tree, uint32_t word, unsigned long long freq, uint32_t left, uint32_t right);
+
+static inline int HuffmanTree_is_leaf(const HuffmanTree* tree, uint32_t node) {
+    return tree->left[node] == HUFFMAN_NO_NODE && tree->right[node] == HUFFMAN_NO_NODE;
+}
+
+void HuffmanTree_free(HuffmanTree* tree);
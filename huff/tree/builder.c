@@ -4,112 +4,96 @@
 #include <stdlib.h>
 #include <string.h>
 
-// === Keeping heap properties ===
-static void swap(HuffmanNode** a, HuffmanNode** b) {
-    HuffmanNode* temp = *a;
-    *a = *b;
-    *b = temp;
-}
-
-static unsigned int parent(unsigned int i) {
-    return (i - 1) / 2;
-}
-
-static unsigned int child_left(unsigned int i) {
-    return i * 2 + 1;
-}
+// Sorts leaves, which are all nodes of the tree, by frequency with LSD radix sort of 8 bits per pass
+// Sorting is stable, so words of equal frequencies keep their order
+// Passes over bytes which are equal in all frequencies are skipped
+static void sort_leaves(HuffmanTree* tree, uint32_t* words_tmp, unsigned long long* freqs_tmp) {
+    uint32_t count = tree->size;
+    unsigned long long all_or = 0;
+    unsigned long long all_and = ~0ull;
+    for (uint32_t i = 0; i < count; i++) {
+        all_or |= tree->freqs[i];
+        all_and &= tree->freqs[i];
+    }
 
-static unsigned int child_right(unsigned int i) {
-    return i * 2 + 2;
-}
+    for (unsigned int shift = 0; shift < 64; shift += 8) {
+        if ((((all_or ^ all_and) >> shift) & 0xFF) == 0) {
+            continue;
+        }
 
-static void heapify_up(TreeBuilder* heap, unsigned int i) {
-    HuffmanNode** nodes = heap->nodes;
+        uint32_t offsets[256] = {0};
+        for (uint32_t i = 0; i < count; i++) {
+            offsets[(tree->freqs[i] >> shift) & 0xFF]++;
+        }
+        uint32_t sum = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            uint32_t digit_count = offsets[digit];
+            offsets[digit] = sum;
+            sum += digit_count;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t pos = offsets[(tree->freqs[i] >> shift) & 0xFF]++;
+            words_tmp[pos] = tree->words[i];
+            freqs_tmp[pos] = tree->freqs[i];
+        }
 
-    while (1) {
-        if (i==0) return;
-    
-        if (nodes[parent(i)]->freq > nodes[i]->freq) {
-            swap(&nodes[parent(i)], &nodes[i]);
-            i = parent(i);
-        } else return;
+        memcpy(tree->words, words_tmp, count * sizeof(uint32_t));
+        memcpy(tree->freqs, freqs_tmp, count * sizeof(unsigned long long));
     }
 }
 
-static void heapify_down(TreeBuilder* heap, unsigned int i) {
-    HuffmanNode** nodes = heap->nodes;
-
-    while (1) {
-        if (child_left(i)>=heap->size || child_right(i)>=heap->size)
-            return;
+// Merges the two lightest nodes until one is left, it is the root
+// Merged nodes are created with non-decreasing frequencies, so the lightest node is always
+// at the front of one of the queues
+static void merge_nodes(HuffmanTree* tree) {
+    uint32_t leaves_count = tree->size;
+    uint32_t leaf_next = 0;
+    uint32_t merged_next = leaves_count;
+
+    for (uint32_t k = 0; k + 1 < leaves_count; k++) {
+        uint32_t pair[2];
+        for (int j = 0; j < 2; j++) {
+            if (leaf_next < leaves_count
+                && (merged_next == tree->size || tree->freqs[leaf_next] <= tree->freqs[merged_next])) {
+                pair[j] = leaf_next++;
+            } else {
+                pair[j] = merged_next++;
+            }
+        }
 
-        if (nodes[child_left(i)]->freq < nodes[i]->freq) {
-            swap(&nodes[child_left(i)], &nodes[i]);
-            i = child_left(i);
-        } else if (nodes[child_right(i)]->freq < nodes[i]->freq) {
-            swap(&nodes[child_right(i)], &nodes[i]);
-            i = child_right(i);
-        } else return;
+        // The lighter node is on the left, the one on the right = higher frequency
+        HuffmanTree_add(tree, 0, tree->freqs[pair[0]] + tree->freqs[pair[1]], pair[0], pair[1]);
     }
+    tree->root = tree->size - 1;
 }
-// === Keeping heap properties ===
 
-static void insert(TreeBuilder* self, HuffmanNode* node) {
-    self->nodes[self->size] = node;
-    heapify_up(self, self->size++);
-}
-
-static HuffmanNode* extract(TreeBuilder* self) {
-    if (self->size==0) {
+HuffmanTree* TreeBuilder_build(const unsigned long long* freqs, unsigned int size) {
+    uint32_t leaves_count = 0;
+    for (unsigned int i = 0; i < size; i++) {
+        if (freqs[i] != 0) leaves_count++;
+    }
+    if (leaves_count == 0) {
         return NULL;
     }
-    HuffmanNode* res = self->nodes[0];
-    swap(&self->nodes[0], &self->nodes[--self->size]);
-    heapify_down(self, 0);
-    return res;
-}
-
-// Extract all nodes in binary tree format
-static HuffmanNode* extract_tree(TreeBuilder* self) {
-    HuffmanNode* tree;
 
-    while (self->size > 1) {
-        HuffmanNode* node1 = extract(self);
-        HuffmanNode* node2 = extract(self);
+    HuffmanTree* tree = HuffmanTree_create(2*leaves_count - 1);
+    unsigned long long* sorting = (unsigned long long*)malloc(leaves_count * (sizeof(unsigned long long) + sizeof(uint32_t)));
+    if (!tree || !sorting) {
+        fprintf(stderr, "Out of memory\n");
+        if (tree) HuffmanTree_free(tree);
+        free(sorting);
+        return NULL;
+    }
 
-        // Creating determinism. Among the two nodes with the lowest frequency, the one on the right = higher frequency
-        HuffmanNode* merge_node = NULL;
-        if (node1->freq >= node2->freq) {
-            merge_node = HuffmanNode_create(0, NULL, node1->freq+node2->freq, node2, node1);
-        } else {
-            merge_node = HuffmanNode_create(0, NULL, node1->freq+node2->freq, node1, node2);
+    for (unsigned int i = 0; i < size; i++) {
+        if (freqs[i] != 0) {
+            HuffmanTree_add(tree, i, freqs[i], HUFFMAN_NO_NODE, HUFFMAN_NO_NODE);
         }
-
-        insert(self, merge_node);
     }
 
-    tree = extract(self);
+    sort_leaves(tree, (uint32_t*)(sorting + leaves_count), sorting);
+    merge_nodes(tree);
 
+    free(sorting);
     return tree;
 }
-
-
-TreeBuilder* TreeBuilder_create(unsigned int capacity) {
-    TreeBuilder* heap = (TreeBuilder*)malloc(sizeof(TreeBuilder));
-    if (heap == NULL) return NULL;
-    heap->size = 0;
-    heap->capacity = capacity;
-    heap->nodes = (HuffmanNode**)malloc(sizeof(HuffmanNode*) * capacity);
-    heap->insert = insert;
-    heap->extract_tree = extract_tree;
-    return heap;
-}
-
-
-void TreeBuilder_free(TreeBuilder* tb) {
-    for (unsigned int i = 0; i < tb->size; i++) {
-        HuffmanNode_freetree(tb->nodes[i]);
-    }
-    free(tb->nodes);
-    free(tb);
-}
\ No newline at end of file
@@ -5,19 +5,11 @@
 
 #include "../node.h"
 
-extern uint8_t wordsize;
-
-typedef struct TreeBuilder {
-    unsigned int size;
-    unsigned int capacity;
-    HuffmanNode** nodes;
-    void (*insert)(struct TreeBuilder* self, HuffmanNode* node); 
-    HuffmanNode* (*extract_tree)(struct TreeBuilder* self);      // Extract all nodes in binary tree format
-} TreeBuilder;
-
-// Create a TreeBuilder with the given capacity
-// !!! After use, run "TreeBuilder_free" if non-null !!!
-TreeBuilder* TreeBuilder_create(unsigned int capacity);
-
-// Free the TreeBuilder
-void TreeBuilder_free(TreeBuilder* tb);
\ No newline at end of file
+// Builds the Huffman tree of the words with non-zero frequency
+// Leaves are sorted by frequency once, then merged in linear time with two queues:
+// sorted leaves and merged nodes, which are created in the order of frequencies
+// Ties are resolved in favour of leaves, then of smaller word index, so the tree is deterministic
+// Word of the leaf is the index of its frequency (see itoword)
+// Returns NULL if all frequencies are zero or out of memory
+// !!! After use, run "HuffmanTree_free" if non-null !!!
+HuffmanTree* TreeBuilder_build(const unsigned long long* freqs, unsigned int size);
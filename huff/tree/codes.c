@@ -3,123 +3,254 @@
 #include <stdlib.h>
 #include <string.h>
 
-int wordtoi(const uint8_t* word) {
-    int word_ind = 0;
-    memcpy(&word_ind, word, wordsize);
-    return word_ind;
-}
+#include "../../cpu.h"
+
+typedef struct {
+    unsigned long long freq;
+    unsigned int index;
+} WordFreq;
 
 void Codes_free(Codes codes) {
-    for (size_t i = 0; i < codes.size; i++) {
-        if (codes.codes[i].size != 0) {
-            free(codes.codes[i].code);
-            codes.codes[i].size = 0;
+    free(codes.codes);
+}
+
+// Fills lengths and freqs of the leaves under the node
+// set depth = 0 to start recursion
+// Returns 0 on success, else 1
+static char collect_lengths(const HuffmanTree* tree, uint32_t node, uint8_t* lengths, WordFreq* freqs, size_t size, unsigned int depth) {
+    if (node >= tree->size || (tree->left[node] == HUFFMAN_NO_NODE) != (tree->right[node] == HUFFMAN_NO_NODE)) {
+        fprintf(stderr, "Corrupted huffman tree\n");
+        return 1;
+    }
+
+    if (tree->left[node] != HUFFMAN_NO_NODE) {
+        if (collect_lengths(tree, tree->left[node], lengths, freqs, size, depth + 1) != 0) {
+            return 1;
         }
+        return collect_lengths(tree, tree->right[node], lengths, freqs, size, depth + 1);
     }
-    free(codes.codes);
+
+    size_t word_index = tree->words[node];
+    if (word_index >= size || lengths[word_index] != 0) {
+        fprintf(stderr, "Corrupted huffman tree\n");
+        return 1;
+    }
+
+    // The tree of one leaf is encoded by the single bit
+    lengths[word_index] = depth == 0 ? 1 : (depth > UINT8_MAX ? UINT8_MAX : depth);
+    freqs[word_index].freq = tree->freqs[node];
+    freqs[word_index].index = word_index;
+    return 0;
 }
 
-void itoword(const int index, uint8_t* word) {
-    memcpy(word, &index, wordsize);
+static int compare_freqs(const void* a, const void* b) {
+    const WordFreq* fa = (const WordFreq*)a;
+    const WordFreq* fb = (const WordFreq*)b;
+    if (fa->freq != fb->freq) return fa->freq < fb->freq ? -1 : 1;
+    return fa->index < fb->index ? -1 : (fa->index > fb->index);
 }
 
-// Fills codes from Huffman tree
-// codes - list where codes will be stored
-// set curcode = 0 and codesize = 0 to start recursion
-// Returns 0 on success, else 1
-static char Codes_build_reqursion(HuffmanNode* tree, Code* codes, uint8_t* curcode, unsigned char codesize) {
-    if ((tree->left == NULL && tree->right != NULL) || (tree->left != NULL && tree->right == NULL)) {
-        fprintf(stderr, "Corrupted huffman tree\n");
+int Codes_lengths(const HuffmanTree* tree, uint8_t* lengths, size_t size, uint8_t maxlen) {
+    memset(lengths, 0, size);
+    if (!tree) return 0;
+
+    WordFreq* freqs = (WordFreq*)calloc(size, sizeof(WordFreq));
+    if (!freqs) {
+        fprintf(stderr, "Out of memory\n");
         return 1;
     }
 
-    unsigned int codesize_bytes = codesize / 8 + (codesize % 8 > 0);
+    if (collect_lengths(tree, tree->root, lengths, freqs, size, 0) != 0) {
+        free(freqs);
+        return 1;
+    }
 
-    if (tree->left == NULL && tree->right == NULL && codesize == 0 && tree->wordsize < wordsize*8) {
-        codesize_bytes = tree->wordsize / 8 + (tree->wordsize % 8 > 0);
+    size_t used_count = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (lengths[i]) freqs[used_count++] = freqs[i];
+    }
 
-        codes[(1 << (wordsize*8))].size = 1;
-        codes[(1 << (wordsize*8))].code = (uint8_t*)malloc(codesize_bytes);
-        if (!codes[(1 << (wordsize*8))].code) {
-            fprintf(stderr, "Out of memory\n");
-            return 1;
-        }
-        codes[(1 << (wordsize*8))].code[0] = 0;
-        return 0;
-    } else if (tree->left == NULL && tree->right == NULL && codesize == 0) {
-        codesize_bytes = tree->wordsize / 8 + (tree->wordsize % 8 > 0);
+    if (maxlen > CODES_MAX_LENGTH) maxlen = CODES_MAX_LENGTH;
+    while (((size_t)1 << maxlen) < used_count) maxlen++;
 
-        codes[wordtoi(tree->word)].size = 1;
-        codes[wordtoi(tree->word)].code = (uint8_t*)malloc(codesize_bytes);
-        if (!codes[wordtoi(tree->word)].code) {
-            fprintf(stderr, "Out of memory\n");
-            return 1;
-        }
-        codes[wordtoi(tree->word)].code[0] = 0;
-        return 0;
-    } else if (tree->left == NULL && tree->right == NULL) {
-        int word_index;
-        if (tree->wordsize < wordsize*8) {
-            word_index = (1 << (wordsize*8));
-        } else {
-            word_index = wordtoi(tree->word);
+    unsigned int bl_count[CODES_MAX_LENGTH+1] = {0};
+    char overflow = 0;
+    for (size_t i = 0; i < used_count; i++) {
+        uint8_t length = lengths[freqs[i].index];
+        if (length > maxlen) {
+            length = maxlen;
+            overflow = 1;
         }
+        bl_count[length]++;
+    }
 
-        if (codes[word_index].size) {
-            printf("\nWARNING: Code for word (ind %d) is already set\n", word_index);
-        }
+    if (!overflow) {
+        free(freqs);
+        return 0;
+    }
 
-        codes[word_index].size = codesize;
-        codes[word_index].code = (uint8_t*)malloc(codesize_bytes);
+    // Clamping made the code over-subscribed (Kraft sum above 1, in units of 2^-maxlen)
+    // Each step moves a leaf one level down and pairs it with a leaf from the last level
+    // This is the way zlib limits code lengths
+    unsigned long long kraft = 0;
+    for (unsigned int len = 1; len <= maxlen; len++) {
+        kraft += (unsigned long long)bl_count[len] << (maxlen - len);
+    }
+    while (kraft > (1ull << maxlen)) {
+        unsigned int bits = maxlen - 1;
+        while (bl_count[bits] == 0) bits--;
+        bl_count[bits]--;
+        bl_count[bits+1] += 2;
+        bl_count[maxlen]--;
+        kraft--;
+    }
 
-        if (!codes[word_index].code) {
-            fprintf(stderr, "Out of memory\n");
-            return 1;
-        }
-        for (unsigned int i = 0; i < codesize_bytes; i++) {
-            codes[word_index].code[i] = curcode[i];
-        }
-    } else {
-        if (Codes_build_reqursion(tree->left, codes, curcode, codesize + 1) == -1) {
-            return 1;
-        }
-        unsigned int lastbyte = codesize / 8;
-        unsigned char lastbit = codesize % 8;
-        curcode[lastbyte] += 1 << (7 - lastbit);
-        if (Codes_build_reqursion(tree->right, codes, curcode, codesize + 1) == -1) {
-            return 1;
+    // The rarest words get the longest codes
+    qsort(freqs, used_count, sizeof(WordFreq), compare_freqs);
+    size_t word_i = 0;
+    for (unsigned int len = maxlen; len > 0; len--) {
+        for (unsigned int i = 0; i < bl_count[len]; i++) {
+            lengths[freqs[word_i++].index] = len;
         }
-        curcode[lastbyte] -= 1 << (7 - lastbit);
     }
+
+    free(freqs);
     return 0;
 }
 
-
-Codes Codes_build(HuffmanNode* tree) {
+Codes Codes_build(const uint8_t* lengths, size_t size) {
     Codes codes;
-    codes.size = (1 << (wordsize*8)) + 1;
+    codes.size = size;
     codes.codes = (Code*)calloc(codes.size, sizeof(Code));
     if (!codes.codes) {
         codes.size = 0;
         fprintf(stderr, "Out of memory\n");
         return codes;
     }
-    uint8_t* curcode = (uint8_t*)calloc(2<<(wordsize*8 - 3), 1);
-    if (!curcode) {
-        codes.size = 0;
-        free(codes.codes);
-        fprintf(stderr, "Out of memory\n");
-        return codes;
+
+    unsigned int bl_count[CODES_MAX_LENGTH+1] = {0};
+    for (size_t i = 0; i < size; i++) {
+        if (lengths[i] > CODES_MAX_LENGTH) {
+            fprintf(stderr, "Corrupted code lengths\n");
+            free(codes.codes);
+            codes.size = 0;
+            return codes;
+        }
+        bl_count[lengths[i]]++;
     }
 
-    if (Codes_build_reqursion(tree, codes.codes, curcode, 0) != 0) {
-        fprintf(stderr, "Error while building codes\n");
-        free(codes.codes);
-        free(curcode);
-        codes.size = 0;
-        return codes;
+    // The first code of every length, codes of one length are consecutive
+    uint64_t next_code[CODES_MAX_LENGTH+1] = {0};
+    uint64_t code = 0;
+    long long left = 1;
+    bl_count[0] = 0;
+    for (unsigned int len = 1; len <= CODES_MAX_LENGTH; len++) {
+        code = (code + bl_count[len-1]) << 1;
+        next_code[len] = code;
+
+        left = (left << 1) - bl_count[len];
+        if (left < 0) {
+            fprintf(stderr, "Corrupted code lengths\n");
+            free(codes.codes);
+            codes.size = 0;
+            return codes;
+        }
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        if (lengths[i] == 0) continue;
+        codes.codes[i] = (next_code[lengths[i]]++ << CODE_SIZE_BITS) | lengths[i];
     }
 
-    free(curcode);
     return codes;
-}
\ No newline at end of file
+}
+
+HuffmanTree* Codes_tree(const uint8_t* lengths, size_t size) {
+    Codes codes = Codes_build(lengths, size);
+    if (codes.size == 0) {
+        return NULL;
+    }
+
+    // Every inner node has two children, except at most one node of every depth
+    // on the path of the last code, which may be missing from an incomplete code
+    size_t used_count = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (codes.codes[i] != 0) used_count++;
+    }
+    HuffmanTree* tree = HuffmanTree_create(2*used_count + CODES_MAX_LENGTH);
+    if (!tree) {
+        fprintf(stderr, "Out of memory\n");
+        Codes_free(codes);
+        return NULL;
+    }
+    tree->root = HuffmanTree_add(tree, 0, 0, HUFFMAN_NO_NODE, HUFFMAN_NO_NODE);
+
+    for (size_t i = 0; i < size; i++) {
+        Code code = codes.codes[i];
+        if (code == 0) continue;
+
+        uint32_t node = tree->root;
+        for (int bit = CODE_SIZE(code) - 1; bit >= 0; bit--) {
+            uint32_t* next = (CODE_BITS(code) >> bit) & 1 ? &tree->right[node] : &tree->left[node];
+            if (*next == HUFFMAN_NO_NODE) {
+                *next = HuffmanTree_add(tree, bit == 0 ? i : 0, 0, HUFFMAN_NO_NODE, HUFFMAN_NO_NODE);
+                if (*next == HUFFMAN_NO_NODE) {
+                    fprintf(stderr, "Corrupted code lengths\n");
+                    HuffmanTree_free(tree);
+                    Codes_free(codes);
+                    return NULL;
+                }
+            }
+            node = *next;
+        }
+    }
+
+    Codes_free(codes);
+    return tree;
+}
+
+// The accumulator is copied to local variables, so it stays in registers while words are loaded
+CPU_KERNEL_INLINE uint64_t encode(FileBufferIO* stream, const Code* codes, const uint8_t* words, size_t first, size_t end, size_t step, uint8_t wordsize) {
+    uint64_t acc = stream->acc;
+    unsigned int acc_count = stream->acc_count;
+    uint64_t bits = 0;
+
+    for (size_t i = first; i < end; i += step) {
+        Code code = codes[wordtoi(words + i*wordsize, wordsize)];
+        unsigned int size = CODE_SIZE(code);
+        if (acc_count + size > 64) {
+            stream->acc = acc;
+            stream->acc_count = acc_count;
+            flushbits(stream);
+            acc = stream->acc;
+            acc_count = stream->acc_count;
+        }
+        acc |= (CODE_BITS(code) << (64 - size)) >> acc_count;
+        acc_count += size;
+        bits += size;
+    }
+
+    stream->acc = acc;
+    stream->acc_count = acc_count;
+    return bits;
+}
+
+static uint64_t encode_generic(FileBufferIO* stream, const Code* codes, const uint8_t* words, size_t first, size_t end, size_t step, uint8_t wordsize) {
+    return wordsize == 1 ? encode(stream, codes, words, first, end, step, 1) : encode(stream, codes, words, first, end, step, 2);
+}
+
+CPU_TARGET_SSE42 static uint64_t encode_sse42(FileBufferIO* stream, const Code* codes, const uint8_t* words, size_t first, size_t end, size_t step, uint8_t wordsize) {
+    return wordsize == 1 ? encode(stream, codes, words, first, end, step, 1) : encode(stream, codes, words, first, end, step, 2);
+}
+
+CPU_TARGET_AVX2 static uint64_t encode_avx2(FileBufferIO* stream, const Code* codes, const uint8_t* words, size_t first, size_t end, size_t step, uint8_t wordsize) {
+    return wordsize == 1 ? encode(stream, codes, words, first, end, step, 1) : encode(stream, codes, words, first, end, step, 2);
+}
+
+uint64_t Codes_encode(FileBufferIO* stream, const Code* codes, const uint8_t* words, size_t first, size_t end, size_t step, uint8_t wordsize) {
+    switch (Cpu_level()) {
+        case CPU_AVX2: return encode_avx2(stream, codes, words, first, end, step, wordsize);
+        case CPU_SSE42: return encode_sse42(stream, codes, words, first, end, step, wordsize);
+        default: return encode_generic(stream, codes, words, first, end, step, wordsize);
+    }
+}
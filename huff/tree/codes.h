@@ -4,27 +4,58 @@
 #include <stdint.h>
 
 #include "../node.h"
+#include "../../buffio.h"
 
-extern uint8_t wordsize;
+// Longest code length that Codes_lengths can be limited to
+#define CODES_MAX_LENGTH 24
 
-typedef struct {
-    uint8_t* code;
-    uint8_t size;
-} Code;
+// Code of a word packed as (code bits << CODE_SIZE_BITS) | code size
+// Code bits are written to the stream starting from the most significant one
+typedef uint64_t Code;
+
+#define CODE_SIZE_BITS 6
+#define CODE_SIZE(c) ((c) & ((1 << CODE_SIZE_BITS) - 1))
+#define CODE_BITS(c) ((c) >> CODE_SIZE_BITS)
 
 typedef struct {
-    Code* codes;
+    Code* codes; // Indexed by word index, zero for words without code
     size_t size;
 } Codes;
 
-// Converts a word to its index in the codes array
-int wordtoi(const uint8_t* word);
+// Number of different words of wordsize bytes, the size of the arrays indexed by words
+#define ALPHABET_SIZE(wordsize) ((size_t)1 << ((wordsize)*8))
+
+// Converts a little-endian word of wordsize bytes (1 or 2) to its index in the codes array
+// Kernels call it with a constant wordsize, so it becomes a single load
+static inline unsigned int wordtoi(const uint8_t* word, uint8_t wordsize) {
+    return wordsize == 1 ? word[0] : (unsigned int)(word[0] | (word[1] << 8));
+}
 
-// Converts an index of the codes array to a word
-void itoword(const int index, uint8_t* word);
+// Converts an index of the codes array to a little-endian word of wordsize bytes (1 or 2)
+static inline void itoword(unsigned int index, uint8_t* word, uint8_t wordsize) {
+    word[0] = index;
+    if (wordsize == 2) word[1] = index >> 8;
+}
 
 void Codes_free(Codes codes);
 
-// Runs build_codes_reqursion
-// !!! Don't forget to free the returned string !!!
-Codes Codes_build(HuffmanNode* tree);
\ No newline at end of file
+// Fills lengths with code lengths of the tree leaves, indexed by word index
+// Codes longer than maxlen are shortened, keeping the code prefix-free
+// maxlen is raised if it can't hold all leaves of the tree
+// Returns 0 on success, else 1
+int Codes_lengths(const HuffmanTree* tree, uint8_t* lengths, size_t size, uint8_t maxlen);
+
+// Builds canonical codes from code lengths
+// Returns codes with size 0 if the lengths are corrupted
+// !!! After use, run "Codes_free" if size non-zero !!!
+Codes Codes_build(const uint8_t* lengths, size_t size);
+
+// Builds the canonical Huffman tree from code lengths, leaves hold word indices
+// Returns NULL if the lengths are corrupted or out of memory
+// !!! After use, run "HuffmanTree_free" if non-null !!!
+HuffmanTree* Codes_tree(const uint8_t* lengths, size_t size);
+
+// Writes codes of words first, first+step, ... before end of the buffer of words of wordsize bytes to the stream
+// The kernel is built for every level of cpu.h and dispatched by Cpu_level
+// Returns the number of written bits
+uint64_t Codes_encode(FileBufferIO* stream, const Code* codes, const uint8_t* words, size_t first, size_t end, size_t step, uint8_t wordsize);
@@ -0,0 +1,226 @@
+#include "lengths.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "builder.h"
+#include "codes.h"
+#include "table.h"
+
+// Alphabet of the code lengths code:
+// 0..CODES_MAX_LENGTH - the code length itself
+#define LENGTHS_REPEAT     (CODES_MAX_LENGTH + 1) // Repeat the previous length 3..6 times (2 extra bits)
+#define LENGTHS_ZEROS      (CODES_MAX_LENGTH + 2) // 3..10 zero lengths (3 extra bits)
+#define LENGTHS_ZEROS_LONG (CODES_MAX_LENGTH + 3) // 11..138 zero lengths (7 extra bits)
+#define LENGTHS_ZEROS_HUGE (CODES_MAX_LENGTH + 4) // 139..65674 zero lengths (16 extra bits)
+#define LENGTHS_ALPHABET   (CODES_MAX_LENGTH + 5)
+
+// Code lengths of the lengths code are stored in 3 bits
+#define LENGTHS_CODE_MAXLEN 7
+
+// Code lengths of the lengths code are stored in this order, so rarely used ones can be cut off
+static const uint8_t lengths_order[LENGTHS_ALPHABET] = {
+    LENGTHS_ZEROS, LENGTHS_ZEROS_LONG, LENGTHS_ZEROS_HUGE, LENGTHS_REPEAT,
+    0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24
+};
+
+typedef struct {
+    uint8_t symbol;
+    uint16_t extra;
+} LengthsSymbol;
+
+// Replaces runs of lengths with repeat codes
+// Returns the number of symbols
+static size_t lengths_rle(const uint8_t* lengths, size_t size, LengthsSymbol* symbols) {
+    size_t count = 0;
+    size_t i = 0;
+    while (i < size) {
+        uint8_t length = lengths[i];
+        size_t run_max = length == 0 ? 65674 : 7;
+        size_t run = 1;
+        if (length == 0) {
+            // Tables of 2-byte words are mostly zeros, they are skipped by 8 lengths at once
+            while (i + run + 8 <= size && run + 8 <= run_max) {
+                uint64_t next;
+                memcpy(&next, lengths + i + run, sizeof(next));
+                if (next != 0) break;
+                run += 8;
+            }
+        }
+        while (i + run < size && run < run_max && lengths[i + run] == length) run++;
+
+        if (length == 0 && run >= 139) {
+            symbols[count++] = (LengthsSymbol){LENGTHS_ZEROS_HUGE, run - 139};
+            i += run;
+        } else if (length == 0 && run >= 11) {
+            if (run > 138) run = 138;
+            symbols[count++] = (LengthsSymbol){LENGTHS_ZEROS_LONG, run - 11};
+            i += run;
+        } else if (length == 0 && run >= 3) {
+            symbols[count++] = (LengthsSymbol){LENGTHS_ZEROS, run - 3};
+            i += run;
+        } else if (length != 0 && run >= 4) {
+            symbols[count++] = (LengthsSymbol){length, 0};
+            symbols[count++] = (LengthsSymbol){LENGTHS_REPEAT, run - 4};
+            i += run;
+        } else {
+            symbols[count++] = (LengthsSymbol){length, 0};
+            i++;
+        }
+    }
+    return count;
+}
+
+static uint8_t lengths_extra_bits(uint8_t symbol) {
+    switch (symbol) {
+        case LENGTHS_REPEAT: return 2;
+        case LENGTHS_ZEROS: return 3;
+        case LENGTHS_ZEROS_LONG: return 7;
+        case LENGTHS_ZEROS_HUGE: return 16;
+        default: return 0;
+    }
+}
+
+// Writes code lengths to the stream, NULL stream only counts the bits
+// Returns the number of written bits, 0 if failed
+static size_t put_lengths(FileBufferIO* stream, const uint8_t* lengths, size_t size) {
+    LengthsSymbol* symbols = (LengthsSymbol*)malloc(sizeof(LengthsSymbol) * (size + 1));
+    if (!symbols) {
+        fprintf(stderr, "Out of memory\n");
+        return 0;
+    }
+    size_t symbols_count = lengths_rle(lengths, size, symbols);
+
+    unsigned long long freqs[LENGTHS_ALPHABET] = {0};
+    for (size_t i = 0; i < symbols_count; i++) {
+        freqs[symbols[i].symbol]++;
+    }
+
+    uint8_t code_lengths[LENGTHS_ALPHABET];
+    HuffmanTree* tree = TreeBuilder_build(freqs, LENGTHS_ALPHABET);
+    if (!tree || Codes_lengths(tree, code_lengths, LENGTHS_ALPHABET, LENGTHS_CODE_MAXLEN) != 0) {
+        if (tree) HuffmanTree_free(tree);
+        free(symbols);
+        return 0;
+    }
+    HuffmanTree_free(tree);
+
+    Codes codes = Codes_build(code_lengths, LENGTHS_ALPHABET);
+    if (codes.size == 0) {
+        free(symbols);
+        return 0;
+    }
+
+    uint8_t code_lengths_count = LENGTHS_ALPHABET;
+    while (code_lengths_count > 0 && code_lengths[lengths_order[code_lengths_count-1]] == 0) {
+        code_lengths_count--;
+    }
+
+    size_t wrote_bits = 5 + code_lengths_count*3;
+    if (stream) {
+        putbits(stream, code_lengths_count, 5);
+        for (uint8_t i = 0; i < code_lengths_count; i++) {
+            putbits(stream, code_lengths[lengths_order[i]], 3);
+        }
+    }
+
+    for (size_t i = 0; i < symbols_count; i++) {
+        Code code = codes.codes[symbols[i].symbol];
+        uint8_t extra_bits = lengths_extra_bits(symbols[i].symbol);
+        wrote_bits += CODE_SIZE(code) + extra_bits;
+        if (!stream) {
+            continue;
+        }
+
+        putbits(stream, CODE_BITS(code), CODE_SIZE(code));
+        if (extra_bits) {
+            putbits(stream, symbols[i].extra, extra_bits);
+        }
+    }
+
+    Codes_free(codes);
+    free(symbols);
+    return wrote_bits;
+}
+
+size_t Lengths_write(FileBufferIO* stream, const uint8_t* lengths, size_t size) {
+    return put_lengths(stream, lengths, size);
+}
+
+size_t Lengths_size(const uint8_t* lengths, size_t size) {
+    return put_lengths(NULL, lengths, size);
+}
+
+// Reads count bits of the stream into value
+// Returns 0 if success, else 1
+static int read_value(FileBufferIO* stream, unsigned char count, uint32_t* value) {
+    *value = peekbits(stream, count);
+    if (stream->window_count < count) return 1;
+    consumebits(stream, count);
+    return 0;
+}
+
+int Lengths_read(FileBufferIO* stream, uint8_t* lengths, size_t size) {
+    uint32_t code_lengths_count = 0;
+    if (read_value(stream, 5, &code_lengths_count) != 0 || code_lengths_count > LENGTHS_ALPHABET) {
+        fprintf(stderr, "Corrupted code lengths\n");
+        return 1;
+    }
+
+    uint8_t code_lengths[LENGTHS_ALPHABET] = {0};
+    for (uint32_t i = 0; i < code_lengths_count; i++) {
+        uint32_t code_length = 0;
+        if (read_value(stream, 3, &code_length) != 0) {
+            fprintf(stderr, "Corrupted code lengths\n");
+            return 1;
+        }
+        code_lengths[lengths_order[i]] = code_length;
+    }
+
+    DecodeTable table = DecodeTable_build(code_lengths, LENGTHS_ALPHABET);
+    if (table.size == 0) {
+        return 1;
+    }
+
+    size_t i = 0;
+    while (i < size) {
+        int32_t symbol = DecodeTable_next(&table, stream);
+        if (symbol < 0) {
+            fprintf(stderr, "Corrupted code lengths\n");
+            DecodeTable_free(table);
+            return 1;
+        }
+
+        if (symbol <= CODES_MAX_LENGTH) {
+            lengths[i++] = symbol;
+            continue;
+        }
+
+        uint32_t extra = 0;
+        if (read_value(stream, lengths_extra_bits(symbol), &extra) != 0 || (symbol == LENGTHS_REPEAT && i == 0)) {
+            fprintf(stderr, "Corrupted code lengths\n");
+            DecodeTable_free(table);
+            return 1;
+        }
+
+        uint8_t length = 0;
+        size_t run = 0;
+        switch (symbol) {
+            case LENGTHS_REPEAT: length = lengths[i-1]; run = 3 + extra; break;
+            case LENGTHS_ZEROS: run = 3 + extra; break;
+            case LENGTHS_ZEROS_LONG: run = 11 + extra; break;
+            default: run = 139 + extra; break;
+        }
+
+        if (run > size - i) {
+            fprintf(stderr, "Corrupted code lengths\n");
+            DecodeTable_free(table);
+            return 1;
+        }
+        memset(lengths + i, length, run);
+        i += run;
+    }
+
+    DecodeTable_free(table);
+    return 0;
+}
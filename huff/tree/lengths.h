@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../../buffio.h"
+
+// Writes code lengths in the compact form:
+// runs of lengths are replaced with repeat codes and coded with a small Huffman code
+// Returns the number of written bits, 0 if failed
+size_t Lengths_write(FileBufferIO* stream, const uint8_t* lengths, size_t size);
+
+// Returns the number of bits Lengths_write would write, 0 if failed
+size_t Lengths_size(const uint8_t* lengths, size_t size);
+
+// Reads code lengths written by Lengths_write
+// Returns 0 if success, else 1
+int Lengths_read(FileBufferIO* stream, uint8_t* lengths, size_t size);
@@ -0,0 +1,155 @@
+#include "table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../cpu.h"
+
+DecodeTable DecodeTable_build(const uint8_t* lengths, size_t size) {
+    DecodeTable table;
+    memset(&table, 0, sizeof(table));
+
+    Codes codes = Codes_build(lengths, size);
+    if (codes.size == 0) {
+        return table;
+    }
+
+    // Secondary table index size for every primary prefix
+    const size_t primary_size = 1 << DECODE_PRIMARY_BITS;
+    uint8_t* subbits = (uint8_t*)calloc(primary_size, sizeof(uint8_t));
+    if (!subbits) {
+        fprintf(stderr, "Out of memory\n");
+        Codes_free(codes);
+        return table;
+    }
+
+    for (size_t i = 0; i < codes.size; i++) {
+        uint8_t codesize = CODE_SIZE(codes.codes[i]);
+        if (codesize <= DECODE_PRIMARY_BITS) continue;
+
+        uint8_t extra = codesize - DECODE_PRIMARY_BITS;
+        uint32_t prefix = CODE_BITS(codes.codes[i]) >> extra;
+        if (subbits[prefix] < extra) {
+            subbits[prefix] = extra;
+        }
+    }
+
+    size_t table_size = primary_size;
+    for (size_t i = 0; i < primary_size; i++) {
+        if (subbits[i]) table_size += (size_t)1 << subbits[i];
+    }
+
+    table.entries = (uint32_t*)calloc(table_size, sizeof(uint32_t));
+    if (!table.entries) {
+        fprintf(stderr, "Out of memory\n");
+        free(subbits);
+        Codes_free(codes);
+        return table;
+    }
+
+    // Link primary prefixes of long codes to their secondary tables
+    size_t offset = primary_size;
+    for (size_t i = 0; i < primary_size; i++) {
+        if (!subbits[i]) continue;
+        table.entries[i] = (uint32_t)(offset << 7) | DECODE_ENTRY_LINK | subbits[i];
+        offset += (size_t)1 << subbits[i];
+    }
+
+    for (size_t i = 0; i < codes.size; i++) {
+        uint8_t codesize = CODE_SIZE(codes.codes[i]);
+        uint32_t code = CODE_BITS(codes.codes[i]);
+        if (codesize == 0) continue;
+
+        uint32_t entry = ((uint32_t)i << 7) | codesize;
+        if (codesize <= DECODE_PRIMARY_BITS) {
+            uint8_t fill = DECODE_PRIMARY_BITS - codesize;
+            size_t start = (size_t)code << fill;
+            for (size_t j = 0; j < ((size_t)1 << fill); j++) {
+                table.entries[start + j] = entry;
+            }
+        } else {
+            uint8_t extra = codesize - DECODE_PRIMARY_BITS;
+            uint32_t prefix = code >> extra;
+            uint8_t fill = subbits[prefix] - extra;
+            size_t start = DECODE_ENTRY_VALUE(table.entries[prefix])
+                + ((size_t)(code & ((1u << extra) - 1)) << fill);
+            for (size_t j = 0; j < ((size_t)1 << fill); j++) {
+                table.entries[start + j] = entry;
+            }
+        }
+    }
+
+    table.size = table_size;
+    free(subbits);
+    Codes_free(codes);
+    return table;
+}
+
+void DecodeTable_free(DecodeTable table) {
+    free(table.entries);
+}
+
+// Streams are copied to local variables, so their windows stay in registers while words are stored to out
+CPU_KERNEL_INLINE size_t decode_streams(const DecodeTable* table, DecodeStream* streams, uint8_t* out, size_t words_count, uint8_t wordsize) {
+    DecodeStream s0 = streams[0];
+    DecodeStream s1 = streams[1];
+    DecodeStream s2 = streams[2];
+    DecodeStream s3 = streams[3];
+
+    size_t i = 0;
+    int32_t symbols[DECODE_STREAMS] = {0};
+    for (; i + DECODE_STREAMS <= words_count; i += DECODE_STREAMS) {
+        symbols[0] = DecodeStream_next(table, &s0);
+        symbols[1] = DecodeStream_next(table, &s1);
+        symbols[2] = DecodeStream_next(table, &s2);
+        symbols[3] = DecodeStream_next(table, &s3);
+        if ((symbols[0] | symbols[1] | symbols[2] | symbols[3]) < 0) {
+            break;
+        }
+
+        for (int j = 0; j < DECODE_STREAMS; j++) {
+            itoword(symbols[j], out + (i+j)*wordsize, wordsize);
+        }
+    }
+
+    streams[0] = s0;
+    streams[1] = s1;
+    streams[2] = s2;
+    streams[3] = s3;
+
+    if (i + DECODE_STREAMS <= words_count) {
+        // A stream of the group is broken, words before it are decoded already
+        for (int j = 0; j < DECODE_STREAMS && symbols[j] >= 0; j++, i++) {
+            itoword(symbols[j], out + i*wordsize, wordsize);
+        }
+        return i;
+    }
+
+    // The last words of the block take the first streams
+    for (int j = 0; i < words_count; j++, i++) {
+        int32_t symbol = DecodeStream_next(table, &streams[j]);
+        if (symbol < 0) break;
+        itoword(symbol, out + i*wordsize, wordsize);
+    }
+    return i;
+}
+
+static size_t decode_streams_generic(const DecodeTable* table, DecodeStream* streams, uint8_t* out, size_t words_count, uint8_t wordsize) {
+    return wordsize == 1 ? decode_streams(table, streams, out, words_count, 1) : decode_streams(table, streams, out, words_count, 2);
+}
+
+CPU_TARGET_SSE42 static size_t decode_streams_sse42(const DecodeTable* table, DecodeStream* streams, uint8_t* out, size_t words_count, uint8_t wordsize) {
+    return wordsize == 1 ? decode_streams(table, streams, out, words_count, 1) : decode_streams(table, streams, out, words_count, 2);
+}
+
+CPU_TARGET_AVX2 static size_t decode_streams_avx2(const DecodeTable* table, DecodeStream* streams, uint8_t* out, size_t words_count, uint8_t wordsize) {
+    return wordsize == 1 ? decode_streams(table, streams, out, words_count, 1) : decode_streams(table, streams, out, words_count, 2);
+}
+
+size_t DecodeTable_decode_streams(const DecodeTable* table, DecodeStream* streams, uint8_t* out, size_t words_count, uint8_t wordsize) {
+    switch (Cpu_level()) {
+        case CPU_AVX2: return decode_streams_avx2(table, streams, out, words_count, wordsize);
+        case CPU_SSE42: return decode_streams_sse42(table, streams, out, words_count, wordsize);
+        default: return decode_streams_generic(table, streams, out, words_count, wordsize);
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../../buffio.h"
+#include "codes.h"
+
+// Number of bits resolved by one lookup in the primary table
+#define DECODE_PRIMARY_BITS 11
+
+// Longest code the table can resolve
+#define DECODE_MAX_CODELEN CODES_MAX_LENGTH
+
+// Table entry layout:
+//   bits 0..5  - code length (symbol entry) or secondary table index bits (link entry)
+//   bit  6     - link to a secondary table
+//   bits 7..31 - symbol (symbol entry) or secondary table offset (link entry)
+// A zero entry means that no code starts with these bits
+#define DECODE_ENTRY_LEN(e)   ((e) & 0x3F)
+#define DECODE_ENTRY_LINK     0x40
+#define DECODE_ENTRY_VALUE(e) ((e) >> 7)
+
+typedef struct {
+    uint32_t* entries;      // Primary table followed by secondary tables
+    size_t size;            // Number of entries
+} DecodeTable;
+
+// Builds the lookup table of canonical codes with the given lengths
+// Symbols are indexes of lengths
+// Returns table with size 0 if the lengths are corrupted
+// !!! After use, run "DecodeTable_free" if size non-zero !!!
+DecodeTable DecodeTable_build(const uint8_t* lengths, size_t size);
+
+void DecodeTable_free(DecodeTable table);
+
+// Decodes the next symbol of the stream
+// Returns -1 without consuming anything if the bits are not a code or the file has ended
+static inline int32_t DecodeTable_next(const DecodeTable* table, FileBufferIO* stream) {
+    uint64_t next = peekbits(stream, DECODE_MAX_CODELEN) << (64 - DECODE_MAX_CODELEN);
+
+    uint32_t entry = table->entries[next >> (64 - DECODE_PRIMARY_BITS)];
+    if (entry & DECODE_ENTRY_LINK) {
+        entry = table->entries[DECODE_ENTRY_VALUE(entry) + ((next << DECODE_PRIMARY_BITS) >> (64 - DECODE_ENTRY_LEN(entry)))];
+    }
+
+    unsigned char codesize = DECODE_ENTRY_LEN(entry);
+    if (codesize == 0 || codesize > stream->window_count) {
+        return -1;
+    }
+    consumebits(stream, codesize);
+    return DECODE_ENTRY_VALUE(entry);
+}
+
+// Reader of a code stream in memory, independent of FileBufferIO
+// Several readers are decoded in one loop, so their state must stay in local variables
+typedef struct {
+    const uint8_t* next;  // Next byte to load to the window
+    const uint8_t* end;   // Bytes after it are read as zero
+    uint64_t window;      // Next bits of the stream, starting from the most significant bit
+    unsigned int count;   // Number of real bits of the window
+} DecodeStream;
+
+static inline DecodeStream DecodeStream_init(const uint8_t* start, const uint8_t* end) {
+    DecodeStream stream = {start, end, 0, 0};
+    return stream;
+}
+
+// Returns the number of bits consumed since start
+static inline uint64_t DecodeStream_consumed(const DecodeStream* stream, const uint8_t* start) {
+    return (uint64_t)(stream->next - start) * 8 - stream->count;
+}
+
+// Loads whole bytes to the window until it has more than 56 bits or the stream ends
+static inline void DecodeStream_refill(DecodeStream* stream) {
+    if (stream->end - stream->next >= 8) {
+        uint64_t next = 0;
+        for (int i = 0; i < 8; i++) {
+            next = (next << 8) | stream->next[i];
+        }
+        stream->window |= next >> stream->count;
+        stream->next += (63 - stream->count) >> 3;
+        stream->count |= 56;
+        return;
+    }
+
+    while (stream->count <= 56 && stream->next < stream->end) {
+        stream->window |= (uint64_t)*stream->next++ << (56 - stream->count);
+        stream->count += 8;
+    }
+}
+
+// Decodes the next symbol of the stream in memory, the same way as DecodeTable_next
+// Returns -1 without consuming anything if the bits are not a code or the stream has ended
+static inline int32_t DecodeStream_next(const DecodeTable* table, DecodeStream* stream) {
+    if (stream->count < DECODE_MAX_CODELEN) DecodeStream_refill(stream);
+
+    uint32_t entry = table->entries[stream->window >> (64 - DECODE_PRIMARY_BITS)];
+    if (entry & DECODE_ENTRY_LINK) {
+        entry = table->entries[DECODE_ENTRY_VALUE(entry) + ((stream->window << DECODE_PRIMARY_BITS) >> (64 - DECODE_ENTRY_LEN(entry)))];
+    }
+
+    unsigned int codesize = DECODE_ENTRY_LEN(entry);
+    if (codesize == 0 || codesize > stream->count) {
+        return -1;
+    }
+    stream->window <<= codesize;
+    stream->count -= codesize;
+    return DECODE_ENTRY_VALUE(entry);
+}
+
+// Number of streams decoded together by DecodeTable_decode_streams
+#define DECODE_STREAMS 4
+
+// Decodes words_count words from DECODE_STREAMS streams to out, word i is taken from stream i % DECODE_STREAMS
+// Words of wordsize bytes (1 or 2) are stored as itoword does
+// The kernel is built for every level of cpu.h and dispatched by Cpu_level
+// Returns the number of decoded words, less than words_count if a stream has no code at its position
+size_t DecodeTable_decode_streams(const DecodeTable* table, DecodeStream* streams, uint8_t* out, size_t words_count, uint8_t wordsize);
@@ -0,0 +1,227 @@
+#include "lz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Matches at least this long are taken without looking at the next position
+#define LZ_LAZY_LIMIT 32
+
+// Costs are in 1/LZ_COST_SCALE bits
+#define LZ_COST_SCALE 16
+
+// Estimated bits of the length and distance bucket codes of a match, without their extra bits
+#define LZ_MATCH_CODE_BITS 10
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    uint32_t window;
+    uint32_t depth;
+    int32_t* head; // The last position of every hash, -1 - none
+    int32_t* prev; // The previous position with the same hash, by position modulo mask + 1
+    uint32_t mask;
+    unsigned int hash_bits;
+    uint32_t literal_cost; // Average cost of a literal byte of the data
+} Matcher;
+
+typedef struct {
+    uint32_t length;
+    uint32_t distance;
+    int64_t gain; // Cost of the bytes as literals minus the cost of the match
+} Match;
+
+// Returns log2(value) in cost units, the fraction is linear between powers of two
+static inline uint32_t cost_log2(uint64_t value) {
+    unsigned int high = 63 - __builtin_clzll(value);
+    uint64_t fraction = high >= 4 ? (value >> (high - 4)) & 15 : (value << (4 - high)) & 15;
+    return high * LZ_COST_SCALE + (uint32_t)(fraction * LZ_COST_SCALE / 16);
+}
+
+// Returns the order-0 entropy of a byte of the data in cost units, at least one bit
+static uint32_t literal_cost(const uint8_t* data, size_t size) {
+    if (size == 0) return LZ_COST_SCALE;
+    uint64_t counts[256] = {0};
+    for (size_t i = 0; i < size; i++) {
+        counts[data[i]]++;
+    }
+    uint64_t total = 0;
+    uint32_t size_log = cost_log2(size);
+    for (unsigned int c = 0; c < 256; c++) {
+        if (counts[c]) total += counts[c] * (size_log - cost_log2(counts[c]));
+    }
+    uint64_t cost = total / size;
+    return cost > LZ_COST_SCALE ? (uint32_t)cost : LZ_COST_SCALE;
+}
+
+// Returns the gain of a match over coding its bytes as literals, farther buckets pay for their extra bits
+static inline int64_t match_gain(const Matcher* m, uint32_t length, uint32_t distance) {
+    unsigned int length_bits, distance_bits;
+    uint32_t extra;
+    Lz_bucket(length - LZ_MIN_MATCH, &length_bits, &extra);
+    Lz_bucket(distance - 1, &distance_bits, &extra);
+    int64_t cost = (int64_t)(LZ_MATCH_CODE_BITS + length_bits + distance_bits) * LZ_COST_SCALE;
+    return (int64_t)length * m->literal_cost - cost;
+}
+
+static inline uint32_t hash4(const uint8_t* p, unsigned int hash_bits) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return (word * 2654435761u) >> (32 - hash_bits);
+}
+
+static inline void insert(Matcher* m, size_t pos) {
+    uint32_t hash = hash4(m->data + pos, m->hash_bits);
+    m->prev[pos & m->mask] = m->head[hash];
+    m->head[hash] = (int32_t)pos;
+}
+
+// Returns the length of the common prefix of a and b up to limit bytes
+static inline uint32_t common_length(const uint8_t* a, const uint8_t* b, uint32_t limit) {
+    uint32_t len = 0;
+    while (len + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + len, sizeof(x));
+        memcpy(&y, b + len, sizeof(y));
+        if (x != y) {
+            return len + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        len += 8;
+    }
+    while (len < limit && a[len] == b[len]) len++;
+    return len;
+}
+
+// Returns the match of the largest gain at the position among the candidates of its hash chain,
+// length 0 if there is none that is cheaper than literals
+static Match find_match(const Matcher* m, size_t pos) {
+    Match best = {0, 0, 0};
+    uint32_t limit = m->size - pos < LZ_MAX_MATCH ? (uint32_t)(m->size - pos) : LZ_MAX_MATCH;
+    if (limit < LZ_MIN_MATCH) return best;
+
+    const uint8_t* cur = m->data + pos;
+    int32_t cand = m->head[hash4(cur, m->hash_bits)];
+    for (uint32_t left = m->depth; cand >= 0 && left > 0; left--) {
+        if (pos - cand > m->window) break;
+
+        // Candidates only get farther, so only a longer match can have a larger gain,
+        // the byte after the best length must match to make it
+        const uint8_t* prev = m->data + cand;
+        if (prev[best.length] == cur[best.length]) {
+            uint32_t len = common_length(prev, cur, limit);
+            if (len > best.length && len >= LZ_MIN_MATCH) {
+                int64_t gain = match_gain(m, len, pos - cand);
+                if (gain > best.gain) {
+                    best.length = len;
+                    best.distance = pos - cand;
+                    best.gain = gain;
+                    if (len == limit) break;
+                }
+            }
+        }
+
+        // Links of positions out of the ring are overwritten by newer ones
+        int32_t next = m->prev[cand & m->mask];
+        if (next >= cand) break;
+        cand = next;
+    }
+
+    return best;
+}
+
+// Appends the sequence to the list
+// Returns 0 if success, else 1
+static int add_sequence(LzSequence** sequences, size_t* count, size_t* capacity, uint32_t literals, Match match) {
+    if (*count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity*2 : 1024;
+        LzSequence* items = (LzSequence*)realloc(*sequences, new_capacity * sizeof(LzSequence));
+        if (!items) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        *sequences = items;
+        *capacity = new_capacity;
+    }
+    LzSequence* seq = &(*sequences)[(*count)++];
+    seq->literals = literals;
+    seq->length = match.length;
+    seq->distance = match.distance;
+    return 0;
+}
+
+size_t Lz_parse(const uint8_t* data, size_t size, uint32_t window, uint32_t depth, LzSequence** sequences) {
+    Matcher m;
+    m.data = data;
+    m.size = size;
+    m.window = window;
+    m.depth = depth ? depth : LZ_DEPTH_DEFAULT;
+    m.literal_cost = literal_cost(data, size);
+
+    // The ring of links holds the window, both tables are small for small blocks
+    uint32_t ring = 1;
+    while (ring < window && ring < size) ring <<= 1;
+    m.mask = ring - 1;
+    m.hash_bits = 10;
+    while (m.hash_bits < 16 && ((size_t)1 << m.hash_bits) < size) m.hash_bits++;
+
+    m.head = (int32_t*)malloc(((size_t)1 << m.hash_bits) * sizeof(int32_t));
+    m.prev = (int32_t*)malloc((size_t)ring * sizeof(int32_t));
+    *sequences = NULL;
+    if (!m.head || !m.prev) {
+        fprintf(stderr, "Out of memory\n");
+        free(m.head);
+        free(m.prev);
+        return (size_t)-1;
+    }
+    memset(m.head, 0xFF, ((size_t)1 << m.hash_bits) * sizeof(int32_t));
+
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t literals_start = 0;
+    size_t pos = 0;
+    int status = 0;
+    Match next = {0, 0, 0};
+    char has_next = 0; // The match at pos is already found by the previous step
+    while (pos + LZ_MIN_MATCH <= size && status == 0) {
+        Match match = has_next ? next : find_match(&m, pos);
+        has_next = 0;
+        insert(&m, pos);
+        if (match.length == 0) {
+            pos++;
+            continue;
+        }
+
+        // A literal and a match of a larger gain at the next position are better than this match
+        if (match.length < LZ_LAZY_LIMIT && pos + 1 + LZ_MIN_MATCH <= size) {
+            next = find_match(&m, pos + 1);
+            if (next.gain > match.gain) {
+                has_next = 1;
+                pos++;
+                continue;
+            }
+        }
+
+        status = add_sequence(sequences, &count, &capacity, pos - literals_start, match);
+        size_t end = pos + match.length;
+        size_t insert_end = end + LZ_MIN_MATCH <= size ? end : size - LZ_MIN_MATCH + 1;
+        for (pos++; pos < insert_end; pos++) {
+            insert(&m, pos);
+        }
+        pos = end;
+        literals_start = pos;
+    }
+
+    if (status == 0 && (literals_start < size || count == 0)) {
+        Match none = {0, 0, 0};
+        status = add_sequence(sequences, &count, &capacity, size - literals_start, none);
+    }
+
+    free(m.head);
+    free(m.prev);
+    if (status != 0) {
+        free(*sequences);
+        *sequences = NULL;
+        return (size_t)-1;
+    }
+    return count;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Matches are from LZ_MIN_MATCH to LZ_MAX_MATCH bytes at a distance up to the window
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 65535)
+#define LZ_WINDOW_MAX (1 << 24)
+#define LZ_DEPTH_DEFAULT 16
+
+// Lengths and distances are coded by buckets, a bucket code is followed by extra bits of the value in it
+// Values below 8 have their own codes, larger ones are split by the highest two bits
+#define LZ_LENGTH_CODES 34 // Buckets of length - LZ_MIN_MATCH
+#define LZ_DISTANCE_CODES 50 // Buckets of distance - 1
+#define LZ_LITLEN_SIZE (256 + LZ_LENGTH_CODES) // Alphabet of literal bytes and length buckets
+
+// Literals followed by a match, the last sequence of a block may have no match
+typedef struct {
+    uint32_t literals;
+    uint32_t length; // 0 - no match
+    uint32_t distance;
+} LzSequence;
+
+// Returns the bucket of the value, fills the number of its extra bits and their value
+static inline unsigned int Lz_bucket(uint32_t value, unsigned int* extra_bits, uint32_t* extra) {
+    if (value < 8) {
+        *extra_bits = 0;
+        *extra = 0;
+        return value;
+    }
+    unsigned int high = 31 - __builtin_clz(value);
+    *extra_bits = high - 1;
+    *extra = value & ((1u << (high - 1)) - 1);
+    return 8 + (high - 3)*2 + ((value >> (high - 1)) & 1);
+}
+
+// Returns the smallest value of the bucket, fills the number of its extra bits
+static inline uint32_t Lz_bucket_base(unsigned int bucket, unsigned int* extra_bits) {
+    if (bucket < 8) {
+        *extra_bits = 0;
+        return bucket;
+    }
+    unsigned int high = 3 + (bucket - 8) / 2;
+    *extra_bits = high - 1;
+    return (uint32_t)(2 | ((bucket - 8) & 1)) << (high - 1);
+}
+
+// Splits size bytes of data into sequences of literals and matches in the last window bytes
+// Hash chains of 4-byte prefixes are searched for up to depth candidates at every position,
+// matches are ranked by their length minus the estimated bits of their codes and extra bits,
+// a match is taken only if the next position doesn't start a better one
+// Returns the number of sequences, they cover the whole data, (size_t)-1 if out of memory
+// !!! After use, free "sequences" if the result is not (size_t)-1 !!!
+size_t Lz_parse(const uint8_t* data, size_t size, uint32_t window, uint32_t depth, LzSequence** sequences);
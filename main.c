@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "archiver.h"
+#include "cpu.h"
 
 enum CommandType {
     HELP = 0,
@@ -17,8 +18,19 @@ enum OptionType {
     OPTION_OUTPUT = 0,
     OPTION_WORDSIZE = 1,
     OPTION_DIR = 2,
-    OPTION_DECLINEWARNING = 3,
-    OPTION_ACCEPTWARNING = 4,
+    OPTION_CODELEN = 3,
+    OPTION_BLOCK = 4,
+    OPTION_THREADS = 5,
+    OPTION_MEMORY = 6,
+    OPTION_STREAMS = 7,
+    OPTION_CPU = 8,
+    OPTION_SOLID = 9,
+    OPTION_BYEXT = 10,
+    OPTION_DEDUP = 11,
+    OPTION_LZ = 12,
+    OPTION_DEPTH = 13,
+    OPTION_FSE = 14,
+    OPTION_CONTEXT = 15,
     INVALID_OPTION
 };
 
@@ -26,12 +38,24 @@ typedef struct {
     enum CommandType cmd;
     char* archive;
     char* out;
+    char* cpu;
     char** files;
     int files_count;
     char** dirs;
     int dirs_count;
     int wordsize;
-    enum WarningAction warning_action;
+    int codelen;
+    long long block;
+    long long memory;
+    int streams;
+    int threads;
+    long long solid;
+    int byext;
+    int dedup;
+    long long lz;
+    int depth;
+    int fse;
+    int context;
 } Instruction;
 
 typedef struct Manual {
@@ -43,18 +67,29 @@ typedef struct Manual {
 
 Manual commands_manual[] = {
     {2, (const char*[]){"-help", "-h"}, "Show help information", "-help"},
-    {2, (const char*[]){"-compress", "-c"}, "Compress files", "-compress [files|dirs] [-output <file>] [-word <number>] [-dw|aw]"},
-    {2, (const char*[]){"-decompress", "-d"}, "Decompress files", "-decompress <archive> [-output <dir>] [files] [-dir <path>]"},
+    {2, (const char*[]){"-compress", "-c"}, "Compress files", "-compress [files|dirs] [-output <file|->] [-word <number|auto>] [-codelen <bits>] [-block <size>] [-memory <size>] [-streams <number>] [-solid <size> [-byext]] [-dedup] [-lz <size> [-depth <number>]] [-fse] [-context <number>] [-threads <number>] [-cpu <name>]"},
+    {2, (const char*[]){"-decompress", "-d"}, "Decompress files", "-decompress <archive> [-output <dir|->] [files] [-dir <path>] [-threads <number>] [-cpu <name>]"},
     {2, (const char*[]){"-list", "-ls"}, "Show list of files in archive. Use -dir to select dir in archive", "-list <archive> [-dir <path>]"},
     {0, NULL, NULL, NULL}
 };
 
 Manual options_manual[] = {
-    {2, (const char*[]){"-output", "-o"}, "Specify path for command", "-output <file|dir>"},
-    {2, (const char*[]){"-word", "-w"}, "Specify word size in bytes (from 1 to 2)", "-word <number>"},
+    {2, (const char*[]){"-output", "-o"}, "Specify path for command, \"-\" writes the archive to the standard output", "-output <file|dir|->"},
+    {2, (const char*[]){"-word", "-w"}, "Specify word size in bytes (from 1 to 2, default 1), auto - choose it for every file by a sample of the file", "-word <number|auto>"},
     {1, (const char*[]){"-dir"}, "Specify directory inside archive", "-dir <path>"},
-    {2, (const char*[]){"-declinewarning", "-dw"}, "Decline all warnings about small files", "-declinewarning"},
-    {2, (const char*[]){"-acceptwarning", "-aw"}, "Accept all warnings about small files", "-acceptwarning"},
+    {2, (const char*[]){"-codelen", "-cl"}, "Specify maximum huffman code length in bits (from 8 to 24, default 15 for 1-byte words and 20 for 2-byte words)", "-codelen <bits>"},
+    {2, (const char*[]){"-block", "-b"}, "Split files into independently compressed blocks of the size in bytes, suffixes K, M, G are allowed (from 1K to 1G)", "-block <size>"},
+    {2, (const char*[]){"-threads", "-t"}, "Specify number of threads for compression and decompression (from 0 to 1024, 0 - one per processor, default 1)", "-threads <number>"},
+    {2, (const char*[]){"-memory", "-m"}, "Files up to the size are read once and compressed from memory, larger files are compressed by blocks of the size, suffixes K, M, G are allowed (from 1K to 1G, default 64M)", "-memory <size>"},
+    {2, (const char*[]){"-streams", "-s"}, "Specify number of interleaved code streams of every block, 4 streams are decoded faster, 1 stream is a bit smaller (1 or 4, default 4, files under 16K always use 1)", "-streams <number>"},
+    {1, (const char*[]){"-cpu"}, "Specify instruction set the scalar compression and decompression kernels are compiled for (generic, sse4.2 or avx2, default the best supported by the processor, also set by the HUF_CPU environment variable)", "-cpu <name>"},
+    {1, (const char*[]){"-solid"}, "Pack files under 64K into solid blocks of up to the size in bytes compressed together, suffixes K, M, G are allowed (from 1K to 1G)", "-solid <size>"},
+    {1, (const char*[]){"-byext"}, "Group files of solid blocks by extension", "-byext"},
+    {1, (const char*[]){"-dedup"}, "Split files into chunks by content and store every unique chunk once, new chunks of a file are compressed together like a file, files without repeated chunks are compressed as usual, chunks are found by a 128-bit hash and reused only if their bytes are equal, earlier chunks are read again from their files, compression is single-threaded and -solid is not used", "-dedup"},
+    {1, (const char*[]){"-lz"}, "Find repeats of the data within the window of the size in bytes before Huffman coding, every block is coded so if it makes it smaller, suffixes K, M are allowed (from 1K to 16M)", "-lz <size>"},
+    {1, (const char*[]){"-depth"}, "Specify how many earlier positions are compared to find a repeat of -lz (from 1 to 4096, default 16)", "-depth <number>"},
+    {1, (const char*[]){"-fse"}, "Code blocks by tANS instead of Huffman codes if it makes them smaller, only for 1-byte words", "-fse"},
+    {1, (const char*[]){"-context"}, "Code every byte by one of up to the number of tables chosen by the previous byte if it makes blocks smaller, only for 1-byte words (from 2 to 64)", "-context <number>"},
     {0, NULL, NULL, NULL}
 };
 
@@ -92,6 +127,25 @@ void strlwr(char* s) {
     for (; *s; s++) *s = asciitolower(*s);
 }
 
+// Parses size in bytes with an optional suffix K, M or G
+// Returns -1 if the size is invalid
+long long parse_size(const char* s) {
+    char* end = NULL;
+    long long size = strtoll(s, &end, 10);
+    if (end == s || size < 0) {
+        return -1;
+    }
+
+    switch (asciitolower(*end)) {
+        case '\0': return size;
+        case 'k': size <<= 10; break;
+        case 'm': size <<= 20; break;
+        case 'g': size <<= 30; break;
+        default: return -1;
+    }
+    return end[1] == '\0' ? size : -1;
+}
+
 int check_flag(const char* flag, const char** aliases, int aliases_count) {
     char* lower_command = (char*)malloc(strlen(flag) + 1);
     if (!lower_command) {
@@ -111,18 +165,17 @@ int check_flag(const char* flag, const char** aliases, int aliases_count) {
     return 0;
 }
 
-void free_instruction(Instruction ins) {
-    if (ins.dirs) {
-        free(ins.dirs);
-    }
+// Frees the lists of the instruction, they are left NULL, so the instruction can still be returned
+void free_instruction(Instruction* ins) {
+    free(ins->dirs);
+    ins->dirs = NULL;
 
-    if (ins.files) {
-        free(ins.files);
-    }
+    free(ins->files);
+    ins->files = NULL;
 }
 
 Instruction parse_instruction(int argc, char** argv) {
-    Instruction ins = {INVALID_COMMAND, NULL, NULL, NULL, 0, NULL, 0, 1, WARN_ACT_ASK};
+    Instruction ins = {INVALID_COMMAND, NULL, NULL, NULL, NULL, 0, NULL, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0};
 
     ins.files = (char**)malloc(argc * sizeof(char*));
     if (!ins.files) {
@@ -147,7 +200,7 @@ Instruction parse_instruction(int argc, char** argv) {
             return ins;
         } else if (check == -1) {
             ins.cmd = PARSER_ERROR;
-            free_instruction(ins);
+            free_instruction(&ins);
             return ins;
         }
 
@@ -156,14 +209,14 @@ Instruction parse_instruction(int argc, char** argv) {
             if (ins.cmd != INVALID_COMMAND) {
                 fprintf(stderr, "Only one command can be specified\n");
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
             ins.cmd = COMPRESS;
             continue;
         } else if (check == -1) {
             ins.cmd = PARSER_ERROR;
-            free_instruction(ins);
+            free_instruction(&ins);
             return ins;
         }
 
@@ -172,14 +225,14 @@ Instruction parse_instruction(int argc, char** argv) {
             if (ins.cmd != INVALID_COMMAND) {
                 fprintf(stderr, "Only one command can be specified\n");
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
 
             if (argc <= i+1) {
                 fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
 
@@ -190,7 +243,7 @@ Instruction parse_instruction(int argc, char** argv) {
             continue;
         } else if (check == -1) {
             ins.cmd = PARSER_ERROR;
-            free_instruction(ins);
+            free_instruction(&ins);
             return ins;
         }
 
@@ -199,13 +252,13 @@ Instruction parse_instruction(int argc, char** argv) {
             if (ins.cmd != INVALID_COMMAND) {
                 fprintf(stderr, "Only one command can be specified\n");
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
             if (argc <= i+1) {
                 fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
             ins.cmd = LIST;
@@ -214,7 +267,7 @@ Instruction parse_instruction(int argc, char** argv) {
             continue;
         } else if (check == -1) {
             ins.cmd = PARSER_ERROR;
-            free_instruction(ins);
+            free_instruction(&ins);
             return ins;
         }
 
@@ -223,7 +276,7 @@ Instruction parse_instruction(int argc, char** argv) {
             if (argc <= i+1) {
                 fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
             ins.out = argv[i+1];
@@ -231,7 +284,7 @@ Instruction parse_instruction(int argc, char** argv) {
             continue;
         } else if (check == -1) {
             ins.cmd = PARSER_ERROR;
-            free_instruction(ins);
+            free_instruction(&ins);
             return ins;
         }
 
@@ -240,15 +293,17 @@ Instruction parse_instruction(int argc, char** argv) {
             if (argc <= i+1) {
                 fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
 
-            int parse_wordsize = atoi(argv[i+1]);
-            if (parse_wordsize < 1 || parse_wordsize>2) {
-                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 1 to 2\n", argv[i]);
+            // 0 - the word size is chosen for every file
+            char is_auto = strcmp(argv[i+1], "auto") == 0;
+            int parse_wordsize = is_auto ? 0 : atoi(argv[i+1]);
+            if (!is_auto && (parse_wordsize < 1 || parse_wordsize>2)) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 1 to 2, auto\n", argv[i]);
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
 
@@ -257,66 +312,318 @@ Instruction parse_instruction(int argc, char** argv) {
             continue;
         } else if (check == -1) {
             ins.cmd = PARSER_ERROR;
-            free_instruction(ins);
+            free_instruction(&ins);
             return ins;
         }
 
-        check = check_flag(argv[i], options_manual[OPTION_DIR].aliases, options_manual[OPTION_DIR].aliases_count);
+        check = check_flag(argv[i], options_manual[OPTION_CODELEN].aliases, options_manual[OPTION_CODELEN].aliases_count);
         if (check == 1) {
             if (argc <= i+1) {
                 fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
 
-            for (int j = 0; j < ins.dirs_count; j++) {
-                if (strcmp(ins.dirs[j], argv[i+1]) == 0) {
-                    fprintf(stderr, "Directory \"%s\" is specified twice\n", argv[i+1]);
-                    ins.cmd = PARSER_ERROR;
-                    free_instruction(ins);
-                    return ins;
-                }
+            int parse_codelen = atoi(argv[i+1]);
+            if (parse_codelen < 8 || parse_codelen > 24) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 8 to 24\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
             }
 
-            ins.dirs[ins.dirs_count++] = argv[i+1];
+            ins.codelen = parse_codelen;
+            i += 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_BLOCK].aliases, options_manual[OPTION_BLOCK].aliases_count);
+        if (check == 1) {
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            long long parse_block = parse_size(argv[i+1]);
+            if (parse_block < (1 << 10) || parse_block > (1 << 30)) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 1K to 1G\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            ins.block = parse_block;
+            i += 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_MEMORY].aliases, options_manual[OPTION_MEMORY].aliases_count);
+        if (check == 1) {
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            long long parse_memory = parse_size(argv[i+1]);
+            if (parse_memory < (1 << 10) || parse_memory > (1 << 30)) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 1K to 1G\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            ins.memory = parse_memory;
+            i += 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_STREAMS].aliases, options_manual[OPTION_STREAMS].aliases_count);
+        if (check == 1) {
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            int parse_streams = atoi(argv[i+1]);
+            if (parse_streams != 1 && parse_streams != 4) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: 1, 4\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            ins.streams = parse_streams;
+            i += 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_SOLID].aliases, options_manual[OPTION_SOLID].aliases_count);
+        if (check == 1) {
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            long long parse_solid = parse_size(argv[i+1]);
+            if (parse_solid < (1 << 10) || parse_solid > (1 << 30)) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 1K to 1G\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            ins.solid = parse_solid;
+            i += 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_BYEXT].aliases, options_manual[OPTION_BYEXT].aliases_count);
+        if (check == 1) {
+            ins.byext = 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_DEDUP].aliases, options_manual[OPTION_DEDUP].aliases_count);
+        if (check == 1) {
+            ins.dedup = 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_LZ].aliases, options_manual[OPTION_LZ].aliases_count);
+        if (check == 1) {
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            long long parse_lz = parse_size(argv[i+1]);
+            if (parse_lz < (1 << 10) || parse_lz > (1 << 24)) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 1K to 16M\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            ins.lz = parse_lz;
+            i += 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_DEPTH].aliases, options_manual[OPTION_DEPTH].aliases_count);
+        if (check == 1) {
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            char* end = NULL;
+            long parse_depth = strtol(argv[i+1], &end, 10);
+            if (end == argv[i+1] || *end != '\0' || parse_depth < 1 || parse_depth > 4096) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 1 to 4096\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            ins.depth = parse_depth;
+            i += 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_FSE].aliases, options_manual[OPTION_FSE].aliases_count);
+        if (check == 1) {
+            ins.fse = 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_CONTEXT].aliases, options_manual[OPTION_CONTEXT].aliases_count);
+        if (check == 1) {
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            char* end = NULL;
+            long parse_context = strtol(argv[i+1], &end, 10);
+            if (end == argv[i+1] || *end != '\0' || parse_context < 2 || parse_context > 64) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 2 to 64\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            ins.context = parse_context;
             i += 1;
             continue;
         } else if (check == -1) {
             ins.cmd = PARSER_ERROR;
-            free_instruction(ins);
+            free_instruction(&ins);
             return ins;
         }
 
-        check = check_flag(argv[i], options_manual[OPTION_DECLINEWARNING].aliases, options_manual[OPTION_DECLINEWARNING].aliases_count);
+        check = check_flag(argv[i], options_manual[OPTION_CPU].aliases, options_manual[OPTION_CPU].aliases_count);
         if (check == 1) {
-            if (ins.warning_action != WARN_ACT_ASK) {
-                fprintf(stderr, "Only one warning option can be specified\n");
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
-            ins.warning_action = WARN_ACT_DECLINE;
+            ins.cpu = argv[i+1];
+            i += 1;
             continue;
         } else if (check == -1) {
             ins.cmd = PARSER_ERROR;
-            free_instruction(ins);
+            free_instruction(&ins);
             return ins;
         }
 
-        check = check_flag(argv[i], options_manual[OPTION_ACCEPTWARNING].aliases, options_manual[OPTION_ACCEPTWARNING].aliases_count);
+        check = check_flag(argv[i], options_manual[OPTION_THREADS].aliases, options_manual[OPTION_THREADS].aliases_count);
         if (check == 1) {
-            if (ins.warning_action != WARN_ACT_ASK) {
-                fprintf(stderr, "Only one warning option can be specified\n");
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
-            ins.warning_action = WARN_ACT_ACCEPT;
+
+            char* end = NULL;
+            long parse_threads = strtol(argv[i+1], &end, 10);
+            if (end == argv[i+1] || *end != '\0' || parse_threads < 0 || parse_threads > 1024) {
+                fprintf(stderr, "Option \"%s\" can take only one of the following values: from 0 to 1024\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            ins.threads = parse_threads;
+            i += 1;
             continue;
         } else if (check == -1) {
             ins.cmd = PARSER_ERROR;
-            free_instruction(ins);
+            free_instruction(&ins);
+            return ins;
+        }
+
+        check = check_flag(argv[i], options_manual[OPTION_DIR].aliases, options_manual[OPTION_DIR].aliases_count);
+        if (check == 1) {
+            if (argc <= i+1) {
+                fprintf(stderr, "Option \"%s\" requires 1 argument\n", argv[i]);
+                ins.cmd = PARSER_ERROR;
+                free_instruction(&ins);
+                return ins;
+            }
+
+            for (int j = 0; j < ins.dirs_count; j++) {
+                if (strcmp(ins.dirs[j], argv[i+1]) == 0) {
+                    fprintf(stderr, "Directory \"%s\" is specified twice\n", argv[i+1]);
+                    ins.cmd = PARSER_ERROR;
+                    free_instruction(&ins);
+                    return ins;
+                }
+            }
+
+            ins.dirs[ins.dirs_count++] = argv[i+1];
+            i += 1;
+            continue;
+        } else if (check == -1) {
+            ins.cmd = PARSER_ERROR;
+            free_instruction(&ins);
             return ins;
         }
 
@@ -324,7 +631,7 @@ Instruction parse_instruction(int argc, char** argv) {
             if (strcmp(ins.files[i], argv[i]) == 0) {
                 fprintf(stderr, "File \"%s\" is specified twice\n", argv[i]);
                 ins.cmd = PARSER_ERROR;
-                free_instruction(ins);
+                free_instruction(&ins);
                 return ins;
             }
         }
@@ -346,43 +653,62 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (Cpu_init(ins.cpu) != 0) {
+        free_instruction(&ins);
+        return 1;
+    }
+
     if (ins.cmd == HELP) {
         command_help(argv[0]);
     } else if (ins.cmd == COMPRESS) {
-        wordsize = ins.wordsize;
-        compress_warn_act = ins.warning_action;
+        ArchiverOptions options;
+        options.wordsize = ins.wordsize;
+        options.codelen_max = ins.codelen;
+        options.block_size = ins.block;
+        options.memory_limit = ins.memory;
+        options.streams = ins.streams;
+        options.solid_size = ins.solid;
+        options.solid_by_ext = ins.byext;
+        options.dedup = ins.dedup;
+        options.lz_window = ins.lz;
+        options.lz_depth = ins.depth;
+        options.fse = ins.fse;
+        options.context_tables = ins.context;
+        options.threads = ins.threads;
 
         int flag;
         if (!ins.out) {
-            flag = compress(ins.files, ins.files_count, "archive.huff");
+            flag = compress(ins.files, ins.files_count, "archive.huff", &options);
         } else {
-            flag = compress(ins.files, ins.files_count, ins.out);
+            flag = compress(ins.files, ins.files_count, ins.out, &options);
         }
 
         if (flag != 0) {
             fprintf(stderr, "Compression canceled\n");
-            free_instruction(ins);
+            free_instruction(&ins);
             return 1;
         }
     } else if (ins.cmd == DECOMPRESS) {
-        wordsize = ins.wordsize;
+        ArchiverOptions options;
+        memset(&options, 0, sizeof(options));
+        options.threads = ins.threads;
 
         int flag;
         if (!ins.out) {
-            flag = decompress(ins.archive, ".", ins.files, ins.files_count, ins.dirs, ins.dirs_count);
+            flag = decompress(ins.archive, ".", ins.files, ins.files_count, ins.dirs, ins.dirs_count, &options);
         } else {
-            flag = decompress(ins.archive, ins.out, ins.files, ins.files_count, ins.dirs, ins.dirs_count);
+            flag = decompress(ins.archive, ins.out, ins.files, ins.files_count, ins.dirs, ins.dirs_count, &options);
         }
 
         if (flag) {
             fprintf(stderr, "Decompression canceled\n");
-            free_instruction(ins);
+            free_instruction(&ins);
             return 1;
         }
     } else if (ins.cmd == LIST) {
         if (ins.archive == NULL) {
             fprintf(stderr, "Archive not specified\n");
-            free_instruction(ins);
+            free_instruction(&ins);
             return 1;
         }
 
@@ -395,16 +721,16 @@ int main(int argc, char* argv[]) {
 
         if (flag) {
             fprintf(stderr, "Showing files canceled\n");
-            free_instruction(ins);
+            free_instruction(&ins);
             return 1;
         }
     } else {
         fprintf(stderr, "Invalid command, check avaiable commands with:\n");
         fprintf(stderr, "  %s -help\n", argv[0]);
-        free_instruction(ins);
+        free_instruction(&ins);
         return 1;
     }
 
-    free_instruction(ins);
+    free_instruction(&ins);
     return 0;
 }
\ No newline at end of file
@@ -3,18 +3,14 @@
 
 #include "progbar.h"
 
-static int current_percent = -1;
-static unsigned long long limit = 1;
-static unsigned long long value = 1;
-
-static void pg_print() {
+static void pg_print(ProgressBar* pg) {
     int fill_count = 40;
     int max = 100;
-    int percent = (max*value) / limit;
-    if (current_percent == percent) {
+    int percent = (max*pg->value) / pg->limit;
+    if (pg->current_percent == percent) {
         return;
     }
-    current_percent = percent;
+    pg->current_percent = percent;
 
     printf("\r");
     if (percent < 0) {
@@ -32,24 +28,28 @@ static void pg_print() {
         printf("-");
     }
     printf("] %3d%%", percent);
-    //printf(" %lld/%lld", value, limit);
+    //printf(" %lld/%lld", pg->value, pg->limit);
     fflush(stdout);
 }
 
-void pg_update(long long delta) {
-    value += delta;
-    pg_print();
+void pg_update(ProgressBar* pg, long long delta) {
+    pthread_mutex_lock(&pg->lock);
+    pg->value += delta;
+    pg_print(pg);
+    pthread_mutex_unlock(&pg->lock);
 }
 
-void pg_init(long long lim, long long start_value) {
-    limit = lim;
-    value = start_value;
-    pg_print();
+void pg_init(ProgressBar* pg, long long lim, long long start_value) {
+    pthread_mutex_init(&pg->lock, NULL);
+    pg->current_percent = -1;
+    pg->limit = lim > 0 ? lim : 1;
+    pg->value = start_value;
+    pg_print(pg);
 }
 
-void pg_end() {
-    value = limit;
-    pg_print();
-    current_percent = -1;
+void pg_end(ProgressBar* pg) {
+    pg->value = pg->limit;
+    pg_print(pg);
     printf("\n");
-}
\ No newline at end of file
+    pthread_mutex_destroy(&pg->lock);
+}
@@ -1,7 +1,16 @@
 #pragma once
 
-void pg_update(long long delta);
+#include <pthread.h>
 
-void pg_init(long long limit, long long start_value);
+typedef struct {
+    pthread_mutex_t lock; // Progress may be updated from several threads
+    int current_percent;
+    unsigned long long limit;
+    unsigned long long value;
+} ProgressBar;
 
-void pg_end();
\ No newline at end of file
+void pg_update(ProgressBar* pg, long long delta);
+
+void pg_init(ProgressBar* pg, long long limit, long long start_value);
+
+void pg_end(ProgressBar* pg);
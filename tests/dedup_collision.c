@@ -0,0 +1,131 @@
+// Writes two files of one chunk that differ in their first 16 bytes and have equal fingerprints
+// Usage: dedup_collision <first> <second>
+// The first words of both files take the lanes of Chunk_fingerprint to the same state:
+// the second word fixes the sum in the h2 lane, then the xor in the h1 lane is met by solving
+// z ^ (z + e) = d, random first words of the second file are tried until it has a solution
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../dedup.h"
+
+#define FILE_SIZE CHUNK_MIN
+
+#define M1 0x87c37b91114253d5ull
+#define M2 0x4cf5ad432745937full
+
+static inline uint64_t rotl64(uint64_t x, unsigned int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Inverse of an odd number modulo 2^64 by Newton's iterations
+static uint64_t inverse(uint64_t a) {
+    uint64_t x = a;
+    for (int i = 0; i < 6; i++) x *= 2 - a * x;
+    return x;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Lanes of Chunk_fingerprint after the word
+static void step(uint64_t* h1, uint64_t* h2, uint64_t word) {
+    *h1 = rotl64(*h1 ^ (word * M1), 31) * M2;
+    *h2 = rotl64(*h2 + (word * M2), 27) * M1 + *h1;
+}
+
+// Finds z with z ^ (z + e) == d, carries of the sum are d ^ e
+// The next carry is the majority of z_k, e_k and c_k: it must be e_k where e_k equals c_k,
+// elsewhere it is z_k, so z takes the next carries there
+// Returns 0 if success, else 1
+static int solve_xor_add(uint64_t e, uint64_t d, uint64_t* z) {
+    const uint64_t low = ~0ull >> 1; // The carry out of the highest bit is dropped
+    uint64_t carries = d ^ e;
+    uint64_t next = carries >> 1;
+    if ((carries & 1) || (~(e ^ carries) & (next ^ e) & low)) return 1;
+    *z = next & (e ^ carries) & low;
+    return 0;
+}
+
+static int write_file(const char* path, const uint8_t* data) {
+    FILE* fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return 1;
+    }
+    size_t wrote = fwrite(data, 1, FILE_SIZE, fp);
+    if (fclose(fp) != 0 || wrote != FILE_SIZE) {
+        fprintf(stderr, "Error while writing %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <first> <second>\n", argv[0]);
+        return 1;
+    }
+
+    static uint8_t first[FILE_SIZE];
+    static uint8_t second[FILE_SIZE];
+    uint64_t seed = 0x48554644;
+    for (size_t i = 0; i < FILE_SIZE; i += 8) {
+        uint64_t word = next_random(&seed);
+        memcpy(first + i, &word, sizeof(word));
+    }
+    memcpy(second, first, FILE_SIZE);
+
+    const uint64_t m1_inverse = inverse(M1);
+    const uint64_t m2_inverse = inverse(M2);
+    uint64_t words[2][2];
+    uint64_t h1[2], h2[2];
+    for (int f = 0; f < 2; f++) {
+        words[f][0] = next_random(&seed);
+        h1[f] = 0x9e3779b97f4a7c15ull ^ FILE_SIZE;
+        h2[f] = 0xc2b2ae3d27d4eb4full ^ FILE_SIZE;
+        step(&h1[f], &h2[f], words[f][0]);
+    }
+
+    // The first word of the first file stays, the second file tries new ones
+    char found = 0;
+    for (uint64_t tries = 0; tries < (1ull << 32) && !found; tries++) {
+        if (tries > 0) {
+            words[1][0] = next_random(&seed);
+            h1[1] = 0x9e3779b97f4a7c15ull ^ FILE_SIZE;
+            h2[1] = 0xc2b2ae3d27d4eb4full ^ FILE_SIZE;
+            step(&h1[1], &h2[1], words[1][0]);
+        }
+
+        // Equal h2 sums need w1' = w1 + (h2 - h2') / M2, so w1' * M1 = w1 * M1 + e
+        uint64_t shift = (h2[0] - h2[1]) * m2_inverse;
+        uint64_t z;
+        if (solve_xor_add(shift * M1, h1[0] ^ h1[1], &z) != 0) {
+            continue;
+        }
+        words[0][1] = z * m1_inverse;
+        words[1][1] = words[0][1] + shift;
+        found = 1;
+    }
+    if (!found) {
+        fprintf(stderr, "No collision found\n");
+        return 1;
+    }
+
+    memcpy(first, words[0], sizeof(words[0]));
+    memcpy(second, words[1], sizeof(words[1]));
+    uint64_t fingerprint[2][2];
+    Chunk_fingerprint(first, FILE_SIZE, fingerprint[0]);
+    Chunk_fingerprint(second, FILE_SIZE, fingerprint[1]);
+    if (memcmp(fingerprint[0], fingerprint[1], sizeof(fingerprint[0])) != 0 || memcmp(first, second, FILE_SIZE) == 0
+        || Chunk_cut(first, FILE_SIZE) != FILE_SIZE) {
+        fprintf(stderr, "The files don't collide\n");
+        return 1;
+    }
+
+    return write_file(argv[1], first) || write_file(argv[2], second);
+}